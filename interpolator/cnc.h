@@ -3,22 +3,46 @@
 #include "math.h"
 #include "arm_math.h"
 
+//X, Y and Z, then the rotary axes A, B and C: build with -DAXES_COUNT=4 to 6 to drive them
+#ifndef AXES_COUNT
+#define AXES_COUNT 3
+#endif
+#if AXES_COUNT < 3 || AXES_COUNT > 6
+#error "AXES_COUNT goes from 3 to 6"
+#endif
+
+enum {
+    AXIS_X = 0,
+    AXIS_Y = 1,
+    AXIS_Z = 2,
+    AXIS_A = 3,
+    AXIS_B = 4,
+    AXIS_C = 5
+};
+
+//maxSpeed in mm/min, maxAcceleration in mm/s^2, degrees instead of mm for the rotary axes
 typedef struct __attribute__((__packed__)) {
-    uint32_t stepsPerMillimeter, maxSpeed, maxAcceleration, clockFrequency;
+    uint32_t stepsPerMillimeter, maxSpeed, maxAcceleration;
+} axis_parameters_t;
+
+typedef struct __attribute__((__packed__)) {
+    axis_parameters_t axes[AXES_COUNT];
+    uint32_t clockFrequency;
 } parameters_t;
 
 typedef struct __attribute__((__packed__)) {
-    int32_t x, y, z, speed;
+    int32_t axes[AXES_COUNT];
+    int32_t speed;
 } position_t;
 
 typedef struct __attribute__((__packed__)) {
-    int32_t x, y, z;
+    int32_t axes[AXES_COUNT];
 } offset_t;
 
+//bit n is about axis n, its direction bit is set when the axis value increases
 typedef struct __attribute__((packed)) {
-    uint8_t xStep, xDirection;
-    uint8_t yStep, yDirection;
-    uint8_t zStep, zDirection;
+    uint8_t steps;
+    uint8_t directions;
 } axes_t;
 
 typedef struct {
@@ -59,6 +83,9 @@ typedef struct {
     int limitZ: 1;
     int limitX: 1;
     int limitY: 1;
+    int limitA: 1;
+    int limitB: 1;
+    int limitC: 1;
 } __attribute__((packed)) spi_input_t;
 
 typedef union {
@@ -70,13 +97,14 @@ typedef struct {
     position_t position;
     offset_t workOffset;
     parameters_t parameters;
-    int xHomed;
-    int yHomed;
-    int zHomed;
+    //bit n is set once axis n has been homed
+    uint8_t homedAxes;
     uint16_t state;
     int32_t lastEvent[4];
     step_t currentStep;
     uint64_t tick;
+    //steps that moved at least an axis
+    uint32_t executedSteps;
     spi_output_t spiOutput;
     uint8_t unfilteredSpiInput;
     spi_input_t spiInput;
@@ -106,6 +134,73 @@ enum {
     EXIT_MANUAL_MODE = 5
 };
 
+//referenced from worker.js
+typedef enum {
+    PROGRAM_STEPS = 0,
+    PROGRAM_START_SPINDLE = 1,
+    PROGRAM_STOP_SPINDLE = 2,
+    PROGRAM_START_SOCKET = 3,
+    PROGRAM_STOP_SOCKET = 4,
+    //run-length and varint encoded steps, see nextCompressedProgramStep()
+    PROGRAM_COMPRESSED_STEPS = 5,
+    //linear segments with their speed profile, interpolated in planner.c
+    PROGRAM_SEGMENTS = 6,
+    //4 bytes records for more than 3 axes: the duration, then the step mask and the direction mask
+    PROGRAM_WIDE_STEPS = 7,
+    //PROGRAM_COMPRESSED_STEPS with the step mask in the axes byte, followed by the direction mask
+    PROGRAM_COMPRESSED_WIDE_STEPS = 8
+} program_type_t;
+
+//what the superloop of main() is running, see enterLoopSection()
+typedef enum {
+    LOOP_SPI = 0,
+    LOOP_SPI_PERIODIC = 1,
+    LOOP_BULK_RECEPTION = 2,
+    LOOP_CREDITS = 3,
+    LOOP_TELEMETRY = 4,
+    LOOP_PROGRAM_START = 5,
+    LOOP_RUN = 6,
+    LOOP_STORAGE = 7
+} loop_section_t;
+
+#define LOOP_SECTIONS 8
+
+//the interrupt handlers whose cycles are accounted, see beginInterruptProfile()
+typedef enum {
+    ISR_SYSTICK = 0,
+    ISR_USB = 1,
+    ISR_STEP_TIMER = 2,
+    ISR_STEP_DMA = 3,
+    ISR_SPI_DMA = 4
+} profiled_interrupt_t;
+
+#define PROFILED_INTERRUPTS 5
+
+typedef struct {
+    uint64_t totalCycles;
+    uint32_t calls;
+    uint32_t maxCycles;
+} cycle_account_t;
+
+//the loop sections don't count the cycles of the interrupts that preempted them
+typedef struct {
+    //since the reset
+    uint64_t elapsedCycles;
+    cycle_account_t sections[LOOP_SECTIONS];
+    cycle_account_t interrupts[PROFILED_INTERRUPTS];
+} cycle_profile_t;
+
+#define STEP_JITTER_BINS 16
+
+//lateness of the TIM3 step edges in core cycles, see profiling.c
+typedef struct {
+    uint32_t edges;
+    uint32_t worstLatency;
+    //loop_section_t
+    uint32_t worstSection;
+    uint32_t bins[STEP_JITTER_BINS];
+} step_jitter_t;
+
 //http://www.chiark.greenend.org.uk/~sgtatham/coroutines.html
 
 #define crBegin static int state=0; switch(state) { default:break; case 0:
@@ -119,6 +214,11 @@ enum {
 #define crYieldUntil(value, predicate) while(!(predicate)) {crYield(value);}
 #define crYieldVoidUntil(predicate) while(!(predicate)) {crYield();}
 
+//build with -DSTEP_DMA=1 to have the program steps played by DMA from a table of GPIO words
+#ifndef STEP_DMA
+#define STEP_DMA 0
+#endif
+
 #define INTERRUPT_PACKET_SIZE         24
 #define INTERRUPT_ENDPOINT_NUM        1
 #define INTERRUPT_ENDPOINT_DIR        EP_IN
@@ -129,6 +229,27 @@ enum {
 #define BULK_ENDPOINT_DIR             EP_OUT
 #define BULK_ENDPOINT                 (BULK_ENDPOINT_DIR|BULK_ENDPOINT_NUM)
 
+#define TELEMETRY_PACKET_SIZE         64
+#define TELEMETRY_ENDPOINT_NUM        2
+#define TELEMETRY_ENDPOINT_DIR        EP_IN
+#define TELEMETRY_ENDPOINT            (TELEMETRY_ENDPOINT_DIR|TELEMETRY_ENDPOINT_NUM)
+
+//the 64KB core coupled memory at 0x10000000, only the CPU reaches it, no DMA buffer can go there
+//CCM_RAM_SECTION=1 when the linker script keeps the .ccmram section there, uninitialized, for example:
+//  MEMORY { CCMRAM (rw) : ORIGIN = 0x10000000, LENGTH = 64K }
+//  SECTIONS { .ccmram (NOLOAD) : { *(.ccmram) } >CCMRAM }
+//without it, ld would place the orphan section where it sees fit, in the SRAM and the flash image
+#ifndef CCM_RAM_SECTION
+#define CCM_RAM_SECTION               0
+#endif
+#define CCM_RAM_SIZE                  0x10000
+#ifndef CCM_RAM
+#define CCM_RAM                       __attribute__((section(".ccmram")))
+#endif
+
+//SysTick frequency, cncMemory.tick unit
+#define TICK_FREQUENCY                100000
+
 extern volatile cnc_memory_t cncMemory;
 
 extern uint32_t isEmergencyStopped();
@@ -139,10 +260,44 @@ extern void initUSB();
 
 extern int startHoming();
 
+extern int setParameters(const parameters_t *parameters);
+
+extern int parametersAreValid(const parameters_t *parameters);
+
+extern void loadSettings();
+
+extern void saveSettingsIfChanged();
+
+extern void savePosition();
+
 extern int32_t readFromProgram(uint32_t count, uint8_t *array);
 
+extern int32_t peekFromProgram(uint32_t offset, uint8_t *byte);
+
+extern uint32_t remainingProgramLength();
+
+extern void skipFromProgram(uint32_t count);
+
+extern void skipReceivedProgram();
+
+extern void beginProgram(program_type_t type, uint32_t programID);
+
+extern int peekNextProgram(program_type_t *type, uint32_t *programID);
+
+extern void enterNextProgram();
+
+extern uint32_t playedProgramID();
+
 extern void checkProgramEnd();
 
+extern void resetSegmentInterpolator();
+
+extern int segmentInterpolatorIsEmpty();
+
+extern uint32_t segmentInterpolatorPendingSteps();
+
+extern step_t nextSegmentStep();
+
 extern uint8_t *cncGetCfgDesc(uint8_t speed, uint16_t *length);
 
 extern void zeroJoystick();
@@ -155,7 +310,13 @@ extern uint32_t toggleManualMode();
 
 extern void periodicUICallback();
 
-extern void copyUSBufferIfPossible();
+extern void armBulkReceptionIfPossible();
+
+extern void reportCreditsIfPossible();
+
+extern void sendTelemetryIfDue();
+
+extern void recordStarvation(int starved);
 
 extern void tryToStartProgram();
 
@@ -163,4 +324,28 @@ extern void initSPISystem();
 
 extern void handleSPI();
 
-extern void periodicSpiFunction();
\ No newline at end of file
+extern void periodicSpiFunction();
+
+extern int32_t limitSwitchTripPosition(int axis);
+
+extern void initCycleCounter();
+
+extern void enterLoopSection(loop_section_t section);
+
+extern void startStepEdgeTiming(uint32_t firstEdgeCycles);
+
+extern void stopStepEdgeTiming();
+
+extern void timeStepEdge(uint32_t periodCycles);
+
+extern void resetStepJitter();
+
+extern void readStepJitter(step_jitter_t *jitter);
+
+extern uint32_t beginInterruptProfile();
+
+extern void endInterruptProfile(profiled_interrupt_t interrupt, uint32_t start);
+
+extern void resetCycleProfile();
+
+extern void readCycleProfile(cycle_profile_t *profile);
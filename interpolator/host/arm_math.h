@@ -0,0 +1,8 @@
+#pragma once
+
+// Stand-in for the CMSIS DSP header, the firmware only takes the float type from it.
+
+#include <stdint.h>
+#include <math.h>
+
+typedef float float32_t;
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+#include "stm32f4xx_conf.h"
+#include "simulation.h"
+#include "cnc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <x86intrin.h>
+
+#define HAS_CYCLE_COUNTER 1
+#define readHostCycles() __rdtsc()
+#else
+#define HAS_CYCLE_COUNTER 0
+#define readHostCycles() 0
+#endif
+
+// the board wiring, see motorsPinout and eStopPinout in main.c, uiPinout in manual.c
+#define STEP_PINS           (GPIO_Pin_3 | GPIO_Pin_5 | GPIO_Pin_7)
+#define ESTOP_PIN           GPIO_Pin_14
+#define TOOL_PROBE_PIN      GPIO_Pin_8
+// nothing asserted on the IO board, see spiInputPolarity in spiIO.c
+#define SPI_IDLE_INPUT      0xE3
+
+// what the host sends, see createProgramEncoder(), createCompressedProgramEncoder() and
+// createSegmentProgramEncoder() in worker.js
+#define PROGRAM_HEADER_LENGTH   8
+#define MAX_PROGRAM_SIZE        300
+#define STEP_RECORD_LENGTH      3
+#define WIDE_STEP_RECORD_LENGTH 4
+#define MAX_PROGRAM_BYTES       (MAX_PROGRAM_SIZE * STEP_RECORD_LENGTH)
+#define MAX_COMPRESSED_RECORD   11
+#define SEGMENT_RECORD_LENGTH   28
+#define STEP_DURATION           10
+// see credit_report_t in usb.c
+#define CREDIT_REPORT_WORDS     6
+// see cncSetup() in usb.c
+#define REQUEST_BUFFER_STATISTICS   13
+#define BUFFER_STATISTICS_WORDS     6
+// 0.1mm on X, a slight corner at each junction
+#define SEGMENT_STEPS           64
+#define SEGMENT_SPEED           50.0f
+#define SEGMENT_ACCELERATION    100.0f
+
+// rough cost of a pass of the superloop on the F4 when the timer is not running
+#define LOOP_CYCLES             200
+
+#define MAX_LOOPS_PER_STEP      100
+
+extern void firmwareMain(void);
+
+extern void __real_handleSPI(void);
+
+typedef enum {
+    STEPS_FORMAT = 0,
+    COMPRESSED_FORMAT,
+    SEGMENTS_FORMAT,
+    WIDE_FORMAT
+} stream_format_t;
+
+static const char *formatNames[] = {"steps", "compressed", "segments", "wide"};
+
+static const uint8_t programTypes[] = {PROGRAM_STEPS, PROGRAM_COMPRESSED_STEPS, PROGRAM_SEGMENTS, PROGRAM_WIDE_STEPS};
+
+static const uint32_t recordLengths[] = {STEP_RECORD_LENGTH, MAX_COMPRESSED_RECORD, SEGMENT_RECORD_LENGTH,
+        WIDE_STEP_RECORD_LENGTH};
+
+static const uint8_t stepPattern[] = {0b000011, 0b001100, 0b001111, 0b110000, 0b111111, 0b000011};
+
+static struct {
+    uint8_t *stream;
+    uint32_t length;
+    uint32_t sent;
+    // end of each program in the stream
+    uint32_t *programEnds;
+    uint32_t programCount;
+    // what the last credit report allows to have sent, see Runner in runner.js
+    uint8_t hasCredits;
+    uint32_t sendLimit;
+    // the last program filled its last packet, the transfer is still open
+    uint8_t endTransfer;
+    uint64_t nakedPackets;
+    uint64_t expectedSteps;
+    uint64_t steps;
+    uint64_t iterations;
+    struct timespec startTime;
+    uint64_t startCycles;
+    jmp_buf end;
+} bench;
+
+static void writeHeader(uint8_t *header, uint8_t type, uint32_t length, uint32_t programID) {
+    header[0] = type;
+    header[1] = (uint8_t) length;
+    header[2] = (uint8_t) (length >> 8);
+    header[3] = (uint8_t) (length >> 16);
+    header[4] = (uint8_t) programID;
+    header[5] = (uint8_t) (programID >> 8);
+    header[6] = (uint8_t) (programID >> 16);
+    header[7] = (uint8_t) (programID >> 24);
+}
+
+static uint8_t *writeUint32(uint8_t *cursor, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        *cursor++ = (uint8_t) (value >> 8 * i);
+    return cursor;
+}
+
+static uint8_t *writeFloat32(uint8_t *cursor, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return writeUint32(cursor, bits);
+}
+
+static uint8_t *writeVarint(uint8_t *cursor, uint32_t value) {
+    while (value > 0x7F) {
+        *cursor++ = (uint8_t) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *cursor++ = (uint8_t) value;
+    return cursor;
+}
+
+// the same steps in the step formats, the compressed one merges the identical successive steps
+// and the wide one spells the 3 axes of the pattern as step and direction masks
+// the segments format moves X by SEGMENT_STEPS at a time, Y and Z by a fraction of it that changes every other segment
+static void createStream(uint64_t steps, stream_format_t format) {
+    uint64_t maxPrograms = steps + 1;
+    bench.stream = malloc(maxPrograms * PROGRAM_HEADER_LENGTH + steps * SEGMENT_RECORD_LENGTH);
+    bench.programEnds = malloc(maxPrograms * sizeof(*bench.programEnds));
+    bench.expectedSteps = steps;
+    bench.programCount = 0;
+    uint8_t *cursor = bench.stream;
+    uint64_t step = 0;
+    while (step < steps) {
+        uint8_t *header = cursor;
+        cursor += PROGRAM_HEADER_LENGTH;
+        uint32_t previousDuration = 0;
+        uint32_t recordLength = recordLengths[format];
+        while (step < steps && cursor - header - PROGRAM_HEADER_LENGTH + recordLength <= MAX_PROGRAM_BYTES) {
+            uint8_t axes = stepPattern[step % sizeof(stepPattern)];
+            if (format == STEPS_FORMAT) {
+                *cursor++ = (uint8_t) STEP_DURATION;
+                *cursor++ = (uint8_t) (STEP_DURATION >> 8);
+                *cursor++ = axes;
+                step++;
+                continue;
+            }
+            if (format == WIDE_FORMAT) {
+                *cursor++ = (uint8_t) STEP_DURATION;
+                *cursor++ = (uint8_t) (STEP_DURATION >> 8);
+                *cursor++ = (uint8_t) ((axes & 0b000001) | (axes & 0b000100) >> 1 | (axes & 0b010000) >> 2);
+                *cursor++ = (uint8_t) ((axes & 0b000010) >> 1 | (axes & 0b001000) >> 2 | (axes & 0b100000) >> 3);
+                step++;
+                continue;
+            }
+            if (format == SEGMENTS_FORMAT) {
+                uint32_t major = steps - step < SEGMENT_STEPS ? (uint32_t) (steps - step) : SEGMENT_STEPS;
+                cursor = writeUint32(cursor, major);
+                cursor = writeUint32(cursor, step / SEGMENT_STEPS % 2 ? major * 5 / 8 : major * 3 / 4);
+                cursor = writeUint32(cursor, (uint32_t) -(int32_t) (major / 2));
+                cursor = writeFloat32(cursor, 0);
+                cursor = writeFloat32(cursor, SEGMENT_SPEED);
+                cursor = writeFloat32(cursor, 0);
+                cursor = writeFloat32(cursor, SEGMENT_ACCELERATION);
+                step += major;
+                continue;
+            }
+            uint32_t repeat = 1;
+            while (step + repeat < steps && stepPattern[(step + repeat) % sizeof(stepPattern)] == axes)
+                repeat++;
+            int32_t delta = STEP_DURATION - (int32_t) previousDuration;
+            *cursor++ = (uint8_t) (axes | (delta ? 0x40 : 0) | (repeat > 1 ? 0x80 : 0));
+            if (delta)
+                cursor = writeVarint(cursor, (uint32_t) (delta << 1) ^ (uint32_t) (delta >> 31));
+            if (repeat > 1)
+                cursor = writeVarint(cursor, repeat);
+            previousDuration = STEP_DURATION;
+            step += repeat;
+        }
+        writeHeader(header, programTypes[format], (uint32_t) (cursor - header - PROGRAM_HEADER_LENGTH),
+                bench.programCount + 1);
+        bench.programEnds[bench.programCount++] = (uint32_t) (cursor - bench.stream);
+    }
+    bench.length = (uint32_t) (cursor - bench.stream);
+}
+
+static void countSteps(GPIO_TypeDef *gpio, uint16_t previous, uint16_t current) {
+    if (gpio == GPIOE && (current & ~previous & STEP_PINS))
+        bench.steps++;
+}
+
+static void pollCredits() {
+    uint32_t report[CREDIT_REPORT_WORDS];
+    if (simulationUSBInterruptIn(INTERRUPT_ENDPOINT_NUM, (uint8_t *) report, sizeof(report)) != sizeof(report))
+        return;
+    bench.hasCredits = 1;
+    // consumed bytes + buffer size
+    bench.sendLimit = report[1] + report[4];
+}
+
+// sends the stream like Runner.sendSpeed(), one bulk transfer per program, within the reported credits
+static void feedUSB() {
+    static uint32_t program = 0;
+    pollCredits();
+    while (bench.sent < bench.length || bench.endTransfer) {
+        if (bench.endTransfer) {
+            if (!simulationUSBBulkOutZeroLength(BULK_ENDPOINT_NUM)) {
+                bench.nakedPackets++;
+                break;
+            }
+            bench.endTransfer = 0;
+            continue;
+        }
+        while (bench.programEnds[program] <= bench.sent)
+            program++;
+        uint32_t programEnd = bench.programEnds[program];
+        uint32_t packet = programEnd - bench.sent < BULK_PACKET_SIZE ? programEnd - bench.sent : BULK_PACKET_SIZE;
+        if (bench.hasCredits && (int32_t) (bench.sendLimit - bench.sent) < (int32_t) packet)
+            break;
+        uint32_t accepted = simulationUSBBulkOut(BULK_ENDPOINT_NUM, bench.stream + bench.sent, packet);
+        if (!accepted) {
+            bench.nakedPackets++;
+            break;
+        }
+        bench.sent += accepted;
+        bench.endTransfer = bench.sent == programEnd && accepted == BULK_PACKET_SIZE;
+    }
+}
+
+// handleSPI() is called once per pass of the superloop, the linker redirects the call here.
+void __wrap_handleSPI(void) {
+    if (bench.iterations++ == 0) {
+        simulationUSBConnect();
+        simulationUSBControlOut(REQUEST_BUFFER_STATISTICS, 0, 0, 0);
+        clock_gettime(CLOCK_MONOTONIC, &bench.startTime);
+        bench.startCycles = readHostCycles();
+    }
+    feedUSB();
+    if (bench.sent == bench.length && bench.steps == bench.expectedSteps && cncMemory.state == READY)
+        longjmp(bench.end, 1);
+    if (bench.iterations > (bench.expectedSteps + 1) * MAX_LOOPS_PER_STEP)
+        longjmp(bench.end, 2);
+    // the harness is infinitely fast: when waiting for the step timer, jump to it
+    if (!simulationSkipToNextTimerEvent())
+        simulationAdvance(LOOP_CYCLES);
+    __real_handleSPI();
+}
+
+int main(int argc, char **argv) {
+    uint64_t steps = argc > 1 ? strtoull(argv[1], 0, 10) : 1000000;
+    int format = 0;
+    while (argc > 2 && format < (int) (sizeof(formatNames) / sizeof(*formatNames)) && strcmp(argv[2], formatNames[format]))
+        format++;
+    if (steps == 0 || format == sizeof(formatNames) / sizeof(*formatNames)) {
+        fprintf(stderr, "usage: %s [steps] [steps|compressed|segments|wide] [stream file]\n", argv[0]);
+        return 1;
+    }
+    createStream(steps, (stream_format_t) format);
+    // what is sent, for interpolator-replay
+    if (argc > 3) {
+        FILE *file = fopen(argv[3], "wb");
+        if (!file || fwrite(bench.stream, 1, bench.length, file) != bench.length || fclose(file)) {
+            perror(argv[3]);
+            return 1;
+        }
+    }
+    simulationObserveGPIO(countSteps);
+    simulationSetInputPins(GPIOE, ESTOP_PIN, 1);
+    simulationSetInputPins(GPIOA, TOOL_PROBE_PIN, 1);
+    simulationSetSPIInput(SPI_IDLE_INPUT);
+    int result = setjmp(bench.end);
+    if (!result)
+        firmwareMain();
+    struct timespec endTime;
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    uint64_t cycles = readHostCycles() - bench.startCycles;
+    double seconds = (endTime.tv_sec - bench.startTime.tv_sec) + (endTime.tv_nsec - bench.startTime.tv_nsec) / 1e9;
+    if (result != 1) {
+        fprintf(stderr, "stalled after %llu steps out of %llu, in state %d\n", (unsigned long long) bench.steps,
+                (unsigned long long) bench.expectedSteps, cncMemory.state);
+        return 1;
+    }
+    printf("steps: %llu\n", (unsigned long long) bench.steps);
+    printf("stream bytes: %u\n", bench.length);
+    printf("NAKed packets: %llu\n", (unsigned long long) bench.nakedPackets);
+    printf("seconds: %.6f\n", seconds);
+    printf("steps/second: %.0f\n", bench.steps / seconds);
+    printf("loop iterations/second: %.0f\n", bench.iterations / seconds);
+    printf("loop iterations/step: %.2f\n", (double) bench.iterations / bench.steps);
+    printf("ns/step: %.1f\n", seconds * 1e9 / bench.steps);
+    if (HAS_CYCLE_COUNTER)
+        printf("host cycles/step: %.1f\n", (double) cycles / bench.steps);
+    uint32_t statistics[BUFFER_STATISTICS_WORDS];
+    if (simulationUSBControlIn(REQUEST_BUFFER_STATISTICS, 0, (uint8_t *) statistics, sizeof(statistics)) == sizeof(statistics))
+        printf("starvations: %u, min fill level: %u, starved seconds: %.6f\n", statistics[0], statistics[1],
+                (statistics[4] + ((uint64_t) statistics[5] << 32)) / (double) TICK_FREQUENCY);
+    printf("final position:");
+    for (int i = 0; i < AXES_COUNT; i++)
+        printf(" %d", (int) cncMemory.position.axes[i]);
+    printf("\n");
+    printf("simulated seconds: %.6f\n", (double) simulationNow() / SystemCoreClock);
+    return 0;
+}
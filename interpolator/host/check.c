@@ -0,0 +1,549 @@
+// MAP_ANONYMOUS is not POSIX
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "stm32f4xx_conf.h"
+#include "simulation.h"
+#include "cnc.h"
+
+// Scenarios the bench doesn't go through, played on the simulated board in virtual time. Prints a line per check
+// and exits with 1 when one of them failed, make check runs it.
+// Each scenario boots the firmware in its own process, forked before anything ran: the firmware starts from its
+// initial state, and the flash image goes from one boot to the next like on the board.
+
+// the board wiring, see motorsPinout and eStopPinout in main.c, uiPinout in manual.c
+#define STEP_PINS           (GPIO_Pin_3 | GPIO_Pin_5 | GPIO_Pin_7)
+#define ESTOP_PIN           GPIO_Pin_14
+#define TOOL_PROBE_PIN      GPIO_Pin_8
+// nothing asserted on the IO board, see spiInputPolarity in spiIO.c
+#define SPI_IDLE_INPUT      0xE3
+
+// see createProgramEncoder() in worker.js
+#define PROGRAM_HEADER_LENGTH   8
+#define STEP_RECORD_LENGTH      3
+#define PROGRAM_STEPS_COUNT     300
+#define STEP_DURATION           10
+// steps of the record before the malformed one
+#define MALFORMED_REPEATED_STEPS 100
+// see cncSetup() in usb.c
+#define REQUEST_PARAMETERS      1
+#define REQUEST_ABORT           5
+#define REQUEST_CLEAR_ABORT     6
+#define REQUEST_RESUME_PROGRAM  8
+#define REQUEST_SAVE_POSITION   16
+#define REQUEST_CREDITS         17
+// see credit_report_t in usb.c
+#define CREDIT_REPORT_WORDS     6
+
+// see storage.c, the settings sectors in the flash image and the layout of their records
+static const uint32_t storageSectorOffsets[] = {0xC0000, 0xE0000};
+#define STORAGE_SECTOR_SIZE     0x20000
+#define ERASED_WORD             0xFFFFFFFFU
+#define RECORD_HEADER           0x5E770000U
+#define RECORD_HEADER_MASK      0xFFFF0000U
+// X maxSpeed of the settings written by the storage scenarios, the compiled in one is 3000
+#define SAVED_MAX_SPEED         2500
+#define TOGGLED_MAX_SPEED       2000
+#define FINAL_MAX_SPEED         1500
+
+// rough cost of a pass of the superloop on the F4
+#define LOOP_CYCLES             200
+// 50ms of machine time at 168MHz
+#define SETTLING_PASSES         42000
+// the program of the last transfer starts at one of the next passes
+#define IDLE_PASSES             100
+// handler calls delayed past the compare event of the next step by the late interrupt scenario
+#define LATE_HANDLERS           10
+
+extern void firmwareMain(void);
+
+extern void __real_handleSPI(void);
+
+typedef struct {
+    const char *name;
+    // called by the harness on the flash image before the boot, optional
+    void (*beforeBoot)(void);
+    // called at every pass of the superloop, the scenario ends with finishScenario()
+    void (*pass)(void);
+} scenario_t;
+
+static struct {
+    uint8_t stream[4 * (PROGRAM_HEADER_LENGTH + PROGRAM_STEPS_COUNT * STEP_RECORD_LENGTH)];
+    uint32_t length;
+    uint32_t sent;
+    uint64_t steps;
+    uint64_t stepsAtMark;
+    uint32_t passes;
+    uint32_t idlePasses;
+    int phase;
+    int failures;
+    const scenario_t *scenario;
+    jmp_buf end;
+    // the flash when the firmware started
+    uint8_t bootFlash[SIMULATED_FLASH_SIZE];
+    // shared with the children, the flash of the last boot
+    uint8_t *flash;
+} check;
+
+static void report(const char *name, int ok, const char *detail) {
+    printf("%s %s%s%s\n", ok ? "ok" : "FAIL", name, ok ? "" : ": ", ok ? "" : detail);
+    check.failures += !ok;
+}
+
+static void finishScenario() {
+    longjmp(check.end, 1);
+}
+
+static uint8_t *writeProgramHeader(uint8_t *cursor, program_type_t type, uint32_t length, uint32_t programID) {
+    *cursor++ = (uint8_t) type;
+    for (int i = 0; i < 3; i++)
+        *cursor++ = (uint8_t) (length >> 8 * i);
+    for (int i = 0; i < 4; i++)
+        *cursor++ = (uint8_t) (programID >> 8 * i);
+    return cursor;
+}
+
+// programs of PROGRAM_STEPS_COUNT steps moving X, Y and Z together
+static void createStream(uint32_t programs, uint32_t firstProgramID) {
+    uint8_t *cursor = check.stream;
+    for (uint32_t program = 0; program < programs; program++) {
+        cursor = writeProgramHeader(cursor, PROGRAM_STEPS, PROGRAM_STEPS_COUNT * STEP_RECORD_LENGTH,
+                firstProgramID + program);
+        for (uint32_t step = 0; step < PROGRAM_STEPS_COUNT; step++) {
+            *cursor++ = STEP_DURATION;
+            *cursor++ = 0;
+            *cursor++ = 0b111111;
+        }
+    }
+    check.length = (uint32_t) (cursor - check.stream);
+    check.sent = 0;
+}
+
+// one packet per pass, the endpoint NAKs when the ring buffer is full
+static void feedUSB() {
+    if (check.sent == check.length)
+        return;
+    uint32_t packet = check.length - check.sent < BULK_PACKET_SIZE ? check.length - check.sent : BULK_PACKET_SIZE;
+    check.sent += simulationUSBBulkOut(BULK_ENDPOINT_NUM, check.stream + check.sent, packet);
+}
+
+// the whole stream is played and the step timers stopped
+static int streamIsOver() {
+    if (check.sent != check.length || cncMemory.state != READY || (TIM3->CR1 & TIM_CR1_CEN)
+            || (TIM8->CR1 & TIM_CR1_CEN)) {
+        check.idlePasses = 0;
+        return 0;
+    }
+    return ++check.idlePasses > IDLE_PASSES;
+}
+
+static void countSteps(GPIO_TypeDef *gpio, uint16_t previous, uint16_t current) {
+    if (gpio == GPIOE && (current & ~previous & STEP_PINS))
+        check.steps++;
+}
+
+// streams 4 programs, aborts in the middle of the second one, then plays a program after the abort is cleared
+static void abortScenario() {
+    enum {
+        STARTING,
+        STREAMING,
+        ABORTED,
+        CLEARED
+    };
+    switch (check.phase) {
+        case STARTING:
+            createStream(4, 1);
+            check.phase = STREAMING;
+            break;
+        case STREAMING:
+            feedUSB();
+            // just after a rising edge, the step timer is in the middle of the step
+            if (check.steps == PROGRAM_STEPS_COUNT * 3 / 2) {
+                simulationUSBControlOut(REQUEST_ABORT, 0, 0, 0);
+                check.stepsAtMark = check.steps;
+                check.passes = 0;
+                check.phase = ABORTED;
+            }
+            break;
+        case ABORTED:
+            // the host stopped sending, the steps already received or queued must not be played
+            if (++check.passes < SETTLING_PASSES)
+                break;
+            report("abort stops the steps", check.steps == check.stepsAtMark, "steps played after the abort");
+            report("abort holds the state", cncMemory.state == ABORTING_PROGRAM, "left ABORTING_PROGRAM");
+            simulationUSBControlOut(REQUEST_CLEAR_ABORT, 0, 0, 0);
+            report("clear abort", cncMemory.state == READY, "not READY after REQUEST_CLEAR_ABORT");
+            createStream(1, 10);
+            check.stepsAtMark = check.steps;
+            check.passes = 0;
+            check.phase = CLEARED;
+            break;
+        case CLEARED:
+            feedUSB();
+            if (++check.passes < SETTLING_PASSES * 2)
+                break;
+            report("program after abort", check.steps - check.stepsAtMark == PROGRAM_STEPS_COUNT,
+                    "the program after the abort was not played completely");
+            // the position moved, but it's only written at the end of the homing or by REQUEST_SAVE_POSITION
+            report("no flash write for the jobs", !memcmp(check.bootFlash, simulationFlash(), SIMULATED_FLASH_SIZE),
+                    "the flash was written while the settings didn't change");
+            finishScenario();
+        default:
+            break;
+    }
+}
+
+// a compressed program whose second record has a varint of 6 bytes, followed by a program of plain steps
+static void malformedVarintScenario() {
+    // see readCompressedRecord() in main.c: the X, Y and Z steps, a zigzag duration and a repeat count
+    static const uint8_t compressedProgram[] = {
+            0xFF, STEP_DURATION * 2, MALFORMED_REPEATED_STEPS,
+            0x7F, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01,
+            0xFF, 0, MALFORMED_REPEATED_STEPS};
+    if (!check.phase) {
+        uint8_t *cursor = writeProgramHeader(check.stream, PROGRAM_COMPRESSED_STEPS, sizeof(compressedProgram), 1);
+        memcpy(cursor, compressedProgram, sizeof(compressedProgram));
+        cursor += sizeof(compressedProgram);
+        cursor = writeProgramHeader(cursor, PROGRAM_STEPS, PROGRAM_STEPS_COUNT * STEP_RECORD_LENGTH, 2);
+        for (uint32_t step = 0; step < PROGRAM_STEPS_COUNT; step++) {
+            *cursor++ = STEP_DURATION;
+            *cursor++ = 0;
+            *cursor++ = 0b111111;
+        }
+        check.length = (uint32_t) (cursor - check.stream);
+        check.sent = 0;
+        check.phase = 1;
+    }
+    feedUSB();
+    int over = streamIsOver();
+    if (!over && ++check.passes < SETTLING_PASSES * 2)
+        return;
+    report("malformed varint drops its program", over, "the decoder is stuck on the malformed record");
+    report("program after a malformed varint", check.steps == MALFORMED_REPEATED_STEPS + PROGRAM_STEPS_COUNT,
+            "the steps before the malformed record or of the next program were not played");
+    finishScenario();
+}
+
+// the counters of the credit reports can be read at any time, a new page doesn't get a report before the buffer moves
+static void creditsScenario() {
+    if (!check.phase) {
+        createStream(1, 1);
+        check.phase = 1;
+    }
+    feedUSB();
+    if (!streamIsOver())
+        return;
+    uint32_t credits[CREDIT_REPORT_WORDS];
+    int read = simulationUSBControlIn(REQUEST_CREDITS, 0, (uint8_t *) credits, sizeof(credits)) == sizeof(credits);
+    report("credits read", read && credits[2] == check.length && credits[1] == check.length,
+            "the received and consumed bytes don't match the stream");
+    finishScenario();
+}
+
+// presses the emergency stop in the middle of the first of 2 programs, releases it and resumes the program
+static void pauseScenario() {
+    enum {
+        STARTING,
+        STREAMING,
+        PRESSED,
+        PAUSED,
+        RESUMED
+    };
+    switch (check.phase) {
+        case STARTING:
+            createStream(2, 1);
+            check.phase = STREAMING;
+            break;
+        case STREAMING:
+            feedUSB();
+            if (check.steps == PROGRAM_STEPS_COUNT / 2) {
+                simulationSetInputPins(GPIOE, ESTOP_PIN, 0);
+                check.phase = PRESSED;
+            }
+            break;
+        case PRESSED:
+            feedUSB();
+            if (cncMemory.state != PAUSED_PROGRAM)
+                break;
+            check.stepsAtMark = check.steps;
+            check.passes = 0;
+            check.phase = PAUSED;
+            break;
+        case PAUSED:
+            feedUSB();
+            if (++check.passes < SETTLING_PASSES)
+                break;
+            // TIM3 ends the step in progress, its edge can still come
+            report("pause stops the steps", check.steps - check.stepsAtMark <= 1, "steps played during the pause");
+            simulationSetInputPins(GPIOE, ESTOP_PIN, 1);
+            simulationUSBControlOut(REQUEST_RESUME_PROGRAM, 0, 0, 0);
+            check.phase = RESUMED;
+            break;
+        case RESUMED:
+            feedUSB();
+            if (!streamIsOver())
+                break;
+            report("resume plays every step", check.steps == 2 * PROGRAM_STEPS_COUNT, "steps lost or doubled");
+            report("resume counts every step", cncMemory.position.axes[0] == (int32_t) check.steps,
+                    "the position doesn't match the step pulses");
+            finishScenario();
+        default:
+            break;
+    }
+}
+
+// the program steps of the DMA build don't go through TIM3_IRQHandler()
+#if !STEP_DMA
+// holds the step interrupt from just after a step edge to 2 ticks after the next update, the handler then finds the
+// update and the compare event of the new step pending together
+static void delayStepHandler() {
+    uint64_t tickCycles = 2 * (TIM3->PSC + 1U);
+    simulationMaskInterrupts(1);
+    while (!(TIM3->SR & TIM_IT_Update) && simulationSkipToNextTimerEvent());
+    simulationAdvance((TIM3->CCR1 + 1) * tickCycles);
+    simulationMaskInterrupts(0);
+}
+
+// a program where the step handler is regularly late by more than a tick, every step must still be pulsed once
+static void lateStepInterruptScenario() {
+    if (!check.phase) {
+        createStream(1, 1);
+        check.phase = 1;
+    }
+    feedUSB();
+    // the edge of the current step has been served, and the next one is queued
+    if (check.steps != check.stepsAtMark && check.steps % (PROGRAM_STEPS_COUNT / (LATE_HANDLERS + 1)) == 0
+            && check.steps < PROGRAM_STEPS_COUNT - 2) {
+        check.stepsAtMark = check.steps;
+        delayStepHandler();
+    }
+    if (!streamIsOver())
+        return;
+    report("late step handler pulses every step", check.steps == PROGRAM_STEPS_COUNT, "steps lost or doubled");
+    report("late step handler counts every step", cncMemory.position.axes[0] == (int32_t) check.steps,
+            "the position doesn't match the step pulses");
+    finishScenario();
+}
+#endif
+
+static uint32_t flashWord(uint32_t offset) {
+    uint32_t word;
+    memcpy(&word, check.flash + offset, sizeof(word));
+    return word;
+}
+
+static void writeFlashWord(uint32_t offset, uint32_t word) {
+    memcpy(check.flash + offset, &word, sizeof(word));
+}
+
+// the offset of the last record of the sector in the carried image, 0 when there is none; end gets the free space
+static uint32_t lastRecord(int sector, uint32_t *end) {
+    uint32_t base = storageSectorOffsets[sector];
+    uint32_t offset = 4;
+    uint32_t last = 0;
+    while (offset + 4 <= STORAGE_SECTOR_SIZE && flashWord(base + offset) != ERASED_WORD) {
+        last = base + offset;
+        offset += ((flashWord(base + offset) & ~RECORD_HEADER_MASK) + 2) * 4;
+    }
+    *end = base + offset;
+    return last;
+}
+
+// FNV-1a on the words, like storage.c
+static uint32_t recordChecksum(uint32_t offset, uint32_t count) {
+    uint32_t hash = 2166136261U;
+    for (uint32_t i = 0; i < count; i++) {
+        hash ^= flashWord(offset + i * 4);
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void setMaxSpeed(uint32_t maxSpeed) {
+    parameters_t parameters = cncMemory.parameters;
+    parameters.axes[0].maxSpeed = maxSpeed;
+    simulationUSBControlOut(REQUEST_PARAMETERS, 0, (const uint8_t *) &parameters, sizeof(parameters));
+}
+
+// the parameters are written when the machine is idle, the next pass
+static void saveSettingsScenario() {
+    if (!check.phase) {
+        report("new chip boots with the compiled in settings", cncMemory.parameters.axes[0].maxSpeed == 3000,
+                "unexpected parameters on an erased flash");
+        setMaxSpeed(SAVED_MAX_SPEED);
+        check.phase = 1;
+    }
+    if (++check.passes < IDLE_PASSES)
+        return;
+    report("settings written", memcmp(check.bootFlash, simulationFlash(), SIMULATED_FLASH_SIZE) != 0,
+            "the new parameters were not written");
+    finishScenario();
+}
+
+// the position of the homed axes is written by REQUEST_SAVE_POSITION
+static void savePositionScenario() {
+    if (!check.phase) {
+        report("settings loaded", cncMemory.parameters.axes[0].maxSpeed == SAVED_MAX_SPEED,
+                "the parameters of the last boot were not loaded");
+        createStream(1, 1);
+        check.phase = 1;
+    }
+    feedUSB();
+    if (check.phase == 1 && streamIsOver()) {
+        // stands for a homing of X, Y and Z
+        cncMemory.homedAxes = 0b111;
+        simulationUSBControlOut(REQUEST_SAVE_POSITION, 0, 0, 0);
+        check.passes = 0;
+        check.phase = 2;
+    }
+    if (check.phase == 2 && ++check.passes >= IDLE_PASSES)
+        finishScenario();
+}
+
+static void restorePositionScenario() {
+    report("position restored", cncMemory.position.axes[0] == PROGRAM_STEPS_COUNT,
+            "the saved position was not restored");
+    report("unhomed after a power cycle", cncMemory.homedAxes == 0, "the axes are still homed after the boot");
+    finishScenario();
+}
+
+// a power cut while the last record was written: its checksum word is still erased
+static void tearLastRecord() {
+    uint32_t end;
+    uint32_t last = lastRecord(0, &end);
+    report("a record to tear", last != 0, "no record in the first sector");
+    if (last)
+        writeFlashWord(end - 4, ERASED_WORD);
+}
+
+// the torn record had the position, the one before is loaded
+static void tornRecordScenario() {
+    report("torn record skipped", cncMemory.position.axes[0] == 0
+            && cncMemory.parameters.axes[0].maxSpeed == SAVED_MAX_SPEED, "the torn record was loaded");
+    finishScenario();
+}
+
+// the image written by a firmware built for another AXES_COUNT: a longer record, with a valid checksum
+static void appendForeignRecord() {
+    uint32_t end;
+    uint32_t last = lastRecord(0, &end);
+    if (!last)
+        return;
+    uint32_t length = (flashWord(last) & ~RECORD_HEADER_MASK) + 3;
+    writeFlashWord(end, RECORD_HEADER | length);
+    for (uint32_t i = 0; i < length; i++)
+        writeFlashWord(end + 4 + i * 4, i < length - 3 ? flashWord(last + 4 + i * 4) : 0);
+    writeFlashWord(end + 4 + length * 4, recordChecksum(end + 4, length));
+}
+
+static void foreignRecordScenario() {
+    report("record of another AXES_COUNT skipped", cncMemory.position.axes[0] == 0
+            && cncMemory.parameters.axes[0].maxSpeed == SAVED_MAX_SPEED, "the foreign record was loaded");
+    finishScenario();
+}
+
+// changes the parameters at every pass until the records go to the other sector, then sets the final ones
+static void sectorRolloverScenario() {
+    uint32_t newGeneration;
+    memcpy(&newGeneration, simulationFlash() + storageSectorOffsets[1], sizeof(newGeneration));
+    if (!check.phase) {
+        if (newGeneration == ERASED_WORD && ++check.passes < STORAGE_SECTOR_SIZE / 4) {
+            setMaxSpeed(check.passes % 2 ? TOGGLED_MAX_SPEED : SAVED_MAX_SPEED);
+            return;
+        }
+        // the boot image still has the old sector
+        report("sector rollover", newGeneration == flashWord(storageSectorOffsets[0]) + 1,
+                "the second sector didn't take over");
+        setMaxSpeed(FINAL_MAX_SPEED);
+        check.passes = 0;
+        check.phase = 1;
+    }
+    if (++check.passes >= IDLE_PASSES)
+        finishScenario();
+}
+
+static void afterRolloverScenario() {
+    report("settings loaded from the new sector", cncMemory.parameters.axes[0].maxSpeed == FINAL_MAX_SPEED,
+            "the last parameters were not loaded");
+    finishScenario();
+}
+
+static const scenario_t scenarios[] = {
+        {.name = "abort", .pass = abortScenario},
+        {.name = "credits", .pass = creditsScenario},
+        {.name = "pause", .pass = pauseScenario},
+        {.name = "malformed varint", .pass = malformedVarintScenario},
+#if !STEP_DMA
+        {.name = "late step interrupt", .pass = lateStepInterruptScenario},
+#endif
+        {.name = "save settings", .pass = saveSettingsScenario},
+        {.name = "save position", .pass = savePositionScenario},
+        {.name = "restore position", .pass = restorePositionScenario},
+        {.name = "torn record", .beforeBoot = tearLastRecord, .pass = tornRecordScenario},
+        {.name = "foreign record", .beforeBoot = appendForeignRecord, .pass = foreignRecordScenario},
+        {.name = "sector rollover", .pass = sectorRolloverScenario},
+        {.name = "after rollover", .pass = afterRolloverScenario}};
+
+// handleSPI() is called once per pass of the superloop, the linker redirects the call here.
+void __wrap_handleSPI(void) {
+    static int started = 0;
+    if (!started) {
+        started = 1;
+        memcpy(check.bootFlash, simulationFlash(), SIMULATED_FLASH_SIZE);
+        simulationUSBConnect();
+    }
+    check.scenario->pass();
+    simulationAdvance(LOOP_CYCLES);
+    __real_handleSPI();
+}
+
+// boots the firmware with the flash of the previous boot, returns the number of failed checks
+static int runScenario(const scenario_t *scenario) {
+    fflush(stdout);
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (child == 0) {
+        check.failures = 0;
+        check.scenario = scenario;
+        simulationLoadFlash(check.flash, SIMULATED_FLASH_SIZE);
+        simulationObserveGPIO(countSteps);
+        simulationSetInputPins(GPIOE, ESTOP_PIN, 1);
+        simulationSetInputPins(GPIOA, TOOL_PROBE_PIN, 1);
+        simulationSetSPIInput(SPI_IDLE_INPUT);
+        if (!setjmp(check.end))
+            firmwareMain();
+        memcpy(check.flash, simulationFlash(), SIMULATED_FLASH_SIZE);
+        exit(check.failures);
+    }
+    int status;
+    if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status)) {
+        printf("FAIL %s: the simulation crashed\n", scenario->name);
+        return 1;
+    }
+    return WEXITSTATUS(status);
+}
+
+int main(void) {
+    check.flash = mmap(NULL, SIMULATED_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (check.flash == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    // a new chip
+    memcpy(check.flash, simulationFlash(), SIMULATED_FLASH_SIZE);
+    int failures = 0;
+    for (unsigned int i = 0; i < sizeof(scenarios) / sizeof(*scenarios); i++) {
+        if (scenarios[i].beforeBoot)
+            scenarios[i].beforeBoot();
+        failures += runScenario(&scenarios[i]);
+    }
+    return failures || check.failures ? 1 : 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// Stand-in for the CMSIS Cortex-M4 core peripherals.
+
+#include <stdint.h>
+
+typedef struct {
+    volatile uint32_t CPUID, ICSR, VTOR, AIRCR, SCR, CCR;
+    volatile uint8_t SHP[12];
+    volatile uint32_t SHCSR, CFSR, HFSR, DFSR, MMFAR, BFAR, AFSR, PFR[2], DFR, ADR, MMFR[4], ISAR[5];
+    uint32_t RESERVED0[5];
+    volatile uint32_t CPACR;
+} SCB_Type;
+
+extern SCB_Type simulatedSCB;
+#define SCB (&simulatedSCB)
+
+#define SCB_SCR_SLEEPONEXIT_Msk (1UL << 1)
+#define SCB_SCR_SLEEPDEEP_Msk (1UL << 2)
+
+typedef struct {
+    volatile uint32_t CTRL, CYCCNT, CPICNT, EXCCNT, SLEEPCNT, LSUCNT, FOLDCNT, PCSR;
+} DWT_Type;
+
+typedef struct {
+    volatile uint32_t DHCSR, DCRSR, DCRDR, DEMCR;
+} CoreDebug_Type;
+
+// CYCCNT follows the virtual clock once it is enabled
+extern DWT_Type simulatedDWT;
+extern CoreDebug_Type simulatedCoreDebug;
+#define DWT (&simulatedDWT)
+#define CoreDebug (&simulatedCoreDebug)
+
+#define DWT_CTRL_CYCCNTENA_Msk (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+
+extern uint32_t SysTick_Config(uint32_t ticks);
+
+// the simulation never preempts the code that is running, interrupts are raised between harness steps
+static inline void __disable_irq(void) {
+}
+
+static inline void __enable_irq(void) {
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// Stand-in for the CMSIS intrinsics.
+
+#include <stdint.h>
+
+static inline int32_t __SSAT(int32_t value, uint32_t bits) {
+    int32_t max = (1 << (bits - 1)) - 1;
+    int32_t min = -max - 1;
+    return value > max ? max : value < min ? min : value;
+}
@@ -0,0 +1,724 @@
+#include <stdint.h>
+#include <string.h>
+#include "stm32f4xx_conf.h"
+#include "stm32f4_discovery.h"
+#include "simulation.h"
+
+uint32_t SystemCoreClock = 168000000;
+
+GPIO_TypeDef simulatedGPIO[5];
+TIM_TypeDef simulatedTIM3;
+TIM_TypeDef simulatedTIM8;
+TIM_TypeDef simulatedTIM7;
+SPI_TypeDef simulatedSPI2;
+ADC_TypeDef simulatedADC1;
+DMA_TypeDef simulatedDMA1;
+DMA_TypeDef simulatedDMA2;
+DMA_Stream_TypeDef simulatedDMA1Stream[8];
+DMA_Stream_TypeDef simulatedDMA2Stream[8];
+SCB_Type simulatedSCB;
+DWT_Type simulatedDWT;
+CoreDebug_Type simulatedCoreDebug;
+
+extern void SysTick_Handler(void);
+
+extern void TIM3_IRQHandler(void);
+
+extern void DMA1_Stream3_IRQHandler(void);
+
+// only used by the DMA step engine
+__attribute__ ((weak)) void DMA2_Stream3_IRQHandler(void) {
+}
+
+static struct {
+    uint64_t now;
+    uint64_t sysTickPeriod;
+    uint64_t nextSysTick;
+    simulation_gpio_observer_t gpioObserver;
+    // the parallel pins of the 74HC165 and of the 74HC595
+    uint8_t spiInput;
+    uint8_t spiOutput;
+    // the shift registers, loaded from the inputs and moved to the outputs by the latch pulses
+    uint8_t shiftedInput;
+    uint8_t shiftedOutput;
+    uint8_t joystick[3];
+    // input pins set by the harness, they ignore the pull resistors
+    uint16_t drivenPins[5];
+    // the harness holds the interrupts back, the flags stay pending
+    int interruptsMasked;
+} simulation = {
+        .now = 0,
+        .sysTickPeriod = 0,
+        .nextSysTick = UINT64_MAX,
+        .gpioObserver = 0,
+        .spiInput = 0,
+        .spiOutput = 0,
+        .shiftedInput = 0,
+        .shiftedOutput = 0,
+        .joystick = {128, 128, 128},
+        .interruptsMasked = 0};
+
+typedef struct {
+    TIM_TypeDef *tim;
+    // core cycles per timer kernel clock cycle, 2 on APB1, 1 on APB2
+    uint32_t busDivider;
+    // core cycles already elapsed in the current timer tick
+    uint64_t phase;
+    // shadow of ARR, it is the one the counter compares to when ARPE is set
+    uint32_t autoReload;
+    IRQn_Type irq;
+    void (*handler)(void);
+} simulated_timer_t;
+
+static simulated_timer_t timers[] = {
+        {.tim = TIM3, .busDivider = 2, .phase = 0, .autoReload = 0, .irq = TIM3_IRQn, .handler = TIM3_IRQHandler},
+        // the DMA step engine only uses its DMA requests
+        {.tim = TIM8, .busDivider = 1, .phase = 0, .autoReload = 0, .irq = 0, .handler = 0},
+        // the SPI exchange clock, only its update DMA request too
+        {.tim = TIM7, .busDivider = 2, .phase = 0, .autoReload = 0, .irq = 0, .handler = 0}};
+
+// which stream serves which timer request, see the DMA1 and DMA2 request mappings in the reference manual
+static const struct {
+    TIM_TypeDef *tim;
+    uint16_t request;
+    DMA_Stream_TypeDef *stream;
+    uint32_t channel;
+} dmaRequests[] = {
+        {.tim = TIM8, .request = TIM_DMA_Update, .stream = DMA2_Stream1, .channel = DMA_Channel_7},
+        {.tim = TIM8, .request = TIM_DMA_CC1, .stream = DMA2_Stream2, .channel = DMA_Channel_7},
+        {.tim = TIM8, .request = TIM_DMA_CC2, .stream = DMA2_Stream3, .channel = DMA_Channel_7},
+        {.tim = TIM7, .request = TIM_DMA_Update, .stream = DMA1_Stream2, .channel = DMA_Channel_1}};
+
+// the stream of the SPI2 RX request
+static const struct {
+    DMA_Stream_TypeDef *stream;
+    uint32_t channel;
+} spiReceptionRequest = {.stream = DMA1_Stream3, .channel = DMA_Channel_0};
+
+static const struct {
+    DMA_Stream_TypeDef *stream;
+    IRQn_Type irq;
+    void (*handler)(void);
+} dmaInterrupts[] = {{.stream = DMA2_Stream3, .irq = DMA2_Stream3_IRQn, .handler = DMA2_Stream3_IRQHandler},
+        {.stream = DMA1_Stream3, .irq = DMA1_Stream3_IRQn, .handler = DMA1_Stream3_IRQHandler}};
+
+// NDTR reload value of each stream of DMA1 then DMA2, for the circular mode
+static uint32_t dmaLengths[16];
+
+// position of the flags of each stream in LISR/HISR
+static const uint8_t dmaFlagShifts[] = {0, 6, 16, 22, 0, 6, 16, 22};
+
+#define DMA_HTIF ((uint32_t)0x10)
+#define DMA_TCIF ((uint32_t)0x20)
+
+#define TIMERS_COUNT (sizeof(timers) / sizeof(*timers))
+
+void SystemInit(void) {
+}
+
+uint32_t SysTick_Config(uint32_t ticks) {
+    simulation.sysTickPeriod = ticks;
+    simulation.nextSysTick = simulation.now + ticks;
+    return 0;
+}
+
+/* NVIC */
+
+static uint8_t enabledIRQs[128];
+
+void NVIC_Init(NVIC_InitTypeDef *NVIC_InitStruct) {
+    enabledIRQs[NVIC_InitStruct->NVIC_IRQChannel] = NVIC_InitStruct->NVIC_IRQChannelCmd == ENABLE;
+}
+
+void STM_EVAL_LEDInit(Led_TypeDef Led) {
+}
+
+void STM_EVAL_LEDOn(Led_TypeDef Led) {
+    GPIOD->ODR |= GPIO_Pin_12 << Led;
+}
+
+void STM_EVAL_LEDOff(Led_TypeDef Led) {
+    GPIOD->ODR &= ~(GPIO_Pin_12 << Led);
+}
+
+void RCC_AHB1PeriphClockCmd(uint32_t RCC_AHB1Periph, FunctionalState NewState) {
+}
+
+void RCC_APB1PeriphClockCmd(uint32_t RCC_APB1Periph, FunctionalState NewState) {
+}
+
+void RCC_APB2PeriphClockCmd(uint32_t RCC_APB2Periph, FunctionalState NewState) {
+}
+
+void EXTI_ClearITPendingBit(uint32_t EXTI_Line) {
+}
+
+/* GPIO */
+
+// the latch line of the IO board, see spiPinout in spiIO.c
+#define SHIFT_REGISTERS_LATCH_PIN GPIO_Pin_12
+
+static void writeODR(GPIO_TypeDef *gpio, uint32_t value) {
+    uint16_t previous = (uint16_t) gpio->ODR;
+    gpio->ODR = value & 0xFFFF;
+    // the 74HC165 samples its inputs while the line is low, the 74HC595 updates its outputs when it goes up
+    if (gpio == GPIOB && (previous & ~gpio->ODR & SHIFT_REGISTERS_LATCH_PIN))
+        simulation.shiftedInput = simulation.spiInput;
+    if (gpio == GPIOB && (~previous & gpio->ODR & SHIFT_REGISTERS_LATCH_PIN))
+        simulation.spiOutput = simulation.shiftedOutput;
+    if (simulation.gpioObserver && previous != (uint16_t) gpio->ODR)
+        simulation.gpioObserver(gpio, previous, (uint16_t) gpio->ODR);
+}
+
+void GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_InitStruct) {
+    // the pull resistors give the idle level of the inputs the harness doesn't drive
+    uint32_t pins = GPIO_InitStruct->GPIO_Pin & ~simulation.drivenPins[GPIOx - simulatedGPIO];
+    if (GPIO_InitStruct->GPIO_Mode == GPIO_Mode_IN) {
+        if (GPIO_InitStruct->GPIO_PuPd == GPIO_PuPd_UP)
+            GPIOx->IDR |= pins;
+        else if (GPIO_InitStruct->GPIO_PuPd == GPIO_PuPd_DOWN)
+            GPIOx->IDR &= ~pins;
+    }
+}
+
+void GPIO_PinAFConfig(GPIO_TypeDef *GPIOx, uint16_t GPIO_PinSource, uint8_t GPIO_AF) {
+    GPIOx->AFR[GPIO_PinSource >> 3] |= (uint32_t) GPIO_AF << ((GPIO_PinSource & 7) * 4);
+}
+
+uint8_t GPIO_ReadInputDataBit(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+    return (uint8_t) ((GPIOx->IDR & GPIO_Pin) != 0);
+}
+
+void GPIO_SetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+    writeODR(GPIOx, GPIOx->ODR | GPIO_Pin);
+}
+
+void GPIO_ResetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+    writeODR(GPIOx, GPIOx->ODR & ~GPIO_Pin);
+}
+
+/* TIM */
+
+static simulated_timer_t *findTimer(TIM_TypeDef *tim) {
+    for (unsigned int i = 0; i < TIMERS_COUNT; i++)
+        if (timers[i].tim == tim)
+            return &timers[i];
+    return 0;
+}
+
+void TIM_TimeBaseInit(TIM_TypeDef *TIMx, TIM_TimeBaseInitTypeDef *TIM_TimeBaseInitStruct) {
+    TIMx->ARR = TIM_TimeBaseInitStruct->TIM_Period;
+    TIMx->PSC = TIM_TimeBaseInitStruct->TIM_Prescaler;
+    TIMx->CNT = 0;
+    // the library generates an update event to load the prescaler
+    findTimer(TIMx)->autoReload = TIMx->ARR;
+}
+
+void TIM_OC1Init(TIM_TypeDef *TIMx, TIM_OCInitTypeDef *TIM_OCInitStruct) {
+    TIMx->CCR1 = TIM_OCInitStruct->TIM_Pulse;
+}
+
+void TIM_OC2Init(TIM_TypeDef *TIMx, TIM_OCInitTypeDef *TIM_OCInitStruct) {
+    TIMx->CCR2 = TIM_OCInitStruct->TIM_Pulse;
+}
+
+void TIM_OC1PreloadConfig(TIM_TypeDef *TIMx, uint16_t TIM_OCPreload) {
+}
+
+void TIM_Cmd(TIM_TypeDef *TIMx, FunctionalState NewState) {
+    if (NewState) {
+        if (!(TIMx->CR1 & TIM_CR1_CEN))
+            findTimer(TIMx)->phase = 0;
+        TIMx->CR1 |= TIM_CR1_CEN;
+    } else
+        TIMx->CR1 &= ~TIM_CR1_CEN;
+}
+
+void TIM_UpdateRequestConfig(TIM_TypeDef *TIMx, uint16_t TIM_UpdateSource) {
+    if (TIM_UpdateSource)
+        TIMx->CR1 |= TIM_CR1_URS;
+    else
+        TIMx->CR1 &= ~TIM_CR1_URS;
+}
+
+void TIM_ARRPreloadConfig(TIM_TypeDef *TIMx, FunctionalState NewState) {
+    if (NewState)
+        TIMx->CR1 |= TIM_CR1_ARPE;
+    else
+        TIMx->CR1 &= ~TIM_CR1_ARPE;
+}
+
+void TIM_SelectOnePulseMode(TIM_TypeDef *TIMx, uint16_t TIM_OPMode) {
+    TIMx->CR1 = (TIMx->CR1 & ~TIM_CR1_OPM) | TIM_OPMode;
+}
+
+void TIM_ITConfig(TIM_TypeDef *TIMx, uint16_t TIM_IT, FunctionalState NewState) {
+    if (NewState)
+        TIMx->DIER |= TIM_IT;
+    else
+        TIMx->DIER &= ~TIM_IT;
+}
+
+ITStatus TIM_GetITStatus(TIM_TypeDef *TIMx, uint16_t TIM_IT) {
+    return (TIMx->SR & TIM_IT) && (TIMx->DIER & TIM_IT) ? SET : RESET;
+}
+
+void TIM_ClearITPendingBit(TIM_TypeDef *TIMx, uint16_t TIM_IT) {
+    TIMx->SR &= ~TIM_IT;
+}
+
+void TIM_DMACmd(TIM_TypeDef *TIMx, uint16_t TIM_DMASource, FunctionalState NewState) {
+    if (NewState)
+        TIMx->DIER |= TIM_DMASource;
+    else
+        TIMx->DIER &= ~TIM_DMASource;
+}
+
+void TIM_GenerateEvent(TIM_TypeDef *TIMx, uint16_t TIM_EventSource) {
+    if (TIM_EventSource & TIM_EventSource_Update) {
+        simulated_timer_t *timer = findTimer(TIMx);
+        TIMx->CNT = 0;
+        timer->autoReload = TIMx->ARR;
+        timer->phase = 0;
+        if (!(TIMx->CR1 & TIM_CR1_URS))
+            TIMx->SR |= TIM_IT_Update;
+    }
+}
+
+// the prescaler is used as soon as it is written, the immediate reload is the update event that loads it on the F4
+void TIM_PrescalerConfig(TIM_TypeDef *TIMx, uint16_t Prescaler, uint16_t TIM_PSCReloadMode) {
+    TIMx->PSC = Prescaler;
+    if (TIM_PSCReloadMode == TIM_PSCReloadMode_Immediate)
+        TIM_GenerateEvent(TIMx, TIM_EventSource_Update);
+}
+
+// erased at power up like a new chip, the harness can load an image before starting the firmware
+uint8_t simulatedFlash[SIMULATED_FLASH_SIZE];
+
+static struct {
+    int initialized;
+    int unlocked;
+} flash = {
+        .initialized = 0,
+        .unlocked = 0
+};
+
+static void initFlash() {
+    if (!flash.initialized)
+        memset(simulatedFlash, 0xFF, sizeof(simulatedFlash));
+    flash.initialized = 1;
+}
+
+void simulationLoadFlash(const uint8_t *image, uint32_t length) {
+    initFlash();
+    memcpy(simulatedFlash, image, length < SIMULATED_FLASH_SIZE ? length : SIMULATED_FLASH_SIZE);
+}
+
+const uint8_t *simulationFlash(void) {
+    initFlash();
+    return simulatedFlash;
+}
+
+void FLASH_Unlock(void) {
+    flash.unlocked = 1;
+}
+
+void FLASH_Lock(void) {
+    flash.unlocked = 0;
+}
+
+void FLASH_ClearFlag(uint32_t FLASH_FLAG) {
+}
+
+// 4 sectors of 16KB, one of 64KB, then 128KB ones; the erase time is not simulated
+FLASH_Status FLASH_EraseSector(uint32_t FLASH_Sector, uint8_t VoltageRange) {
+    uint32_t sector = FLASH_Sector >> 3;
+    uint32_t start = sector < 4 ? sector * 0x4000 : sector == 4 ? 0x10000 : (sector - 4) * 0x20000;
+    uint32_t size = sector < 4 ? 0x4000 : sector == 4 ? 0x10000 : 0x20000;
+    initFlash();
+    if (!flash.unlocked)
+        return FLASH_ERROR_WRP;
+    memset(simulatedFlash + start, 0xFF, size);
+    return FLASH_COMPLETE;
+}
+
+// programming only clears bits, like the real array
+FLASH_Status FLASH_ProgramWord(uint32_t Address, uint32_t Data) {
+    uint32_t word;
+    initFlash();
+    if (!flash.unlocked)
+        return FLASH_ERROR_WRP;
+    if (Address & 3)
+        return FLASH_ERROR_PGA;
+    memcpy(&word, (const void *) (uintptr_t) Address, sizeof(word));
+    word &= Data;
+    memcpy((void *) (uintptr_t) Address, &word, sizeof(word));
+    return FLASH_COMPLETE;
+}
+
+static uint64_t tickCycles(simulated_timer_t *timer) {
+    return (timer->tim->PSC + 1) * timer->busDivider;
+}
+
+static uint32_t autoReload(simulated_timer_t *timer) {
+    return timer->tim->CR1 & TIM_CR1_ARPE ? timer->autoReload : timer->tim->ARR;
+}
+
+static uint32_t ticksToUpdate(simulated_timer_t *timer) {
+    TIM_TypeDef *tim = timer->tim;
+    uint32_t arr = autoReload(timer);
+    return tim->CNT <= arr ? arr - tim->CNT + 1 : 0x10000 - tim->CNT;
+}
+
+static uint32_t ticksToCompare(TIM_TypeDef *tim, uint32_t ccr, uint32_t toUpdate) {
+    return ccr > tim->CNT ? ccr - tim->CNT : toUpdate + ccr;
+}
+
+static uint32_t ticksToNextEvent(simulated_timer_t *timer) {
+    TIM_TypeDef *tim = timer->tim;
+    uint32_t toUpdate = ticksToUpdate(timer);
+    uint32_t toEvent = toUpdate;
+    uint32_t toCompare1 = ticksToCompare(tim, tim->CCR1, toUpdate);
+    uint32_t toCompare2 = ticksToCompare(tim, tim->CCR2, toUpdate);
+    if (toCompare1 < toEvent)
+        toEvent = toCompare1;
+    if (toCompare2 < toEvent)
+        toEvent = toCompare2;
+    return toEvent;
+}
+
+static void transferDMA(DMA_Stream_TypeDef *stream);
+
+// the exchange with the shift registers is instantaneous, the received byte raises the RX DMA request
+static void exchangeSPI(SPI_TypeDef *spi, uint8_t output) {
+    simulation.shiftedOutput = output;
+    spi->DR = simulation.shiftedInput;
+    spi->SR = SPI_SR_TXE | SPI_SR_RXNE;
+    if ((spi->CR2 & SPI_CR2_RXDMAEN) && (spiReceptionRequest.stream->CR & DMA_Channel_7) == spiReceptionRequest.channel)
+        transferDMA(spiReceptionRequest.stream);
+}
+
+static void writePeripheral(uint32_t address, uint32_t value, uint32_t size) {
+    for (int i = 0; i < 5; i++)
+        if (address == (uint32_t) (uintptr_t) &simulatedGPIO[i].BSRRL) {
+            GPIO_TypeDef *gpio = &simulatedGPIO[i];
+            // the set half wins over the reset half
+            writeODR(gpio, (gpio->ODR & ~(value >> 16)) | (value & 0xFFFF));
+            return;
+        }
+    if (address == (uint32_t) (uintptr_t) &SPI2->DR) {
+        exchangeSPI(SPI2, (uint8_t) value);
+        return;
+    }
+    memcpy((void *) (uintptr_t) address, &value, size);
+}
+
+static uint32_t readPeripheral(uint32_t address, uint32_t size) {
+    uint32_t value = 0;
+    if (address == (uint32_t) (uintptr_t) &SPI2->DR)
+        SPI2->SR &= ~SPI_SR_RXNE;
+    memcpy(&value, (const void *) (uintptr_t) address, size);
+    return value;
+}
+
+// the streams of DMA1 are numbered 0 to 7, the ones of DMA2 8 to 15
+static unsigned int streamNumber(DMA_Stream_TypeDef *stream) {
+    if (stream >= simulatedDMA2Stream && stream < simulatedDMA2Stream + 8)
+        return (unsigned int) (stream - simulatedDMA2Stream) + 8;
+    return (unsigned int) (stream - simulatedDMA1Stream);
+}
+
+static volatile uint32_t *streamFlagRegister(DMA_Stream_TypeDef *stream) {
+    unsigned int number = streamNumber(stream);
+    DMA_TypeDef *dma = number < 8 ? DMA1 : DMA2;
+    return number % 8 < 4 ? &dma->LISR : &dma->HISR;
+}
+
+static void transferDMA(DMA_Stream_TypeDef *stream) {
+    if (!(stream->CR & DMA_SxCR_EN) || !stream->NDTR)
+        return;
+    unsigned int number = streamNumber(stream);
+    uint32_t memorySize = 1U << ((stream->CR >> 13) & 3);
+    uint32_t peripheralSize = 1U << ((stream->CR >> 11) & 3);
+    uint32_t memory = stream->M0AR + (stream->CR & DMA_SxCR_MINC ? (dmaLengths[number] - stream->NDTR) * memorySize : 0);
+    uint32_t value = 0;
+    if (stream->CR & DMA_SxCR_DIR_0) {
+        memcpy(&value, (const void *) (uintptr_t) memory, memorySize);
+        writePeripheral(stream->PAR, value, peripheralSize);
+    } else {
+        value = readPeripheral(stream->PAR, peripheralSize);
+        memcpy((void *) (uintptr_t) memory, &value, memorySize);
+    }
+    stream->NDTR--;
+    uint32_t flags = 0;
+    if (stream->NDTR == dmaLengths[number] / 2)
+        flags |= DMA_HTIF;
+    if (!stream->NDTR) {
+        flags |= DMA_TCIF;
+        if (stream->CR & DMA_SxCR_CIRC)
+            stream->NDTR = dmaLengths[number];
+        else
+            stream->CR &= ~DMA_SxCR_EN;
+    }
+    *streamFlagRegister(stream) |= flags << dmaFlagShifts[number % 8];
+}
+
+static void requestDMA(TIM_TypeDef *tim, uint16_t request) {
+    if (!(tim->DIER & request))
+        return;
+    for (unsigned int i = 0; i < sizeof(dmaRequests) / sizeof(*dmaRequests); i++)
+        if (dmaRequests[i].tim == tim && dmaRequests[i].request == request
+                && (dmaRequests[i].stream->CR & DMA_Channel_7) == dmaRequests[i].channel)
+            transferDMA(dmaRequests[i].stream);
+}
+
+static void compareChannels(TIM_TypeDef *tim) {
+    if (tim->CNT == tim->CCR1) {
+        tim->SR |= TIM_IT_CC1;
+        requestDMA(tim, TIM_DMA_CC1);
+    }
+    if (tim->CNT == tim->CCR2) {
+        tim->SR |= TIM_IT_CC2;
+        requestDMA(tim, TIM_DMA_CC2);
+    }
+}
+
+static uint64_t cyclesToNextTimerEvent(simulated_timer_t *timer) {
+    if (!(timer->tim->CR1 & TIM_CR1_CEN))
+        return UINT64_MAX;
+    return ticksToNextEvent(timer) * tickCycles(timer) - timer->phase;
+}
+
+static void advanceTimer(simulated_timer_t *timer, uint64_t cycles) {
+    TIM_TypeDef *tim = timer->tim;
+    if (!(tim->CR1 & TIM_CR1_CEN))
+        return;
+    uint64_t total = timer->phase + cycles;
+    uint64_t ticks = total / tickCycles(timer);
+    timer->phase = total % tickCycles(timer);
+    while (ticks) {
+        uint32_t toEvent = ticksToNextEvent(timer);
+        if (toEvent > ticks) {
+            tim->CNT += ticks;
+            return;
+        }
+        ticks -= toEvent;
+        if (toEvent == ticksToUpdate(timer)) {
+            tim->CNT = 0;
+            timer->autoReload = tim->ARR;
+            tim->SR |= TIM_IT_Update;
+            requestDMA(tim, TIM_DMA_Update);
+            compareChannels(tim);
+            if (tim->CR1 & TIM_CR1_OPM) {
+                tim->CR1 &= ~TIM_CR1_CEN;
+                timer->phase = 0;
+                return;
+            }
+        } else {
+            tim->CNT += toEvent;
+            compareChannels(tim);
+        }
+    }
+}
+
+/* clock */
+
+uint64_t simulationNow(void) {
+    return simulation.now;
+}
+
+static uint64_t nextTimerEvent() {
+    uint64_t next = UINT64_MAX;
+    for (unsigned int i = 0; i < TIMERS_COUNT; i++) {
+        uint64_t cycles = cyclesToNextTimerEvent(&timers[i]);
+        if (cycles != UINT64_MAX && simulation.now + cycles < next)
+            next = simulation.now + cycles;
+    }
+    return next;
+}
+
+static void moveClockTo(uint64_t date) {
+    for (unsigned int i = 0; i < TIMERS_COUNT; i++)
+        advanceTimer(&timers[i], date - simulation.now);
+    if ((DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk) && (CoreDebug->DEMCR & CoreDebug_DEMCR_TRCENA_Msk))
+        DWT->CYCCNT += (uint32_t) (date - simulation.now);
+    simulation.now = date;
+}
+
+static uint32_t dmaFlags(DMA_Stream_TypeDef *stream) {
+    return (*streamFlagRegister(stream) >> dmaFlagShifts[streamNumber(stream) % 8]) & 0x3F;
+}
+
+static void raiseInterrupts() {
+    if (simulation.interruptsMasked)
+        return;
+    for (unsigned int i = 0; i < TIMERS_COUNT; i++)
+        if (timers[i].handler && enabledIRQs[timers[i].irq] && (timers[i].tim->SR & timers[i].tim->DIER & 0xFF))
+            timers[i].handler();
+    for (unsigned int i = 0; i < sizeof(dmaInterrupts) / sizeof(*dmaInterrupts); i++) {
+        DMA_Stream_TypeDef *stream = dmaInterrupts[i].stream;
+        uint32_t enabled = (stream->CR & DMA_SxCR_HTIE ? DMA_HTIF : 0) | (stream->CR & DMA_SxCR_TCIE ? DMA_TCIF : 0);
+        if (enabledIRQs[dmaInterrupts[i].irq] && (dmaFlags(stream) & enabled))
+            dmaInterrupts[i].handler();
+    }
+}
+
+void simulationAdvance(uint64_t cycles) {
+    uint64_t target = simulation.now + cycles;
+    while (1) {
+        uint64_t next = nextTimerEvent();
+        if (simulation.nextSysTick < next)
+            next = simulation.nextSysTick;
+        if (next > target)
+            break;
+        moveClockTo(next);
+        raiseInterrupts();
+        if (simulation.now == simulation.nextSysTick) {
+            simulation.nextSysTick += simulation.sysTickPeriod;
+            SysTick_Handler();
+        }
+    }
+    moveClockTo(target);
+}
+
+void simulationMaskInterrupts(int masked) {
+    simulation.interruptsMasked = masked;
+    // the pending ones are served as soon as they are unmasked
+    raiseInterrupts();
+}
+
+int simulationSkipToNextTimerEvent(void) {
+    uint64_t next = nextTimerEvent();
+    if (next == UINT64_MAX)
+        return 0;
+    simulationAdvance(next - simulation.now);
+    return 1;
+}
+
+/* SPI */
+
+void SPI_I2S_DeInit(SPI_TypeDef *SPIx) {
+    SPIx->CR1 = 0;
+    SPIx->SR = SPI_SR_TXE;
+}
+
+void SPI_Init(SPI_TypeDef *SPIx, SPI_InitTypeDef *SPI_InitStruct) {
+    SPIx->CR1 = SPI_InitStruct->SPI_Mode | SPI_InitStruct->SPI_CPOL | SPI_InitStruct->SPI_BaudRatePrescaler;
+}
+
+void SPI_TIModeCmd(SPI_TypeDef *SPIx, FunctionalState NewState) {
+}
+
+void SPI_Cmd(SPI_TypeDef *SPIx, FunctionalState NewState) {
+}
+
+void SPI_I2S_DMACmd(SPI_TypeDef *SPIx, uint16_t SPI_I2S_DMAReq, FunctionalState NewState) {
+    if (NewState)
+        SPIx->CR2 |= SPI_I2S_DMAReq;
+    else
+        SPIx->CR2 &= ~SPI_I2S_DMAReq;
+}
+
+/* ADC and DMA: the joystick conversion is copied as is, the timer requests are served by advanceTimer(), the SPI one
+ * by exchangeSPI() */
+
+static void updateJoystickDMA() {
+    for (int i = 0; i < 8; i++) {
+        DMA_Stream_TypeDef *stream = &simulatedDMA2Stream[i];
+        if ((stream->CR & DMA_SxCR_EN) && stream->PAR == (uint32_t) (uintptr_t) &ADC1->DR)
+            for (uint32_t j = 0; j < stream->NDTR && j < sizeof(simulation.joystick); j++)
+                ((volatile uint8_t *) (uintptr_t) stream->M0AR)[j] = simulation.joystick[j];
+    }
+}
+
+void ADC_CommonInit(ADC_CommonInitTypeDef *ADC_CommonInitStruct) {
+}
+
+void ADC_Init(ADC_TypeDef *ADCx, ADC_InitTypeDef *ADC_InitStruct) {
+}
+
+void ADC_RegularChannelConfig(ADC_TypeDef *ADCx, uint8_t ADC_Channel, uint8_t Rank, uint8_t ADC_SampleTime) {
+}
+
+void ADC_DMARequestAfterLastTransferCmd(ADC_TypeDef *ADCx, FunctionalState NewState) {
+}
+
+void ADC_DMACmd(ADC_TypeDef *ADCx, FunctionalState NewState) {
+}
+
+void ADC_Cmd(ADC_TypeDef *ADCx, FunctionalState NewState) {
+}
+
+void ADC_SoftwareStartConv(ADC_TypeDef *ADCx) {
+    updateJoystickDMA();
+}
+
+void DMA_Init(DMA_Stream_TypeDef *DMAy_Streamx, DMA_InitTypeDef *DMA_InitStruct) {
+    DMAy_Streamx->CR = DMA_InitStruct->DMA_Channel | DMA_InitStruct->DMA_DIR | DMA_InitStruct->DMA_PeripheralInc
+            | DMA_InitStruct->DMA_MemoryInc | DMA_InitStruct->DMA_PeripheralDataSize
+            | DMA_InitStruct->DMA_MemoryDataSize | DMA_InitStruct->DMA_Mode | DMA_InitStruct->DMA_Priority;
+    DMA_SetCurrDataCounter(DMAy_Streamx, (uint16_t) DMA_InitStruct->DMA_BufferSize);
+    DMAy_Streamx->PAR = DMA_InitStruct->DMA_PeripheralBaseAddr;
+    DMAy_Streamx->M0AR = DMA_InitStruct->DMA_Memory0BaseAddr;
+}
+
+void DMA_Cmd(DMA_Stream_TypeDef *DMAy_Streamx, FunctionalState NewState) {
+    if (NewState)
+        DMAy_Streamx->CR |= DMA_SxCR_EN;
+    else
+        DMAy_Streamx->CR &= ~DMA_SxCR_EN;
+}
+
+void DMA_ITConfig(DMA_Stream_TypeDef *DMAy_Streamx, uint32_t DMA_IT, FunctionalState NewState) {
+    if (NewState)
+        DMAy_Streamx->CR |= DMA_IT;
+    else
+        DMAy_Streamx->CR &= ~DMA_IT;
+}
+
+// DMA_IT_xxIFn values carry the bit of the flag in LISR/HISR, the stream tells which register
+ITStatus DMA_GetITStatus(DMA_Stream_TypeDef *DMAy_Streamx, uint32_t DMA_IT) {
+    return (*streamFlagRegister(DMAy_Streamx) & DMA_IT & 0x0F7D0F7D) ? SET : RESET;
+}
+
+void DMA_ClearITPendingBit(DMA_Stream_TypeDef *DMAy_Streamx, uint32_t DMA_IT) {
+    *streamFlagRegister(DMAy_Streamx) &= ~(DMA_IT & 0x0F7D0F7D);
+}
+
+void DMA_SetCurrDataCounter(DMA_Stream_TypeDef *DMAy_Streamx, uint16_t Counter) {
+    DMAy_Streamx->NDTR = Counter;
+    dmaLengths[streamNumber(DMAy_Streamx)] = Counter;
+}
+
+uint16_t DMA_GetCurrDataCounter(DMA_Stream_TypeDef *DMAy_Streamx) {
+    return (uint16_t) DMAy_Streamx->NDTR;
+}
+
+/* harness side */
+
+void simulationSetInputPins(GPIO_TypeDef *gpio, uint16_t pins, int level) {
+    simulation.drivenPins[gpio - simulatedGPIO] |= pins;
+    if (level)
+        gpio->IDR |= pins;
+    else
+        gpio->IDR &= ~pins;
+}
+
+void simulationObserveGPIO(simulation_gpio_observer_t observer) {
+    simulation.gpioObserver = observer;
+}
+
+void simulationSetSPIInput(uint8_t raw) {
+    simulation.spiInput = raw;
+}
+
+uint8_t simulationGetSPIOutput(void) {
+    return simulation.spiOutput;
+}
+
+void simulationSetJoystick(uint8_t x, uint8_t y, uint8_t z) {
+    simulation.joystick[0] = x;
+    simulation.joystick[1] = y;
+    simulation.joystick[2] = z;
+    updateJoystickDMA();
+}
@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <string.h>
+#include "usb_core.h"
+#include "simulation.h"
+
+uint8_t USBD_StrDesc[USB_MAX_STR_DESC_SIZ];
+
+extern void OTG_FS_IRQHandler(void);
+
+typedef enum {
+    NO_EVENT = 0,
+    SETUP_EVENT,
+    CONTROL_DATA_EVENT,
+    DATA_IN_EVENT,
+    DATA_OUT_EVENT
+} usb_event_t;
+
+static struct {
+    USB_OTG_CORE_HANDLE *device;
+    usb_event_t pendingEvent;
+    uint8_t pendingEndpoint;
+    USB_SETUP_REQ setup;
+    uint8_t stalled;
+    uint8_t *controlInBuffer;
+    uint16_t controlInLength;
+    uint8_t *controlOutBuffer;
+    uint16_t controlOutLength;
+} usb = {
+        .device = 0,
+        .pendingEvent = NO_EVENT};
+
+static USB_OTG_EP *outEndpoint(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr) {
+    return &pdev->dev.out_ep[ep_addr & 0x7F];
+}
+
+void USBD_Init(USB_OTG_CORE_HANDLE *pdev, USB_OTG_CORE_ID_TypeDef coreID, USBD_DEVICE *pDevice,
+        USBD_Class_cb_TypeDef *class_cb, USBD_Usr_cb_TypeDef *usr_cb) {
+    memset(pdev, 0, sizeof(*pdev));
+    pdev->cfg.coreID = (uint8_t) coreID;
+    pdev->dev.usr_device = pDevice;
+    pdev->dev.class_cb = class_cb;
+    pdev->dev.usr_cb = usr_cb;
+    usb.device = pdev;
+    usr_cb->Init();
+}
+
+uint32_t DCD_EP_Open(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr, uint16_t ep_mps, uint8_t ep_type) {
+    USB_OTG_EP *ep = ep_addr & 0x80 ? &pdev->dev.in_ep[ep_addr & 0x7F] : outEndpoint(pdev, ep_addr);
+    ep->num = (uint8_t) (ep_addr & 0x7F);
+    ep->is_in = (uint8_t) ((ep_addr & 0x80) != 0);
+    ep->maxpacket = ep_mps;
+    ep->type = ep_type;
+    ep->armed = 0;
+    return 0;
+}
+
+uint32_t DCD_EP_Close(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr) {
+    USB_OTG_EP *ep = ep_addr & 0x80 ? &pdev->dev.in_ep[ep_addr & 0x7F] : outEndpoint(pdev, ep_addr);
+    ep->armed = 0;
+    return 0;
+}
+
+uint32_t DCD_EP_PrepareRx(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t buf_len) {
+    USB_OTG_EP *ep = outEndpoint(pdev, ep_addr);
+    ep->xfer_buff = pbuf;
+    ep->xfer_len = buf_len;
+    ep->xfer_count = 0;
+    ep->armed = 1;
+    return 0;
+}
+
+uint32_t DCD_EP_Tx(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t buf_len) {
+    USB_OTG_EP *ep = &pdev->dev.in_ep[ep_addr & 0x7F];
+    ep->xfer_buff = pbuf;
+    ep->xfer_len = buf_len;
+    ep->xfer_count = 0;
+    ep->armed = 1;
+    return 0;
+}
+
+void DCD_DevDisconnect(USB_OTG_CORE_HANDLE *pdev) {
+}
+
+void USB_OTG_UngateClock(USB_OTG_CORE_HANDLE *pdev) {
+}
+
+uint16_t USBD_GetRxCount(USB_OTG_CORE_HANDLE *pdev, uint8_t epnum) {
+    return (uint16_t) pdev->dev.out_ep[epnum].xfer_count;
+}
+
+void USBD_CtlError(USB_OTG_CORE_HANDLE *pdev, USB_SETUP_REQ *req) {
+    usb.stalled = 1;
+}
+
+USBD_Status USBD_CtlSendData(USB_OTG_CORE_HANDLE *pdev, uint8_t *buf, uint16_t len) {
+    usb.controlInBuffer = buf;
+    usb.controlInLength = len;
+    return USBD_OK;
+}
+
+USBD_Status USBD_CtlPrepareRx(USB_OTG_CORE_HANDLE *pdev, uint8_t *pbuf, uint16_t len) {
+    usb.controlOutBuffer = pbuf;
+    usb.controlOutLength = len;
+    return USBD_OK;
+}
+
+USBD_Status USBD_CtlSendStatus(USB_OTG_CORE_HANDLE *pdev) {
+    return USBD_OK;
+}
+
+void USBD_GetString(uint8_t *desc, uint8_t *unicode, uint16_t *len) {
+    uint16_t index = 2;
+    while (*desc && index + 2 <= USB_MAX_STR_DESC_SIZ) {
+        unicode[index++] = *desc++;
+        unicode[index++] = 0;
+    }
+    unicode[0] = (uint8_t) index;
+    unicode[1] = USB_DESC_TYPE_STRING;
+    *len = index;
+}
+
+// called by the firmware's OTG_FS_IRQHandler(), dispatches what the harness queued
+uint32_t USBD_OTG_ISR_Handler(USB_OTG_CORE_HANDLE *pdev) {
+    usb_event_t event = usb.pendingEvent;
+    usb.pendingEvent = NO_EVENT;
+    switch (event) {
+        case SETUP_EVENT:
+            pdev->dev.class_cb->Setup(pdev, &usb.setup);
+            break;
+        case CONTROL_DATA_EVENT:
+            if (pdev->dev.class_cb->EP0_RxReady)
+                pdev->dev.class_cb->EP0_RxReady(pdev);
+            else if (pdev->dev.class_cb->EP0_TxSent)
+                pdev->dev.class_cb->EP0_TxSent(pdev);
+            break;
+        case DATA_IN_EVENT:
+            if (pdev->dev.class_cb->DataIn)
+                pdev->dev.class_cb->DataIn(pdev, usb.pendingEndpoint);
+            break;
+        case DATA_OUT_EVENT:
+            pdev->dev.class_cb->DataOut(pdev, usb.pendingEndpoint);
+            break;
+        default:
+            break;
+    }
+    return 1;
+}
+
+static void raiseInterrupt(usb_event_t event) {
+    usb.pendingEvent = event;
+    OTG_FS_IRQHandler();
+}
+
+void simulationUSBConnect(void) {
+    usb.device->dev.device_status = USB_OTG_CONFIGURED;
+    usb.device->dev.class_cb->Init(usb.device, 1);
+    usb.device->dev.usr_cb->DeviceConfigured();
+}
+
+uint32_t simulationUSBBulkOut(uint8_t epnum, const uint8_t *data, uint32_t length) {
+    USB_OTG_EP *ep = &usb.device->dev.out_ep[epnum];
+    if (!ep->armed)
+        return 0;
+    uint32_t packetSize = ep->maxpacket ? ep->maxpacket : 64;
+    if (length > packetSize)
+        length = packetSize;
+    if (length > ep->xfer_len - ep->xfer_count)
+        length = ep->xfer_len - ep->xfer_count;
+    memcpy(ep->xfer_buff + ep->xfer_count, data, length);
+    ep->xfer_count += length;
+    // a transfer ends on a short packet or when the buffer is full
+    if (length < packetSize || ep->xfer_count == ep->xfer_len) {
+        ep->armed = 0;
+        usb.pendingEndpoint = epnum;
+        raiseInterrupt(DATA_OUT_EVENT);
+    }
+    return length;
+}
+
+int simulationUSBBulkOutZeroLength(uint8_t epnum) {
+    USB_OTG_EP *ep = &usb.device->dev.out_ep[epnum];
+    if (!ep->armed)
+        return 0;
+    // a short packet, it ends the transfer with what it received so far
+    ep->armed = 0;
+    usb.pendingEndpoint = epnum;
+    raiseInterrupt(DATA_OUT_EVENT);
+    return 1;
+}
+
+int32_t simulationUSBInterruptIn(uint8_t epnum, uint8_t *data, uint32_t length) {
+    USB_OTG_EP *ep = &usb.device->dev.in_ep[epnum];
+    if (!ep->armed)
+        return -1;
+    if (length > ep->xfer_len)
+        length = ep->xfer_len;
+    memcpy(data, ep->xfer_buff, length);
+    ep->armed = 0;
+    usb.pendingEndpoint = epnum;
+    raiseInterrupt(DATA_IN_EVENT);
+    return length;
+}
+
+static void setup(uint8_t bmRequest, uint8_t request, uint16_t value, uint16_t length) {
+    usb.setup = (USB_SETUP_REQ) {.bmRequest = bmRequest, .bRequest = request, .wValue = value, .wIndex = 0, .wLength = length};
+    usb.stalled = 0;
+    usb.controlInBuffer = 0;
+    usb.controlInLength = 0;
+    usb.controlOutBuffer = 0;
+    usb.controlOutLength = 0;
+    raiseInterrupt(SETUP_EVENT);
+}
+
+int32_t simulationUSBControlIn(uint8_t request, uint16_t value, uint8_t *data, uint16_t length) {
+    // device to host, vendor, interface
+    setup(0xC1, request, value, length);
+    if (usb.stalled)
+        return -1;
+    uint16_t count = usb.controlInLength < length ? usb.controlInLength : length;
+    memcpy(data, usb.controlInBuffer, count);
+    return count;
+}
+
+int32_t simulationUSBControlOut(uint8_t request, uint16_t value, const uint8_t *data, uint16_t length) {
+    // host to device, vendor, interface
+    setup(0x41, request, value, length);
+    if (usb.stalled)
+        return -1;
+    if (usb.controlOutBuffer) {
+        uint16_t count = usb.controlOutLength < length ? usb.controlOutLength : length;
+        memcpy(usb.controlOutBuffer, data, count);
+        raiseInterrupt(CONTROL_DATA_EVENT);
+        if (usb.stalled)
+            return -1;
+        return count;
+    }
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "microbench.h"
+
+// Times the firmware functions of the step path one at a time and prints a JSON object per line, sorted by name, so
+// that two revisions can be diffed. The best of REPETITIONS runs is kept, the others are the noise of the host.
+#define REPETITIONS     5
+// a few KB of each format, under the ring buffer size
+#define PROGRAM_BYTES   12000
+// see planner.c
+#define SEGMENT_RECORD_LENGTH 28
+#define SEGMENT_STEPS   64
+
+typedef uint64_t clock_value_t;
+
+static clock_value_t readClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000U + now.tv_nsec;
+}
+
+typedef struct {
+    const char *name;
+    program_type_t programType;
+    void (*run)(uint32_t calls);
+} benchmark_t;
+
+static uint8_t program[PROGRAM_BYTES];
+
+static uint8_t *writeUint32(uint8_t *cursor, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        *cursor++ = (uint8_t) (value >> 8 * i);
+    return cursor;
+}
+
+static uint8_t *writeFloat32(uint8_t *cursor, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return writeUint32(cursor, bits);
+}
+
+static uint8_t *writeVarint(uint8_t *cursor, uint32_t value) {
+    while (value > 0x7F) {
+        *cursor++ = (uint8_t) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *cursor++ = (uint8_t) value;
+    return cursor;
+}
+
+// the steps of a diagonal, with the durations of an acceleration ramp in the compressed one, see bench.c for the formats
+static uint32_t createProgram(program_type_t type) {
+    static const uint8_t pattern[] = {0b000011, 0b001111, 0b000011, 0b110011};
+    uint8_t *cursor = program;
+    uint8_t *end = program + PROGRAM_BYTES - SEGMENT_RECORD_LENGTH;
+    for (uint32_t i = 0; cursor < end; i++) {
+        uint8_t axes = pattern[i % sizeof(pattern)];
+        if (type == PROGRAM_STEPS) {
+            *cursor++ = (uint8_t) (20 + i % 8);
+            *cursor++ = 0;
+            *cursor++ = axes;
+        } else if (type == PROGRAM_WIDE_STEPS) {
+            *cursor++ = (uint8_t) (20 + i % 8);
+            *cursor++ = 0;
+            *cursor++ = (uint8_t) ((axes & 0b000001) | (axes & 0b000100) >> 1 | (axes & 0b010000) >> 2);
+            *cursor++ = (uint8_t) ((axes & 0b000010) >> 1 | (axes & 0b001000) >> 2 | (axes & 0b100000) >> 3);
+        } else if (type == PROGRAM_COMPRESSED_STEPS) {
+            int32_t delta = i % 2 ? -1 : 2;
+            uint32_t repeat = 1 + i % 5;
+            *cursor++ = (uint8_t) (axes | 0x40 | (repeat > 1 ? 0x80 : 0));
+            cursor = writeVarint(cursor, (uint32_t) (delta << 1) ^ (uint32_t) (delta >> 31));
+            if (repeat > 1)
+                cursor = writeVarint(cursor, repeat);
+        } else {
+            cursor = writeUint32(cursor, SEGMENT_STEPS);
+            cursor = writeUint32(cursor, i % 2 ? SEGMENT_STEPS * 5 / 8 : SEGMENT_STEPS * 3 / 4);
+            cursor = writeUint32(cursor, (uint32_t) -(SEGMENT_STEPS / 2));
+            cursor = writeFloat32(cursor, 0);
+            cursor = writeFloat32(cursor, 50);
+            cursor = writeFloat32(cursor, 0);
+            cursor = writeFloat32(cursor, 100);
+        }
+    }
+    return (uint32_t) (cursor - program);
+}
+
+static void runManualStep(uint32_t calls) {
+    probeNextManualStep(calls, 16);
+}
+
+static const benchmark_t benchmarks[] = {
+        {"beginStep", PROGRAM_STEPS, probeBeginStep},
+        {"bulkReception.wrapping", PROGRAM_STEPS, probeBulkReception},
+        {"filterSpiInput", PROGRAM_STEPS, probeFilterSpiInput},
+        {"nextManualStep", PROGRAM_STEPS, runManualStep},
+        {"nextProgramStep.compressed", PROGRAM_COMPRESSED_STEPS, probeNextProgramStep},
+        {"nextProgramStep.segments", PROGRAM_SEGMENTS, probeNextProgramStep},
+        {"nextProgramStep.steps", PROGRAM_STEPS, probeNextProgramStep},
+        {"nextProgramStep.wide", PROGRAM_WIDE_STEPS, probeNextProgramStep},
+        {"readBufferArray2", PROGRAM_STEPS, probeReadBufferArray}};
+
+int main(int argc, char **argv) {
+    uint32_t calls = argc > 1 ? (uint32_t) strtoul(argv[1], 0, 10) : 1000000;
+    const char *filter = argc > 2 ? argv[2] : "";
+    if (!calls) {
+        fprintf(stderr, "usage: %s [calls] [name prefix]\n", argv[0]);
+        return 1;
+    }
+    probeInit();
+    for (uint32_t i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+        const benchmark_t *benchmark = &benchmarks[i];
+        if (strncmp(benchmark->name, filter, strlen(filter)))
+            continue;
+        probeLoadProgram(benchmark->programType, program, createProgram(benchmark->programType));
+        // warms the caches and the branch predictors
+        benchmark->run(calls / 10 + 1);
+        uint64_t best = UINT64_MAX;
+        for (int repetition = 0; repetition < REPETITIONS; repetition++) {
+            clock_value_t start = readClock();
+            benchmark->run(calls);
+            clock_value_t elapsed = readClock() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        printf("{\"benchmark\": \"%s\", \"calls\": %u, \"ns_per_call\": %.2f}\n", benchmark->name, calls,
+                (double) best / calls);
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// The firmware functions on the step path, run in a loop by microbenchProbes.c, see microbench.c
+
+#include <stdint.h>
+#include "cnc.h"
+
+extern void probeInit();
+
+// cut to the ring buffer size
+extern void probeLoadProgram(program_type_t type, const uint8_t *bytes, uint32_t length);
+
+extern void probeNextProgramStep(uint32_t calls);
+
+extern void probeBeginStep(uint32_t calls);
+
+extern void probeNextManualStep(uint32_t calls, uint32_t stepsPerUpdate);
+
+extern void probeFilterSpiInput(uint32_t calls);
+
+extern void probeReadBufferArray(uint32_t calls);
+
+extern void probeBulkReception(uint32_t calls);
@@ -0,0 +1,103 @@
+// The firmware files are included here so that their static functions can be called in isolation by microbench.c.
+// Each probe runs its function in a loop, the state it needs is rewound between the calls without going through the
+// rest of the firmware.
+#include "../main.c"
+#include "../usb.c"
+#include "../manual.c"
+#include "../spiIO.c"
+#include "microbench.h"
+
+static volatile uint32_t sink;
+
+void probeInit() {
+    initMotorPins();
+    deriveStepTiming();
+    initManualControls();
+}
+
+// the program is copied once at the start of the ring, then replayed by rewinding the counters
+void probeLoadProgram(program_type_t type, const uint8_t *bytes, uint32_t length) {
+    length = length < CIRCULAR_BUFFER_SIZE ? length : CIRCULAR_BUFFER_SIZE;
+    memcpy(circularBufferBytes, bytes, length);
+    circularBuffer.writeCount = length;
+    circularBuffer.readCount = 0;
+    circularBuffer.programLength = length;
+    beginProgram(type, 1);
+}
+
+static void rewindProgram() {
+    circularBuffer.readCount = 0;
+    circularBuffer.programLength = circularBuffer.writeCount;
+    beginProgram(programDecoder.type, 1);
+}
+
+void probeNextProgramStep(uint32_t calls) {
+    for (uint32_t i = 0; i < calls; i++) {
+        step_t step = nextProgramStep();
+        if (!step.duration) {
+            rewindProgram();
+            step = nextProgramStep();
+        }
+        sink = step.duration;
+    }
+}
+
+// the step the TIM3 interrupt starts at every compare event
+void probeBeginStep(uint32_t calls) {
+    static const uint8_t pattern[] = {0b00000001, 0b00000110, 0b00000111, 0b00000010};
+    stepQueue.readCount = stepQueue.writeCount = 0;
+    for (uint32_t i = 0; i < STEP_QUEUE_SIZE; i++)
+        stepQueue.steps[i] = (step_t) {.duration = 10, .axes = {.steps = pattern[i % sizeof(pattern)], .directions = 0b101}};
+    stepQueue.writeCount = STEP_QUEUE_SIZE;
+    for (uint32_t i = 0; i < calls; i++) {
+        if (!queuedSteps())
+            stepQueue.readCount -= STEP_QUEUE_SIZE;
+        beginStep();
+    }
+    sink = cncMemory.position.speed;
+}
+
+// the joystick pushed diagonally, the periods are recomputed every stepsPerUpdate steps like at a few kHz
+void probeNextManualStep(uint32_t calls, uint32_t stepsPerUpdate) {
+    for (int i = 0; i < 3; i++)
+        manualControlStatus.filteredAdc[i] = manualControlStatus.zero[i] + ((i == 2 ? 20 : 90) << ADC_FRACTION_BITS);
+    resetJog();
+    for (uint32_t i = 0; i < calls; i++) {
+        if (i % stepsPerUpdate == 0)
+            manualControlStatus.inputSequence++;
+        sink = nextManualStep().duration;
+    }
+}
+
+// a limit switch and the spindle bits bouncing
+void probeFilterSpiInput(uint32_t calls) {
+    for (uint32_t i = 0; i < calls; i++) {
+        cncMemory.unfilteredSpiInput = (uint8_t) (i & 4 ? 0b10100101 : 0b01100011);
+        filterSpiInput(1);
+    }
+    sink = cncMemory.unfilteredSpiInput;
+}
+
+// a step record at a time, like the step format decoder
+void probeReadBufferArray(uint32_t calls) {
+    uint8_t record[3];
+    circularBuffer.readCount = 0;
+    circularBuffer.writeCount = CIRCULAR_BUFFER_SIZE - CIRCULAR_BUFFER_SIZE % 3;
+    for (uint32_t i = 0; i < calls; i++) {
+        if (!readBufferArray2(sizeof(record), record))
+            circularBuffer.readCount = 0;
+        sink = record[2];
+    }
+}
+
+// a full packet received across the end of the ring, its tail is moved to the start
+void probeBulkReception(uint32_t calls) {
+    cncMemory.state = READY;
+    for (uint32_t i = 0; i < calls; i++) {
+        circularBuffer.readCount = circularBuffer.writeCount = CIRCULAR_BUFFER_SIZE - BULK_PACKET_SIZE / 2;
+        circularBuffer.armed = 1;
+        usbDevice.dev.out_ep[BULK_ENDPOINT_NUM].xfer_count = BULK_PACKET_SIZE;
+        cncDataOut(&usbDevice, BULK_ENDPOINT_NUM);
+    }
+    sink = circularBuffer.writeCount;
+}
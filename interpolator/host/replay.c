@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "stm32f4xx_conf.h"
+#include "simulation.h"
+#include "cnc.h"
+
+// Plays a recorded bulk stream through the firmware in virtual time and writes what the motor pins did.
+// The input is either the raw bytes handed to bulkTransfer() (see Runner.startCapture() in runner.js), or a pcap file
+// of a Linux usbmon capture (Wireshark, tcpdump -i usbmonN), where the submissions to the bulk OUT endpoint are kept.
+// Nothing depends on the host clock: the same stream always gives the same timeline.
+
+// the board wiring, see motorsPinout and eStopPinout in main.c, uiPinout in manual.c
+static const uint16_t stepPins[] = {GPIO_Pin_3, GPIO_Pin_5, GPIO_Pin_7, GPIO_Pin_9, GPIO_Pin_11, GPIO_Pin_13};
+static const uint16_t directionPins[] = {GPIO_Pin_4, GPIO_Pin_6, GPIO_Pin_8, GPIO_Pin_10, GPIO_Pin_12, GPIO_Pin_2};
+static const char axisNames[] = "XYZABC";
+#define ESTOP_PIN           GPIO_Pin_14
+#define TOOL_PROBE_PIN      GPIO_Pin_8
+// nothing asserted on the IO board, see spiInputPolarity in spiIO.c
+#define SPI_IDLE_INPUT      0xE3
+
+// see credit_report_t in usb.c
+#define CREDIT_REPORT_WORDS 6
+// see createProgramEncoder() in worker.js, the 3 bytes after the type are the length of the program
+#define PROGRAM_HEADER_LENGTH 8
+
+// rough cost of a pass of the superloop on the F4, the virtual clock moves by that much at each pass
+#define LOOP_CYCLES         200
+// an hour of machine time, when the stream leaves the firmware waiting for more
+#define DEFAULT_MAX_SECONDS 3600
+
+// pcap, see https://wiki.wireshark.org/Development/LibpcapFileFormat
+#define PCAP_MAGIC              0xA1B2C3D4U
+#define PCAP_NANOSECONDS_MAGIC  0xA1B23C4DU
+#define PCAP_HEADER_LENGTH      24
+#define PCAP_RECORD_HEADER_LENGTH 16
+#define LINKTYPE_USB_LINUX      189
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+// struct usbmon_packet of the kernel, the mmapped variant has 16 more bytes before the data
+#define USBMON_HEADER_LENGTH    48
+#define USBMON_MMAPPED_HEADER_LENGTH 64
+#define USBMON_SUBMISSION       'S'
+#define USBMON_BULK             3
+#define USBMON_DATA_PRESENT     0
+
+extern void firmwareMain(void);
+
+extern void __real_handleSPI(void);
+
+typedef enum {
+    VCD_TIMELINE = 0,
+    CSV_TIMELINE
+} timeline_format_t;
+
+static struct {
+    uint8_t *stream;
+    uint32_t length;
+    uint32_t sent;
+    // end of the program being sent, Runner sends each program in a transfer of its own
+    uint32_t transferEnd;
+    // the last program filled its last packet, the transfer is still open
+    uint8_t endTransfer;
+    uint32_t consumed;
+    uint8_t hasCredits;
+    uint32_t sendLimit;
+    uint64_t maxCycles;
+    FILE *output;
+    timeline_format_t format;
+    // last values written to the timeline
+    uint64_t lastTime;
+    uint16_t pins;
+    int32_t position[AXES_COUNT];
+    int state;
+    uint32_t programID;
+    uint64_t steps[AXES_COUNT];
+    jmp_buf end;
+} replay;
+
+static uint32_t readLittleEndian(const uint8_t *bytes, int length) {
+    uint32_t value = 0;
+    for (int i = length - 1; i >= 0; i--)
+        value = value << 8 | bytes[i];
+    return value;
+}
+
+static uint8_t *readFile(const char *path, uint32_t *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    uint32_t capacity = 1 << 16;
+    uint8_t *bytes = malloc(capacity);
+    *length = 0;
+    size_t read;
+    while ((read = fread(bytes + *length, 1, capacity - *length, file)) > 0) {
+        *length += (uint32_t) read;
+        if (*length == capacity)
+            bytes = realloc(bytes, capacity *= 2);
+    }
+    fclose(file);
+    return bytes;
+}
+
+// keeps the data of the bulk OUT submissions to BULK_ENDPOINT_NUM in place, returns the stream length or -1
+static int64_t extractUsbmonStream(uint8_t *file, uint32_t length) {
+    if (length < PCAP_HEADER_LENGTH)
+        return -1;
+    uint32_t magic = readLittleEndian(file, 4);
+    if (magic != PCAP_MAGIC && magic != PCAP_NANOSECONDS_MAGIC)
+        return -1;
+    uint32_t linkType = readLittleEndian(file + 20, 4);
+    uint32_t headerLength;
+    if (linkType == LINKTYPE_USB_LINUX)
+        headerLength = USBMON_HEADER_LENGTH;
+    else if (linkType == LINKTYPE_USB_LINUX_MMAPPED)
+        headerLength = USBMON_MMAPPED_HEADER_LENGTH;
+    else
+        return -1;
+    uint32_t offset = PCAP_HEADER_LENGTH;
+    uint32_t streamLength = 0;
+    while (offset + PCAP_RECORD_HEADER_LENGTH <= length) {
+        uint32_t captured = readLittleEndian(file + offset + 8, 4);
+        const uint8_t *packet = file + offset + PCAP_RECORD_HEADER_LENGTH;
+        offset += PCAP_RECORD_HEADER_LENGTH + captured;
+        if (offset > length || captured < headerLength)
+            break;
+        // the data of a bulk OUT transfer is captured when the host submits it
+        if (packet[8] != USBMON_SUBMISSION || packet[9] != USBMON_BULK || packet[10] != (EP_OUT | BULK_ENDPOINT_NUM)
+                || packet[15] != USBMON_DATA_PRESENT)
+            continue;
+        uint32_t dataLength = readLittleEndian(packet + 36, 4);
+        if (dataLength > captured - headerLength) {
+            fprintf(stderr, "truncated bulk transfer in the capture, raise the snapshot length\n");
+            return -1;
+        }
+        // the data only moves backwards
+        memmove(file + streamLength, packet + headerLength, dataLength);
+        streamLength += dataLength;
+    }
+    return streamLength;
+}
+
+static uint64_t nanoseconds(uint64_t cycles) {
+    return cycles / SystemCoreClock * 1000000000U + cycles % SystemCoreClock * 1000000000U / SystemCoreClock;
+}
+
+static void writeTime() {
+    uint64_t now = nanoseconds(simulationNow());
+    if (replay.format == VCD_TIMELINE && now != replay.lastTime)
+        fprintf(replay.output, "#%llu\n", (unsigned long long) now);
+    replay.lastTime = now;
+}
+
+static void writeBinary(uint32_t value, char identifier) {
+    char bits[33];
+    int length = 0;
+    do {
+        bits[length++] = (char) ('0' + (value & 1));
+        value >>= 1;
+    } while (value);
+    fputc('b', replay.output);
+    while (length)
+        fputc(bits[--length], replay.output);
+    fprintf(replay.output, " %c\n", identifier);
+}
+
+// VCD identifiers: 'A' + axis for the step pins, 'a' + axis for the direction pins, '0' + axis for the positions,
+// 's' for the state and 'p' for the program ID; the pins are wires, the rest are integers
+static void writeEvent(const char *name, int axis, int32_t value, char identifier, int wire) {
+    writeTime();
+    if (replay.format == CSV_TIMELINE) {
+        fprintf(replay.output, "%llu,%s,", (unsigned long long) replay.lastTime, name);
+        if (axis >= 0)
+            fputc(axisNames[axis], replay.output);
+        fprintf(replay.output, ",%d\n", value);
+    } else if (wire)
+        fprintf(replay.output, "%d%c\n", value, identifier);
+    else
+        writeBinary((uint32_t) value, identifier);
+}
+
+static void writeVCDHeader() {
+    fprintf(replay.output, "$timescale 1ns $end\n$scope module interpolator $end\n");
+    for (int i = 0; i < AXES_COUNT; i++) {
+        fprintf(replay.output, "$var wire 1 %c step_%c $end\n", 'A' + i, axisNames[i]);
+        fprintf(replay.output, "$var wire 1 %c direction_%c $end\n", 'a' + i, axisNames[i]);
+        fprintf(replay.output, "$var integer 32 %c position_%c $end\n", '0' + i, axisNames[i]);
+    }
+    fprintf(replay.output, "$var integer 8 s state $end\n$var integer 32 p programID $end\n");
+    fprintf(replay.output, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+    for (int i = 0; i < AXES_COUNT; i++) {
+        fprintf(replay.output, "0%c\n0%c\n", 'A' + i, 'a' + i);
+        writeBinary(0, (char) ('0' + i));
+    }
+    writeBinary(READY, 's');
+    writeBinary(0, 'p');
+    fprintf(replay.output, "$end\n");
+}
+
+// the firmware updates the position and the state around the pin writes, they are compared at each pin change and
+// at each superloop pass
+static void sampleMemory() {
+    for (int i = 0; i < AXES_COUNT; i++)
+        if (cncMemory.position.axes[i] != replay.position[i]) {
+            replay.position[i] = cncMemory.position.axes[i];
+            writeEvent("position", i, replay.position[i], (char) ('0' + i), 0);
+        }
+    if ((int) cncMemory.state != replay.state) {
+        replay.state = cncMemory.state;
+        writeEvent("state", -1, replay.state, 's', 0);
+    }
+    if (playedProgramID() != replay.programID) {
+        replay.programID = playedProgramID();
+        writeEvent("programID", -1, (int32_t) replay.programID, 'p', 0);
+    }
+}
+
+static void recordPins(GPIO_TypeDef *gpio, uint16_t previous, uint16_t current) {
+    if (gpio != GPIOE)
+        return;
+    for (int i = 0; i < AXES_COUNT; i++) {
+        if ((current ^ replay.pins) & directionPins[i])
+            writeEvent("direction", i, !!(current & directionPins[i]), (char) ('a' + i), 1);
+        if ((current ^ replay.pins) & stepPins[i]) {
+            writeEvent("step", i, !!(current & stepPins[i]), (char) ('A' + i), 1);
+            if (current & stepPins[i])
+                replay.steps[i]++;
+        }
+    }
+    replay.pins = current;
+    sampleMemory();
+}
+
+static void pollCredits() {
+    uint32_t report[CREDIT_REPORT_WORDS];
+    if (simulationUSBInterruptIn(INTERRUPT_ENDPOINT_NUM, (uint8_t *) report, sizeof(report)) != sizeof(report))
+        return;
+    replay.hasCredits = 1;
+    replay.consumed = report[1];
+    // consumed bytes + buffer size
+    replay.sendLimit = report[1] + report[4];
+}
+
+// the header of the program starting at start gives the end of its transfer
+static uint32_t programEnd(uint32_t start) {
+    if (start + PROGRAM_HEADER_LENGTH > replay.length)
+        return replay.length;
+    uint32_t end = start + PROGRAM_HEADER_LENGTH + readLittleEndian(replay.stream + start + 1, 3);
+    return end < replay.length ? end : replay.length;
+}
+
+// the packets are sent as soon as the credits allow, like Runner does, the recorded pauses are not replayed
+static void feedUSB() {
+    pollCredits();
+    while (replay.sent < replay.length || replay.endTransfer) {
+        if (replay.endTransfer) {
+            if (!simulationUSBBulkOutZeroLength(BULK_ENDPOINT_NUM))
+                break;
+            replay.endTransfer = 0;
+            continue;
+        }
+        if (replay.sent == replay.transferEnd)
+            replay.transferEnd = programEnd(replay.sent);
+        uint32_t packet = replay.transferEnd - replay.sent < BULK_PACKET_SIZE ? replay.transferEnd - replay.sent
+                : BULK_PACKET_SIZE;
+        if (replay.hasCredits && (int32_t) (replay.sendLimit - replay.sent) < (int32_t) packet)
+            break;
+        uint32_t accepted = simulationUSBBulkOut(BULK_ENDPOINT_NUM, replay.stream + replay.sent, packet);
+        if (!accepted)
+            break;
+        replay.sent += accepted;
+        replay.endTransfer = replay.sent == replay.transferEnd && accepted == BULK_PACKET_SIZE;
+    }
+}
+
+// handleSPI() is called once per pass of the superloop, the linker redirects the call here.
+void __wrap_handleSPI(void) {
+    static int started = 0;
+    if (!started) {
+        started = 1;
+        simulationUSBConnect();
+    }
+    feedUSB();
+    sampleMemory();
+    // READY comes when the program is decoded, the last steps are still in the queue until the timer stops
+    if (replay.sent == replay.length && replay.consumed == replay.length && cncMemory.state == READY
+            && !(TIM3->CR1 & TIM_CR1_CEN))
+        longjmp(replay.end, 1);
+    if (simulationNow() > replay.maxCycles)
+        longjmp(replay.end, 2);
+    // unlike the bench, the time spent waiting for the timer is played, it is in the timeline
+    simulationAdvance(LOOP_CYCLES);
+    __real_handleSPI();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s stream [timeline.vcd|timeline.csv|-] [max seconds]\n", argv[0]);
+        return 1;
+    }
+    replay.stream = readFile(argv[1], &replay.length);
+    if (!replay.stream) {
+        perror(argv[1]);
+        return 1;
+    }
+    int64_t captured = extractUsbmonStream(replay.stream, replay.length);
+    if (captured >= 0)
+        replay.length = (uint32_t) captured;
+    const char *timeline = argc > 2 ? argv[2] : "-";
+    size_t nameLength = strlen(timeline);
+    replay.format = nameLength > 4 && !strcmp(timeline + nameLength - 4, ".csv") ? CSV_TIMELINE : VCD_TIMELINE;
+    replay.output = strcmp(timeline, "-") ? fopen(timeline, "w") : stdout;
+    if (!replay.output) {
+        perror(timeline);
+        return 1;
+    }
+    replay.maxCycles = (uint64_t) (argc > 3 ? strtoul(argv[3], 0, 10) : DEFAULT_MAX_SECONDS) * SystemCoreClock;
+    if (replay.format == VCD_TIMELINE)
+        writeVCDHeader();
+    else
+        fprintf(replay.output, "ns,event,axis,value\n");
+    replay.state = READY;
+    simulationObserveGPIO(recordPins);
+    simulationSetInputPins(GPIOE, ESTOP_PIN, 1);
+    simulationSetInputPins(GPIOA, TOOL_PROBE_PIN, 1);
+    simulationSetSPIInput(SPI_IDLE_INPUT);
+    int result = setjmp(replay.end);
+    if (!result)
+        firmwareMain();
+    sampleMemory();
+    if (replay.output != stdout)
+        fclose(replay.output);
+    fprintf(stderr, "%s: %u bytes, %u sent, %u consumed\n", captured >= 0 ? "usbmon capture" : "raw stream",
+            replay.length, replay.sent, replay.consumed);
+    fprintf(stderr, "steps:");
+    for (int i = 0; i < AXES_COUNT; i++)
+        fprintf(stderr, " %llu", (unsigned long long) replay.steps[i]);
+    fprintf(stderr, "\nfinal position:");
+    for (int i = 0; i < AXES_COUNT; i++)
+        fprintf(stderr, " %d", (int) cncMemory.position.axes[i]);
+    fprintf(stderr, "\nsimulated seconds: %.6f\n", (double) simulationNow() / SystemCoreClock);
+    if (result != 1) {
+        fprintf(stderr, "timed out in state %d\n", cncMemory.state);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+// Host side of the simulated board: what the harness uses to drive the firmware and observe it.
+// Time is virtual and counted in core clock cycles, it only moves when the harness advances it.
+
+#include <stdint.h>
+#include "stm32f4xx_conf.h"
+
+typedef void (*simulation_gpio_observer_t)(GPIO_TypeDef *gpio, uint16_t previous, uint16_t current);
+
+extern uint64_t simulationNow(void);
+
+// advances the virtual clock, delivering SysTick and timer events on the way
+extern void simulationAdvance(uint64_t cycles);
+
+// advances the virtual clock up to the next timer event, returns 0 if no timer is running
+extern int simulationSkipToNextTimerEvent(void);
+
+// plays a late handler: while masked, the timer and DMA flags are raised but their handlers are not called, the
+// pending ones run when the interrupts are unmasked
+extern void simulationMaskInterrupts(int masked);
+
+extern void simulationSetInputPins(GPIO_TypeDef *gpio, uint16_t pins, int level);
+
+extern void simulationObserveGPIO(simulation_gpio_observer_t observer);
+
+// raw level of the IO board input pins, sampled by the latch pulse and shifted in by the next SPI exchange
+extern void simulationSetSPIInput(uint8_t raw);
+
+// the IO board outputs, the byte of the exchange before the last latch pulse
+extern uint8_t simulationGetSPIOutput(void);
+
+extern void simulationSetJoystick(uint8_t x, uint8_t y, uint8_t z);
+
+extern void simulationUSBConnect(void);
+
+// sends one bulk packet (at most 64 bytes), returns the accepted length, 0 means the endpoint NAKed
+extern uint32_t simulationUSBBulkOut(uint8_t epnum, const uint8_t *data, uint32_t length);
+
+// ends the transfer like the host does after a transfer filling its last packet, returns 0 when the endpoint NAKed
+extern int simulationUSBBulkOutZeroLength(uint8_t epnum);
+
+// polls an interrupt IN endpoint, returns the packet length or -1 when the endpoint NAKed
+extern int32_t simulationUSBInterruptIn(uint8_t epnum, uint8_t *data, uint32_t length);
+
+// vendor control requests to the interface, return the data length or -1 when the device stalled
+extern int32_t simulationUSBControlIn(uint8_t request, uint16_t value, uint8_t *data, uint16_t length);
+
+extern int32_t simulationUSBControlOut(uint8_t request, uint16_t value, const uint8_t *data, uint16_t length);
+
+// the flash array survives the firmware: a harness saves it and loads it in the next process to simulate a power cycle
+extern void simulationLoadFlash(const uint8_t *image, uint32_t length);
+
+extern const uint8_t *simulationFlash(void);
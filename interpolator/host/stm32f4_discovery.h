@@ -0,0 +1,16 @@
+#pragma once
+
+// Stand-in for the STM32F4-DISCOVERY board support package.
+
+typedef enum {
+    LED4 = 0,
+    LED3 = 1,
+    LED5 = 2,
+    LED6 = 3
+} Led_TypeDef;
+
+extern void STM_EVAL_LEDInit(Led_TypeDef Led);
+
+extern void STM_EVAL_LEDOn(Led_TypeDef Led);
+
+extern void STM_EVAL_LEDOff(Led_TypeDef Led);
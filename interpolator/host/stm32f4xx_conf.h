@@ -0,0 +1,466 @@
+#pragma once
+
+// Stand-in for the STM32F4 standard peripheral library, only what the firmware uses.
+// The peripherals are plain structs in host memory, their behaviour is simulated in hal.c
+
+#include <stdint.h>
+#include <string.h>
+#include "core_cm4.h"
+#include "core_cmInstr.h"
+
+typedef enum {
+    DISABLE = 0,
+    ENABLE = !DISABLE
+} FunctionalState;
+
+typedef enum {
+    RESET = 0,
+    SET = !RESET
+} FlagStatus, ITStatus;
+
+extern uint32_t SystemCoreClock;
+
+extern void SystemInit(void);
+
+typedef enum {
+    DMA1_Stream3_IRQn = 14,
+    EXTI15_10_IRQn = 40,
+    TIM3_IRQn = 29,
+    DMA2_Stream3_IRQn = 59,
+    OTG_FS_IRQn = 67
+} IRQn_Type;
+
+/* NVIC (misc.h) */
+
+typedef struct {
+    uint8_t NVIC_IRQChannel;
+    uint8_t NVIC_IRQChannelPreemptionPriority;
+    uint8_t NVIC_IRQChannelSubPriority;
+    FunctionalState NVIC_IRQChannelCmd;
+} NVIC_InitTypeDef;
+
+extern void NVIC_Init(NVIC_InitTypeDef *NVIC_InitStruct);
+
+/* GPIO */
+
+typedef struct {
+    volatile uint32_t MODER, OTYPER, OSPEEDR, PUPDR, IDR, ODR;
+    volatile uint16_t BSRRL, BSRRH;
+    volatile uint32_t LCKR, AFR[2];
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef simulatedGPIO[5];
+#define GPIOA (&simulatedGPIO[0])
+#define GPIOB (&simulatedGPIO[1])
+#define GPIOC (&simulatedGPIO[2])
+#define GPIOD (&simulatedGPIO[3])
+#define GPIOE (&simulatedGPIO[4])
+
+#define GPIO_Pin_0  ((uint16_t)0x0001)
+#define GPIO_Pin_1  ((uint16_t)0x0002)
+#define GPIO_Pin_2  ((uint16_t)0x0004)
+#define GPIO_Pin_3  ((uint16_t)0x0008)
+#define GPIO_Pin_4  ((uint16_t)0x0010)
+#define GPIO_Pin_5  ((uint16_t)0x0020)
+#define GPIO_Pin_6  ((uint16_t)0x0040)
+#define GPIO_Pin_7  ((uint16_t)0x0080)
+#define GPIO_Pin_8  ((uint16_t)0x0100)
+#define GPIO_Pin_9  ((uint16_t)0x0200)
+#define GPIO_Pin_10 ((uint16_t)0x0400)
+#define GPIO_Pin_11 ((uint16_t)0x0800)
+#define GPIO_Pin_12 ((uint16_t)0x1000)
+#define GPIO_Pin_13 ((uint16_t)0x2000)
+#define GPIO_Pin_14 ((uint16_t)0x4000)
+#define GPIO_Pin_15 ((uint16_t)0x8000)
+
+typedef enum {
+    GPIO_Mode_IN = 0x00,
+    GPIO_Mode_OUT = 0x01,
+    GPIO_Mode_AF = 0x02,
+    GPIO_Mode_AN = 0x03
+} GPIOMode_TypeDef;
+
+typedef enum {
+    GPIO_OType_PP = 0x00,
+    GPIO_OType_OD = 0x01
+} GPIOOType_TypeDef;
+
+typedef enum {
+    GPIO_Speed_2MHz = 0x00,
+    GPIO_Speed_25MHz = 0x01,
+    GPIO_Speed_50MHz = 0x02,
+    GPIO_Speed_100MHz = 0x03
+} GPIOSpeed_TypeDef;
+
+typedef enum {
+    GPIO_PuPd_NOPULL = 0x00,
+    GPIO_PuPd_UP = 0x01,
+    GPIO_PuPd_DOWN = 0x02
+} GPIOPuPd_TypeDef;
+
+typedef struct {
+    uint32_t GPIO_Pin;
+    GPIOMode_TypeDef GPIO_Mode;
+    GPIOSpeed_TypeDef GPIO_Speed;
+    GPIOOType_TypeDef GPIO_OType;
+    GPIOPuPd_TypeDef GPIO_PuPd;
+} GPIO_InitTypeDef;
+
+#define GPIO_AF_SPI2 ((uint8_t)0x05)
+
+extern void GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_InitStruct);
+
+extern void GPIO_PinAFConfig(GPIO_TypeDef *GPIOx, uint16_t GPIO_PinSource, uint8_t GPIO_AF);
+
+extern uint8_t GPIO_ReadInputDataBit(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+
+extern void GPIO_SetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+
+extern void GPIO_ResetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+
+/* RCC */
+
+#define RCC_AHB1Periph_GPIOA ((uint32_t)0x00000001)
+#define RCC_AHB1Periph_GPIOB ((uint32_t)0x00000002)
+#define RCC_AHB1Periph_GPIOE ((uint32_t)0x00000010)
+#define RCC_AHB1Periph_DMA1  ((uint32_t)0x00200000)
+#define RCC_AHB1Periph_DMA2  ((uint32_t)0x00400000)
+#define RCC_APB1Periph_TIM3  ((uint32_t)0x00000002)
+#define RCC_APB1Periph_TIM7  ((uint32_t)0x00000020)
+#define RCC_APB1Periph_SPI2  ((uint32_t)0x00004000)
+#define RCC_APB2Periph_TIM8  ((uint32_t)0x00000002)
+#define RCC_APB2Periph_ADC1  ((uint32_t)0x00000100)
+
+extern void RCC_AHB1PeriphClockCmd(uint32_t RCC_AHB1Periph, FunctionalState NewState);
+
+extern void RCC_APB1PeriphClockCmd(uint32_t RCC_APB1Periph, FunctionalState NewState);
+
+extern void RCC_APB2PeriphClockCmd(uint32_t RCC_APB2Periph, FunctionalState NewState);
+
+/* EXTI */
+
+#define EXTI_Line14 ((uint32_t)0x04000)
+#define EXTI_Line18 ((uint32_t)0x40000)
+#define EXTI_PortSourceGPIOE ((uint8_t)0x04)
+#define EXTI_PinSource14 ((uint8_t)0x0E)
+
+extern void EXTI_ClearITPendingBit(uint32_t EXTI_Line);
+
+/* TIM */
+
+typedef struct {
+    volatile uint32_t CR1, CR2, SMCR, DIER, SR, EGR, CCMR1, CCMR2, CCER, CNT, PSC, ARR, RCR;
+    volatile uint32_t CCR1, CCR2, CCR3, CCR4, BDTR, DCR, DMAR;
+} TIM_TypeDef;
+
+extern TIM_TypeDef simulatedTIM3;
+#define TIM3 (&simulatedTIM3)
+extern TIM_TypeDef simulatedTIM8;
+#define TIM8 (&simulatedTIM8)
+extern TIM_TypeDef simulatedTIM7;
+#define TIM7 (&simulatedTIM7)
+
+#define TIM_CR1_CEN ((uint16_t)0x0001)
+#define TIM_CR1_URS ((uint16_t)0x0004)
+#define TIM_CR1_OPM ((uint16_t)0x0008)
+#define TIM_CR1_ARPE ((uint16_t)0x0080)
+
+#define TIM_IT_Update ((uint16_t)0x0001)
+#define TIM_IT_CC1 ((uint16_t)0x0002)
+#define TIM_IT_CC2 ((uint16_t)0x0004)
+#define TIM_DMA_Update ((uint16_t)0x0100)
+#define TIM_DMA_CC1 ((uint16_t)0x0200)
+#define TIM_DMA_CC2 ((uint16_t)0x0400)
+
+#define TIM_OPMode_Single ((uint16_t)0x0008)
+#define TIM_OPMode_Repetitive ((uint16_t)0x0000)
+#define TIM_UpdateSource_Global ((uint16_t)0x0000)
+#define TIM_UpdateSource_Regular ((uint16_t)0x0001)
+#define TIM_EventSource_Update ((uint16_t)0x0001)
+#define TIM_PSCReloadMode_Update ((uint16_t)0x0000)
+#define TIM_PSCReloadMode_Immediate ((uint16_t)0x0001)
+#define TIM_CounterMode_Up ((uint16_t)0x0000)
+#define TIM_OCMode_Timing ((uint16_t)0x0000)
+#define TIM_OCMode_PWM1 ((uint16_t)0x0060)
+#define TIM_OutputState_Enable ((uint16_t)0x0001)
+#define TIM_OCPolarity_High ((uint16_t)0x0000)
+#define TIM_OCPreload_Disable ((uint16_t)0x0000)
+#define TIM_OCPreload_Enable ((uint16_t)0x0008)
+
+typedef struct {
+    uint16_t TIM_Prescaler;
+    uint16_t TIM_CounterMode;
+    uint32_t TIM_Period;
+    uint16_t TIM_ClockDivision;
+    uint8_t TIM_RepetitionCounter;
+} TIM_TimeBaseInitTypeDef;
+
+typedef struct {
+    uint16_t TIM_OCMode;
+    uint16_t TIM_OutputState;
+    uint16_t TIM_OutputNState;
+    uint32_t TIM_Pulse;
+    uint16_t TIM_OCPolarity;
+    uint16_t TIM_OCNPolarity;
+    uint16_t TIM_OCIdleState;
+    uint16_t TIM_OCNIdleState;
+} TIM_OCInitTypeDef;
+
+extern void TIM_TimeBaseInit(TIM_TypeDef *TIMx, TIM_TimeBaseInitTypeDef *TIM_TimeBaseInitStruct);
+
+extern void TIM_OC1Init(TIM_TypeDef *TIMx, TIM_OCInitTypeDef *TIM_OCInitStruct);
+
+extern void TIM_OC2Init(TIM_TypeDef *TIMx, TIM_OCInitTypeDef *TIM_OCInitStruct);
+
+extern void TIM_OC1PreloadConfig(TIM_TypeDef *TIMx, uint16_t TIM_OCPreload);
+
+extern void TIM_Cmd(TIM_TypeDef *TIMx, FunctionalState NewState);
+
+extern void TIM_UpdateRequestConfig(TIM_TypeDef *TIMx, uint16_t TIM_UpdateSource);
+
+extern void TIM_SelectOnePulseMode(TIM_TypeDef *TIMx, uint16_t TIM_OPMode);
+
+extern void TIM_ITConfig(TIM_TypeDef *TIMx, uint16_t TIM_IT, FunctionalState NewState);
+
+extern ITStatus TIM_GetITStatus(TIM_TypeDef *TIMx, uint16_t TIM_IT);
+
+extern void TIM_ClearITPendingBit(TIM_TypeDef *TIMx, uint16_t TIM_IT);
+
+extern void TIM_ARRPreloadConfig(TIM_TypeDef *TIMx, FunctionalState NewState);
+
+extern void TIM_GenerateEvent(TIM_TypeDef *TIMx, uint16_t TIM_EventSource);
+
+extern void TIM_PrescalerConfig(TIM_TypeDef *TIMx, uint16_t Prescaler, uint16_t TIM_PSCReloadMode);
+
+extern void TIM_DMACmd(TIM_TypeDef *TIMx, uint16_t TIM_DMASource, FunctionalState NewState);
+
+/* SPI */
+
+typedef struct {
+    volatile uint16_t CR1, RESERVED0, CR2, RESERVED1, SR, RESERVED2, DR, RESERVED3;
+    volatile uint16_t CRCPR, RESERVED4, RXCRCR, RESERVED5, TXCRCR, RESERVED6, I2SCFGR, RESERVED7, I2SPR, RESERVED8;
+} SPI_TypeDef;
+
+extern SPI_TypeDef simulatedSPI2;
+#define SPI2 (&simulatedSPI2)
+
+#define SPI_SR_RXNE ((uint8_t)0x01)
+#define SPI_SR_TXE ((uint8_t)0x02)
+#define SPI_SR_BSY ((uint8_t)0x80)
+#define SPI_CR2_RXDMAEN ((uint8_t)0x01)
+#define SPI_CR2_TXDMAEN ((uint8_t)0x02)
+
+#define SPI_Mode_Master ((uint16_t)0x0104)
+#define SPI_Direction_2Lines_FullDuplex ((uint16_t)0x0000)
+#define SPI_DataSize_8b ((uint16_t)0x0000)
+#define SPI_CPOL_High ((uint16_t)0x0002)
+#define SPI_CPHA_1Edge ((uint16_t)0x0000)
+#define SPI_NSS_Soft ((uint16_t)0x0200)
+#define SPI_BaudRatePrescaler_4 ((uint16_t)0x0008)
+#define SPI_FirstBit_MSB ((uint16_t)0x0000)
+#define SPI_I2S_DMAReq_Tx ((uint16_t)0x0002)
+#define SPI_I2S_DMAReq_Rx ((uint16_t)0x0001)
+
+typedef struct {
+    uint16_t SPI_Direction;
+    uint16_t SPI_Mode;
+    uint16_t SPI_DataSize;
+    uint16_t SPI_CPOL;
+    uint16_t SPI_CPHA;
+    uint16_t SPI_NSS;
+    uint16_t SPI_BaudRatePrescaler;
+    uint16_t SPI_FirstBit;
+    uint16_t SPI_CRCPolynomial;
+} SPI_InitTypeDef;
+
+extern void SPI_I2S_DeInit(SPI_TypeDef *SPIx);
+
+extern void SPI_Init(SPI_TypeDef *SPIx, SPI_InitTypeDef *SPI_InitStruct);
+
+extern void SPI_TIModeCmd(SPI_TypeDef *SPIx, FunctionalState NewState);
+
+extern void SPI_Cmd(SPI_TypeDef *SPIx, FunctionalState NewState);
+
+extern void SPI_I2S_DMACmd(SPI_TypeDef *SPIx, uint16_t SPI_I2S_DMAReq, FunctionalState NewState);
+
+/* ADC */
+
+typedef struct {
+    volatile uint32_t SR, CR1, CR2, SMPR1, SMPR2, JOFR1, JOFR2, JOFR3, JOFR4, HTR, LTR, SQR1, SQR2, SQR3, JSQR;
+    volatile uint32_t JDR1, JDR2, JDR3, JDR4, DR;
+} ADC_TypeDef;
+
+extern ADC_TypeDef simulatedADC1;
+#define ADC1 (&simulatedADC1)
+
+#define ADC_Mode_Independent ((uint32_t)0x00000000)
+#define ADC_Prescaler_Div8 ((uint32_t)0x00030000)
+#define ADC_DMAAccessMode_Disabled ((uint32_t)0x00000000)
+#define ADC_TwoSamplingDelay_20Cycles ((uint32_t)0x00000F00)
+#define ADC_Resolution_8b ((uint32_t)0x02000000)
+#define ADC_ExternalTrigConvEdge_None ((uint32_t)0x00000000)
+#define ADC_DataAlign_Right ((uint32_t)0x00000000)
+#define ADC_Channel_1 ((uint8_t)0x01)
+#define ADC_Channel_2 ((uint8_t)0x02)
+#define ADC_Channel_3 ((uint8_t)0x03)
+#define ADC_SampleTime_28Cycles ((uint8_t)0x02)
+
+typedef struct {
+    uint32_t ADC_Mode;
+    uint32_t ADC_Prescaler;
+    uint32_t ADC_DMAAccessMode;
+    uint32_t ADC_TwoSamplingDelay;
+} ADC_CommonInitTypeDef;
+
+typedef struct {
+    uint32_t ADC_Resolution;
+    FunctionalState ADC_ScanConvMode;
+    FunctionalState ADC_ContinuousConvMode;
+    uint32_t ADC_ExternalTrigConvEdge;
+    uint32_t ADC_ExternalTrigConv;
+    uint32_t ADC_DataAlign;
+    uint8_t ADC_NbrOfConversion;
+} ADC_InitTypeDef;
+
+extern void ADC_CommonInit(ADC_CommonInitTypeDef *ADC_CommonInitStruct);
+
+extern void ADC_Init(ADC_TypeDef *ADCx, ADC_InitTypeDef *ADC_InitStruct);
+
+extern void ADC_RegularChannelConfig(ADC_TypeDef *ADCx, uint8_t ADC_Channel, uint8_t Rank, uint8_t ADC_SampleTime);
+
+extern void ADC_DMARequestAfterLastTransferCmd(ADC_TypeDef *ADCx, FunctionalState NewState);
+
+extern void ADC_DMACmd(ADC_TypeDef *ADCx, FunctionalState NewState);
+
+extern void ADC_Cmd(ADC_TypeDef *ADCx, FunctionalState NewState);
+
+extern void ADC_SoftwareStartConv(ADC_TypeDef *ADCx);
+
+/* DMA */
+
+typedef struct {
+    volatile uint32_t CR, NDTR, PAR, M0AR, M1AR, FCR;
+} DMA_Stream_TypeDef;
+
+typedef struct {
+    volatile uint32_t LISR, HISR, LIFCR, HIFCR;
+} DMA_TypeDef;
+
+extern DMA_TypeDef simulatedDMA1;
+#define DMA1 (&simulatedDMA1)
+extern DMA_TypeDef simulatedDMA2;
+#define DMA2 (&simulatedDMA2)
+
+extern DMA_Stream_TypeDef simulatedDMA1Stream[8];
+#define DMA1_Stream2 (&simulatedDMA1Stream[2])
+#define DMA1_Stream3 (&simulatedDMA1Stream[3])
+
+extern DMA_Stream_TypeDef simulatedDMA2Stream[8];
+#define DMA2_Stream0 (&simulatedDMA2Stream[0])
+#define DMA2_Stream1 (&simulatedDMA2Stream[1])
+#define DMA2_Stream2 (&simulatedDMA2Stream[2])
+#define DMA2_Stream3 (&simulatedDMA2Stream[3])
+
+#define DMA_SxCR_EN ((uint32_t)0x00000001)
+#define DMA_SxCR_HTIE ((uint32_t)0x00000008)
+#define DMA_SxCR_TCIE ((uint32_t)0x00000010)
+#define DMA_SxCR_DIR_0 ((uint32_t)0x00000040)
+#define DMA_SxCR_CIRC ((uint32_t)0x00000100)
+#define DMA_SxCR_MINC ((uint32_t)0x00000400)
+
+#define DMA_Channel_0 ((uint32_t)0x00000000)
+#define DMA_Channel_1 ((uint32_t)0x02000000)
+#define DMA_Channel_7 ((uint32_t)0x0E000000)
+#define DMA_DIR_PeripheralToMemory ((uint32_t)0x00000000)
+#define DMA_DIR_MemoryToPeripheral ((uint32_t)0x00000040)
+#define DMA_PeripheralInc_Disable ((uint32_t)0x00000000)
+#define DMA_MemoryInc_Enable ((uint32_t)0x00000400)
+#define DMA_MemoryInc_Disable ((uint32_t)0x00000000)
+#define DMA_PeripheralDataSize_Byte ((uint32_t)0x00000000)
+#define DMA_PeripheralDataSize_HalfWord ((uint32_t)0x00000800)
+#define DMA_PeripheralDataSize_Word ((uint32_t)0x00001000)
+#define DMA_MemoryDataSize_Byte ((uint32_t)0x00000000)
+#define DMA_MemoryDataSize_HalfWord ((uint32_t)0x00002000)
+#define DMA_MemoryDataSize_Word ((uint32_t)0x00004000)
+#define DMA_Mode_Circular ((uint32_t)0x00000100)
+#define DMA_Priority_Medium ((uint32_t)0x00010000)
+#define DMA_Priority_High ((uint32_t)0x00020000)
+#define DMA_Priority_VeryHigh ((uint32_t)0x00030000)
+#define DMA_FIFOMode_Disable ((uint32_t)0x00000000)
+#define DMA_FIFOThreshold_HalfFull ((uint32_t)0x00000001)
+#define DMA_MemoryBurst_Single ((uint32_t)0x00000000)
+#define DMA_PeripheralBurst_Single ((uint32_t)0x00000000)
+#define DMA_IT_HT ((uint32_t)0x00000008)
+#define DMA_IT_TC ((uint32_t)0x00000010)
+#define DMA_IT_HTIF3 ((uint32_t)0x14000000)
+#define DMA_IT_TCIF3 ((uint32_t)0x18000000)
+
+typedef struct {
+    uint32_t DMA_Channel;
+    uint32_t DMA_PeripheralBaseAddr;
+    uint32_t DMA_Memory0BaseAddr;
+    uint32_t DMA_DIR;
+    uint32_t DMA_BufferSize;
+    uint32_t DMA_PeripheralInc;
+    uint32_t DMA_MemoryInc;
+    uint32_t DMA_PeripheralDataSize;
+    uint32_t DMA_MemoryDataSize;
+    uint32_t DMA_Mode;
+    uint32_t DMA_Priority;
+    uint32_t DMA_FIFOMode;
+    uint32_t DMA_FIFOThreshold;
+    uint32_t DMA_MemoryBurst;
+    uint32_t DMA_PeripheralBurst;
+} DMA_InitTypeDef;
+
+extern void DMA_Init(DMA_Stream_TypeDef *DMAy_Streamx, DMA_InitTypeDef *DMA_InitStruct);
+
+extern void DMA_Cmd(DMA_Stream_TypeDef *DMAy_Streamx, FunctionalState NewState);
+
+extern void DMA_ITConfig(DMA_Stream_TypeDef *DMAy_Streamx, uint32_t DMA_IT, FunctionalState NewState);
+
+extern ITStatus DMA_GetITStatus(DMA_Stream_TypeDef *DMAy_Streamx, uint32_t DMA_IT);
+
+extern void DMA_ClearITPendingBit(DMA_Stream_TypeDef *DMAy_Streamx, uint32_t DMA_IT);
+
+extern void DMA_SetCurrDataCounter(DMA_Stream_TypeDef *DMAy_Streamx, uint16_t Counter);
+
+extern uint16_t DMA_GetCurrDataCounter(DMA_Stream_TypeDef *DMAy_Streamx);
+
+// the flash array is host memory, simulatedFlash is FLASH_BASE
+extern uint8_t simulatedFlash[];
+#define FLASH_BASE ((uint32_t) simulatedFlash)
+#define SIMULATED_FLASH_SIZE 0x100000
+
+typedef enum {
+    FLASH_BUSY = 1,
+    FLASH_ERROR_RD,
+    FLASH_ERROR_PGS,
+    FLASH_ERROR_PGP,
+    FLASH_ERROR_PGA,
+    FLASH_ERROR_WRP,
+    FLASH_ERROR_PROGRAM,
+    FLASH_ERROR_OPERATION,
+    FLASH_COMPLETE
+} FLASH_Status;
+
+#define FLASH_Sector_10 ((uint16_t)0x0050)
+#define FLASH_Sector_11 ((uint16_t)0x0058)
+#define VoltageRange_3 ((uint8_t)0x02)
+
+#define FLASH_FLAG_EOP ((uint32_t)0x00000001)
+#define FLASH_FLAG_OPERR ((uint32_t)0x00000002)
+#define FLASH_FLAG_WRPERR ((uint32_t)0x00000010)
+#define FLASH_FLAG_PGAERR ((uint32_t)0x00000020)
+#define FLASH_FLAG_PGPERR ((uint32_t)0x00000040)
+#define FLASH_FLAG_PGSERR ((uint32_t)0x00000080)
+
+extern void FLASH_Unlock(void);
+
+extern void FLASH_Lock(void);
+
+extern void FLASH_ClearFlag(uint32_t FLASH_FLAG);
+
+extern FLASH_Status FLASH_EraseSector(uint32_t FLASH_Sector, uint8_t VoltageRange);
+
+extern FLASH_Status FLASH_ProgramWord(uint32_t Address, uint32_t Data);
@@ -0,0 +1,148 @@
+#pragma once
+
+// Stand-in for the STM32 USB OTG device library, only what the firmware uses.
+// The device side is simulated in halUSB.c, see simulation.h for the host side.
+
+#include <stdint.h>
+
+#define USB_OTG_MAX_EP0_SIZE 64
+#define USB_OTG_MAX_TX_FIFOS 4
+#define USB_MAX_STR_DESC_SIZ 64
+
+#define USB_OTG_EP_CONTROL 0
+#define USB_OTG_EP_ISOC 1
+#define USB_OTG_EP_BULK 2
+#define USB_OTG_EP_INT 3
+
+#define USB_OTG_CONFIGURED 3
+
+#define USB_DEVICE_DESCRIPTOR_TYPE 0x01
+#define USB_CONFIGURATION_DESCRIPTOR_TYPE 0x02
+#define USB_STRING_DESCRIPTOR_TYPE 0x03
+#define USB_INTERFACE_DESCRIPTOR_TYPE 0x04
+#define USB_ENDPOINT_DESCRIPTOR_TYPE 0x05
+#define USB_DESC_TYPE_STRING 0x03
+#define USB_SIZ_STRING_LANGID 4
+
+#define USBD_IDX_LANGID_STR 0x00
+#define USBD_IDX_MFC_STR 0x01
+#define USBD_IDX_PRODUCT_STR 0x02
+#define USBD_IDX_SERIAL_STR 0x03
+#define USBD_CFG_MAX_NUM 1
+
+#define LOBYTE(x) ((uint8_t)((x) & 0x00FF))
+#define HIBYTE(x) ((uint8_t)(((x) & 0xFF00) >> 8))
+
+typedef enum {
+    USBD_OK = 0,
+    USBD_BUSY,
+    USBD_FAIL
+} USBD_Status;
+
+typedef enum {
+    USB_OTG_HS_CORE_ID = 0,
+    USB_OTG_FS_CORE_ID = 1
+} USB_OTG_CORE_ID_TypeDef;
+
+typedef struct {
+    uint8_t bmRequest;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} USB_SETUP_REQ;
+
+typedef struct {
+    uint8_t *(*GetDeviceDescriptor)(uint8_t speed, uint16_t *length);
+    uint8_t *(*GetLangIDStrDescriptor)(uint8_t speed, uint16_t *length);
+    uint8_t *(*GetManufacturerStrDescriptor)(uint8_t speed, uint16_t *length);
+    uint8_t *(*GetProductStrDescriptor)(uint8_t speed, uint16_t *length);
+    uint8_t *(*GetSerialStrDescriptor)(uint8_t speed, uint16_t *length);
+    uint8_t *(*GetConfigurationStrDescriptor)(uint8_t speed, uint16_t *length);
+    uint8_t *(*GetInterfaceStrDescriptor)(uint8_t speed, uint16_t *length);
+} USBD_DEVICE;
+
+typedef struct {
+    uint8_t (*Init)(void *pdev, uint8_t cfgidx);
+    uint8_t (*DeInit)(void *pdev, uint8_t cfgidx);
+    uint8_t (*Setup)(void *pdev, USB_SETUP_REQ *req);
+    uint8_t (*EP0_TxSent)(void *pdev);
+    uint8_t (*EP0_RxReady)(void *pdev);
+    uint8_t (*DataIn)(void *pdev, uint8_t epnum);
+    uint8_t (*DataOut)(void *pdev, uint8_t epnum);
+    uint8_t (*SOF)(void *pdev);
+    uint8_t (*IsoINIncomplete)(void *pdev);
+    uint8_t (*IsoOUTIncomplete)(void *pdev);
+    uint8_t *(*GetConfigDescriptor)(uint8_t speed, uint16_t *length);
+} USBD_Class_cb_TypeDef;
+
+typedef struct {
+    void (*Init)(void);
+    void (*DeviceReset)(uint8_t speed);
+    void (*DeviceConfigured)(void);
+    void (*DeviceSuspended)(void);
+    void (*DeviceResumed)(void);
+    void (*DeviceConnected)(void);
+    void (*DeviceDisconnected)(void);
+} USBD_Usr_cb_TypeDef;
+
+typedef struct {
+    uint8_t num;
+    uint8_t is_in;
+    uint8_t type;
+    uint16_t maxpacket;
+    uint8_t *xfer_buff;
+    uint32_t xfer_len;
+    uint32_t xfer_count;
+    uint8_t armed;
+} USB_OTG_EP;
+
+typedef struct {
+    uint8_t low_power;
+    uint8_t coreID;
+} USB_OTG_CORE_CFGS;
+
+typedef struct {
+    uint8_t device_status;
+    USB_OTG_EP in_ep[USB_OTG_MAX_TX_FIFOS];
+    USB_OTG_EP out_ep[USB_OTG_MAX_TX_FIFOS];
+    USBD_Class_cb_TypeDef *class_cb;
+    USBD_Usr_cb_TypeDef *usr_cb;
+    USBD_DEVICE *usr_device;
+} DCD_DEV;
+
+typedef struct {
+    USB_OTG_CORE_CFGS cfg;
+    DCD_DEV dev;
+} USB_OTG_CORE_HANDLE;
+
+extern uint8_t USBD_StrDesc[USB_MAX_STR_DESC_SIZ];
+
+extern void USBD_Init(USB_OTG_CORE_HANDLE *pdev, USB_OTG_CORE_ID_TypeDef coreID, USBD_DEVICE *pDevice,
+        USBD_Class_cb_TypeDef *class_cb, USBD_Usr_cb_TypeDef *usr_cb);
+
+extern uint32_t DCD_EP_Open(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr, uint16_t ep_mps, uint8_t ep_type);
+
+extern uint32_t DCD_EP_Close(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr);
+
+extern uint32_t DCD_EP_PrepareRx(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t buf_len);
+
+extern uint32_t DCD_EP_Tx(USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t buf_len);
+
+extern void DCD_DevDisconnect(USB_OTG_CORE_HANDLE *pdev);
+
+extern uint16_t USBD_GetRxCount(USB_OTG_CORE_HANDLE *pdev, uint8_t epnum);
+
+extern void USBD_CtlError(USB_OTG_CORE_HANDLE *pdev, USB_SETUP_REQ *req);
+
+extern USBD_Status USBD_CtlSendData(USB_OTG_CORE_HANDLE *pdev, uint8_t *buf, uint16_t len);
+
+extern USBD_Status USBD_CtlPrepareRx(USB_OTG_CORE_HANDLE *pdev, uint8_t *pbuf, uint16_t len);
+
+extern USBD_Status USBD_CtlSendStatus(USB_OTG_CORE_HANDLE *pdev);
+
+extern void USBD_GetString(uint8_t *desc, uint8_t *unicode, uint16_t *len);
+
+extern uint32_t USBD_OTG_ISR_Handler(USB_OTG_CORE_HANDLE *pdev);
+
+extern void USB_OTG_UngateClock(USB_OTG_CORE_HANDLE *pdev);
@@ -0,0 +1,3 @@
+#pragma once
+
+#include "usb_core.h"
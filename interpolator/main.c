@@ -2,17 +2,22 @@
 #include "stm32f4_discovery.h"
 #include "cnc.h"
 
+//all on the same port, the step DMA writes a single BSRR
 static const struct {
     GPIO_TypeDef *gpio;
-    uint16_t xDirection, xStep, yDirection, yStep, zDirection, zStep;
+    //X, Y, Z, A, B, C: PE14 and PE15 are the emergency stop, C's direction goes to PE2
+    uint16_t steps[6], directions[6];
 } motorsPinout = {
         .gpio = GPIOE,
-        .xStep = GPIO_Pin_3,
-        .xDirection = GPIO_Pin_4,
-        .yStep = GPIO_Pin_5,
-        .yDirection = GPIO_Pin_6,
-        .zStep = GPIO_Pin_7,
-        .zDirection = GPIO_Pin_8};
+        .steps = {GPIO_Pin_3, GPIO_Pin_5, GPIO_Pin_7, GPIO_Pin_9, GPIO_Pin_11, GPIO_Pin_13},
+        .directions = {GPIO_Pin_4, GPIO_Pin_6, GPIO_Pin_8, GPIO_Pin_10, GPIO_Pin_12, GPIO_Pin_2}};
+
+#define AXES_MASK ((1U << AXES_COUNT) - 1)
+
+//the pins of the AXES_COUNT first axes of motorsPinout, see initMotorPins()
+static struct {
+    uint16_t steps, directions;
+} motorPins;
 
 static const struct {
     GPIO_TypeDef *gpio;
@@ -32,96 +37,409 @@ static const struct {
 };
 
 volatile cnc_memory_t cncMemory = {
-        .position = {.x = 0, .y = 0, .z = 0, .speed = 0},
-        .workOffset = {.x = 0, .y = 0, .z = 0},
+        .position = {.axes = {0}, .speed = 0},
+        .workOffset = {.axes = {0}},
         .parameters = {
-                .stepsPerMillimeter = 640,
-                .maxSpeed = 3000,
-                .maxAcceleration = 100,
+                .axes = {[0 ... AXES_COUNT - 1] = {.stepsPerMillimeter = 640, .maxSpeed = 3000, .maxAcceleration = 100}},
                 .clockFrequency = 200000},
-        .xHomed = 0,
-        .yHomed = 0,
-        .zHomed = 0,
+        .homedAxes = 0,
         .state = READY,
         .lastEvent = {NULL_EVENT, 0, 0, 0},
         .tick = 0,
+        .executedSteps = 0,
         .spiOutput = {.run = 0, .reverse = 0, .reset = 0, .sph = 0, .spm = 0, .spl = 0, .socket = 0},
-        .spiInput = {.drv = 0, .upf = 0, .limitX = 0, .limitY = 0, .limitZ = 0},
+        .spiInput = {.drv = 0, .upf = 0, .limitX = 0, .limitY = 0, .limitZ = 0, .limitA = 0, .limitB = 0, .limitC = 0},
         .stopHomingFlag = 0
 };
 
+//bit n is about axis n
 static const struct {
     //how do we increase the axis value: 0 -> dir bit must high, 1-> dir bit must be low
-    uint8_t x:1, y:1, z:1;
+    uint8_t inverted;
     //how do we get towards the limit switch: 0 -> by decreasing the axis value, 1 -> by increasing the axis value
-    uint8_t homeX:1, homeY:1, homeZ:1;
+    uint8_t homeForwards;
 } motorDirection = {
-        .x = 0,
-        .homeX = 0,
-        .y = 0,
-        .homeY = 1,
-        .z = 0,
-        .homeZ = 1};
+        .inverted = 0,
+        .homeForwards = 1 << AXIS_Y | 1 << AXIS_Z};
+
+//the 3 axes records interleave the bits: xStep, xDirection, yStep, yDirection, zStep, zDirection
+static axes_t decodeAxes(uint8_t binAxes) {
+    return (axes_t) {
+            .steps = (uint8_t) ((binAxes & 0b000001) | (binAxes & 0b000100) >> 1 | (binAxes & 0b010000) >> 2),
+            .directions = (uint8_t) ((binAxes & 0b000010) >> 1 | (binAxes & 0b001000) >> 2 | (binAxes & 0b100000) >> 3)};
+}
+
+//the axes this firmware doesn't drive are dropped
+static axes_t decodeWideAxes(uint8_t steps, uint8_t directions) {
+    return (axes_t) {.steps = (uint8_t) (steps & AXES_MASK), .directions = (uint8_t) (directions & AXES_MASK)};
+}
+
+//a compressed record is the axes byte, followed by the varints announced by its 2 upper bits
+#define COMPRESSED_DURATION_FLAG    0b01000000
+#define COMPRESSED_REPEAT_FLAG      0b10000000
+#define COMPRESSED_AXES_MASK        0b00111111
+#define MAX_STEP_DURATION           0xFFFFU
+
+static struct {
+    program_type_t type;
+    //the duration is only transmitted when it changes
+    uint32_t duration;
+    axes_t axes;
+    //steps of the current record that were not returned yet
+    uint32_t remainingSteps;
+    //what is left of the current step when it's longer than a timer period
+    uint32_t remainingDuration;
+    //a record could not be decoded, nothing after it in the program can be trusted
+    uint8_t malformed;
+} programDecoder = {
+        .type = PROGRAM_STEPS,
+        .duration = 0,
+        .remainingSteps = 0,
+        .remainingDuration = 0,
+        .malformed = 0
+};
+
+//power of 2, the ring counters wrap
+#define PROGRAM_MARKS 4U
+
+//where each program begins in the steps pushed to the queue, so that the one being played can be told
+//written by the main loop, read by the OTG interrupt
+static volatile struct {
+    //since power up, wraps
+    uint32_t pushedSteps;
+    uint32_t programIDs[PROGRAM_MARKS];
+    uint32_t firstSteps[PROGRAM_MARKS];
+    uint8_t writeCount;
+    uint8_t readCount;
+} programMarks = {
+        .pushedSteps = 0,
+        .writeCount = 0,
+        .readCount = 0
+};
+
+//the oldest mark is dropped when the ring is full
+static void markProgram(uint32_t programID, uint32_t firstStep) {
+    if ((uint8_t) (programMarks.writeCount - programMarks.readCount) == PROGRAM_MARKS)
+        programMarks.readCount++;
+    programMarks.programIDs[programMarks.writeCount % PROGRAM_MARKS] = programID;
+    programMarks.firstSteps[programMarks.writeCount % PROGRAM_MARKS] = firstStep;
+    programMarks.writeCount++;
+}
+
+void beginProgram(program_type_t type, uint32_t programID) {
+    programDecoder.type = type;
+    programDecoder.duration = 0;
+    programDecoder.remainingSteps = 0;
+    programDecoder.remainingDuration = 0;
+    programDecoder.malformed = 0;
+    resetSegmentInterpolator();
+    //playedProgramID() would see no mark in between
+    __disable_irq();
+    programMarks.readCount = programMarks.writeCount;
+    markProgram(programID, programMarks.pushedSteps);
+    __enable_irq();
+}
+
+#define VARINT_MALFORMED    -1
+#define VARINT_INCOMPLETE   0
+#define VARINT_COMPLETE     1
+
+//LEB128, a 32 bits value takes at most 5 bytes
+static int peekVarint(uint32_t *offset, uint32_t *value) {
+    *value = 0;
+    for (uint32_t shift = 0; shift < 35; shift += 7) {
+        uint8_t byte;
+        if (!peekFromProgram(*offset, &byte))
+            return VARINT_INCOMPLETE;
+        (*offset)++;
+        *value |= (uint32_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return VARINT_COMPLETE;
+    }
+    return VARINT_MALFORMED;
+}
+
+//the record is only consumed when it's complete in the buffer
+static int readCompressedRecord() {
+    if (programDecoder.malformed) {
+        skipReceivedProgram();
+        return 0;
+    }
+    uint32_t offset = 0;
+    uint8_t binAxes;
+    uint8_t directions = 0;
+    uint32_t delta = 0;
+    uint32_t repeat = 1;
+    int wide = programDecoder.type == PROGRAM_COMPRESSED_WIDE_STEPS;
+    int complete = peekFromProgram(offset, &binAxes);
+    if (complete) {
+        offset++;
+        if (wide)
+            complete = peekFromProgram(offset++, &directions);
+        if (complete == VARINT_COMPLETE && (binAxes & COMPRESSED_DURATION_FLAG))
+            complete = peekVarint(&offset, &delta);
+        if (complete == VARINT_COMPLETE && (binAxes & COMPRESSED_REPEAT_FLAG))
+            complete = peekVarint(&offset, &repeat);
+    }
+    if (complete == VARINT_MALFORMED) {
+        programDecoder.malformed = 1;
+        skipReceivedProgram();
+        return 0;
+    }
+    if (!complete) {
+        if (offset >= remainingProgramLength())
+            //the program ends in the middle of a record, drop it
+            skipFromProgram(remainingProgramLength());
+        return 0;
+    }
+    skipFromProgram(offset);
+    //zigzag encoding
+    programDecoder.duration += (delta >> 1) ^ -(delta & 1);
+    programDecoder.axes = wide ? decodeWideAxes((uint8_t) (binAxes & COMPRESSED_AXES_MASK), directions)
+            : decodeAxes((uint8_t) (binAxes & COMPRESSED_AXES_MASK));
+    programDecoder.remainingSteps = repeat;
+    programDecoder.remainingDuration = 0;
+    return 1;
+}
+
+//long steps are cut in timer periods, only the first one moves the axes
+static step_t nextCompressedProgramStep() {
+    if (!programDecoder.remainingSteps && !readCompressedRecord())
+        return (step_t) {.duration = 0};
+    int firstPart = !programDecoder.remainingDuration;
+    if (firstPart)
+        programDecoder.remainingDuration = programDecoder.duration;
+    uint32_t duration = programDecoder.remainingDuration;
+    if (duration > MAX_STEP_DURATION)
+        duration = MAX_STEP_DURATION;
+    programDecoder.remainingDuration -= duration;
+    if (!programDecoder.remainingDuration)
+        programDecoder.remainingSteps--;
+    return (step_t) {
+            .duration = (uint16_t) duration,
+            .axes = firstPart ? programDecoder.axes : (axes_t) {.steps = 0, .directions = 0}};
+}
+
+static int programDecoderIsEmpty() {
+    return programDecoder.remainingSteps == 0 && segmentInterpolatorIsEmpty();
+}
+
+//the next program is decoded as soon as the bytes of the current one are, without a stop in READY between them
+//the planner ring goes on across segment programs, so their junction is planned like any other
+static void chainNextProgram() {
+    program_type_t type;
+    uint32_t programID;
+    if (programDecoder.remainingSteps || !peekNextProgram(&type, &programID))
+        return;
+    int keepPlanner = type == PROGRAM_SEGMENTS && programDecoder.type == PROGRAM_SEGMENTS;
+    if (!keepPlanner && !segmentInterpolatorIsEmpty())
+        return;
+    //the blocks still in the planner belong to the previous program
+    markProgram(programID, programMarks.pushedSteps + (keepPlanner ? segmentInterpolatorPendingSteps() : 0));
+    programDecoder.type = type;
+    programDecoder.duration = 0;
+    programDecoder.remainingDuration = 0;
+    programDecoder.malformed = 0;
+    enterNextProgram();
+}
 
 static step_t nextProgramStep() {
-    uint8_t bytes[3];
-    if (!readFromProgram(sizeof(bytes) / sizeof(*bytes), bytes))
-        return (step_t) {.duration = 0,
-                .axes = {
-                        .xStep = 0,
-                        .yStep = 0,
-                        .zStep = 0}};
-    uint8_t binAxes = bytes[2];
+    if (programDecoder.type == PROGRAM_COMPRESSED_STEPS || programDecoder.type == PROGRAM_COMPRESSED_WIDE_STEPS)
+        return nextCompressedProgramStep();
+    if (programDecoder.type == PROGRAM_SEGMENTS)
+        return nextSegmentStep();
+    int wide = programDecoder.type == PROGRAM_WIDE_STEPS;
+    uint8_t bytes[4];
+    if (!readFromProgram(wide ? 4 : 3, bytes))
+        return (step_t) {.duration = 0, .axes = {.steps = 0, .directions = 0}};
     return (step_t) {
             .duration = bytes[1] << 8 | bytes[0],
-            .axes = {
-                    .xStep = (uint8_t) ((binAxes & 0b000001) != 0),
-                    .yStep = (uint8_t) ((binAxes & 0b000100) != 0),
-                    .zStep = (uint8_t) ((binAxes & 0b010000) != 0),
-                    .xDirection = (uint8_t) ((binAxes & 0b000010) != 0),
-                    .yDirection = (uint8_t) ((binAxes & 0b001000) != 0),
-                    .zDirection = (uint8_t) ((binAxes & 0b100000) != 0)}};
-}
-
-static int xor(int a, int b) {
-    return (a && !b) || (!a && b);
-}
-
-//returns 1 if a step was started
-static int startStep(step_t step) {
-    //diagonal steps are longer than straight ones
-    static float32_t stepFactors[] = {0, 1, 1.414213562f, 1.732050808f};
-    float32_t minDuration = cncMemory.parameters.clockFrequency /
-            (cncMemory.parameters.maxSpeed * cncMemory.parameters.stepsPerMillimeter / 60);
-    GPIO_ResetBits(motorsPinout.gpio, motorsPinout.xDirection | motorsPinout.xStep
-            | motorsPinout.yDirection | motorsPinout.yStep | motorsPinout.zDirection | motorsPinout.zStep);
+            .axes = wide ? decodeWideAxes(bytes[2], bytes[3]) : decodeAxes(bytes[2])};
+}
+
+//run() keeps that many program steps ahead of the running one
+#define STEP_QUEUE_AHEAD 32U
+//a pause gives the steps held by the DMA table back to the queue, a power of two for the 16 bits counters
+#define STEP_QUEUE_SIZE (STEP_DMA ? 128U : STEP_QUEUE_AHEAD)
+
+//filled by run() in the main loop, emptied by the TIM3 interrupt or the step DMA refill
+static volatile struct {
+    step_t steps[STEP_QUEUE_SIZE];
+    uint16_t writeCount;
+    uint16_t readCount;
+    //an engine is generating steps
+    uint8_t running;
+    //the running engine is the DMA table, not TIM3_IRQHandler()
+    uint8_t usingDMA;
+    //the ARR preload holds the duration of the step at readCount, so TIM3 goes on after the current step
+    uint8_t nextArmed;
+} stepQueue = {
+        .writeCount = 0,
+        .readCount = 0,
+        .running = 0,
+        .usingDMA = 0,
+        .nextArmed = 0
+};
+
+//derived from cncMemory.parameters by deriveStepTiming(), the step path only looks them up
+static struct {
+    //the shortest step that keeps every moving axis under its maxSpeed, by step mask
+    uint16_t minDurations[1 << AXES_COUNT];
+    //65536 / sqrt(moving axes), diagonal steps are longer than straight ones, by step mask
+    uint32_t speedScales[1 << AXES_COUNT];
+    //TIM3 is on APB1, twice slower than TIM8
+    uint16_t stepTimerPrescaler;
+    uint16_t dmaTimerPrescaler;
+} stepTiming;
+
+static uint16_t queuedSteps() {
+    return (uint16_t) (stepQueue.writeCount - stepQueue.readCount);
+}
+
+//the steps handed to the DMA table count as played, the table is a few steps long
+//called from the OTG interrupt, it doesn't write to the marks
+uint32_t playedProgramID() {
+    uint32_t playedSteps = programMarks.pushedSteps - queuedSteps();
+    uint8_t writeCount = programMarks.writeCount;
+    uint8_t mark = programMarks.readCount;
+    if (writeCount == mark)
+        return 0;
+    while ((uint8_t) (writeCount - mark) > 1
+            && (int32_t) (playedSteps - programMarks.firstSteps[(mark + 1) % PROGRAM_MARKS]) >= 0)
+        mark++;
+    return programMarks.programIDs[mark % PROGRAM_MARKS];
+}
+
+static step_t popStep() {
+    step_t step = stepQueue.steps[stepQueue.readCount % STEP_QUEUE_SIZE];
+    stepQueue.readCount++;
+    return step;
+}
+
+static void deriveStepTiming() {
+    volatile parameters_t *parameters = &cncMemory.parameters;
+    for (uint32_t mask = 0; mask < 1 << AXES_COUNT; mask++) {
+        //the step length in mm and the slowest axis bound the speed of the vector
+        float32_t squaredStepLength = 0;
+        float32_t maxSpeed = 0;
+        uint32_t axesCount = 0;
+        for (int i = 0; i < AXES_COUNT; i++)
+            if (mask & 1 << i) {
+                axesCount++;
+                float32_t stepLength = 1.0f / parameters->axes[i].stepsPerMillimeter;
+                squaredStepLength += stepLength * stepLength;
+                if (!maxSpeed || parameters->axes[i].maxSpeed < maxSpeed)
+                    maxSpeed = parameters->axes[i].maxSpeed;
+            }
+        float32_t minDuration = mask ? ceilf(parameters->clockFrequency * 60 * sqrtf(squaredStepLength) / maxSpeed) : 0;
+        minDuration = minDuration < 2 ? 2 : minDuration;
+        stepTiming.minDurations[mask] = (uint16_t) (minDuration < 0xFFFF ? minDuration : 0xFFFF);
+        stepTiming.speedScales[mask] = (uint32_t) (axesCount ? 65536 / sqrtf(axesCount) : 0);
+    }
+    stepTiming.stepTimerPrescaler = (uint16_t) ((SystemCoreClock / 2) / cncMemory.parameters.clockFrequency - 1);
+    stepTiming.dmaTimerPrescaler = (uint16_t) (SystemCoreClock / cncMemory.parameters.clockFrequency - 1);
+}
+
+static step_t clampStep(step_t step) {
+    uint16_t minDuration = stepTiming.minDurations[step.axes.steps];
+    if (cncMemory.state != MANUAL_CONTROL && step.duration < minDuration)
+        //clamp speed according to max allowed speed
+        step.duration = minDuration;
+    return step;
+}
+
+static int32_t stepSpeed(step_t step) {
+    return (int32_t) (step.duration * stepTiming.speedScales[step.axes.steps] >> 16);
+}
+
+static void initMotorPins() {
+    motorPins.steps = 0;
+    motorPins.directions = 0;
+    for (int i = 0; i < AXES_COUNT; i++) {
+        motorPins.steps |= motorsPinout.steps[i];
+        motorPins.directions |= motorsPinout.directions[i];
+    }
+}
+
+//the direction pins that have to be high for this step
+static uint16_t directionsGPIO(axes_t axes) {
+    uint8_t high = axes.directions ^ motorDirection.inverted;
+    uint16_t directions = 0;
+    for (int i = 0; i < AXES_COUNT; i++)
+        if (high & 1 << i)
+            directions |= motorsPinout.directions[i];
+    return directions;
+}
+
+static uint16_t stepsGPIO(axes_t axes) {
+    uint16_t steps = 0;
+    for (int i = 0; i < AXES_COUNT; i++)
+        if (axes.steps & 1 << i)
+            steps |= motorsPinout.steps[i];
+    return steps;
+}
+
+static void setDirectionGPIO(axes_t axes) {
+    GPIO_ResetBits(motorsPinout.gpio, motorPins.directions | motorPins.steps);
+    GPIO_SetBits(motorsPinout.gpio, directionsGPIO(axes));
+}
+
+static int stepsAllowed() {
+    return cncMemory.state != PAUSED_PROGRAM && cncMemory.state != ABORTING_PROGRAM;
+}
+
+//manual and homing steps stay on TIM3, they are computed one at a time from live inputs
+static int programStepsUseDMA() {
+    return STEP_DMA && cncMemory.state == RUNNING_PROGRAM;
+}
+
+//the step at readCount begins, its duration is already in the timer
+static void beginStep() {
+    step_t step = popStep();
     cncMemory.currentStep = step;
-    if (step.duration) {
-        uint16_t directions = 0;
-        if (xor(cncMemory.currentStep.axes.xDirection, motorDirection.x))
-            directions |= motorsPinout.xDirection;
-        if (xor(cncMemory.currentStep.axes.yDirection, motorDirection.y))
-            directions |= motorsPinout.yDirection;
-        if (xor(cncMemory.currentStep.axes.zDirection, motorDirection.z))
-            directions |= motorsPinout.zDirection;
-        GPIO_SetBits(motorsPinout.gpio, directions);
-        uint32_t duration = step.duration;
-        int32_t axesCount = step.axes.xStep + step.axes.yStep + step.axes.zStep;
-        float32_t stepFactor = stepFactors[axesCount];
-        uint32_t correctedMinDuration = (uint32_t) ceilf(minDuration * stepFactor);
-        correctedMinDuration = correctedMinDuration < 2 ? 2 : correctedMinDuration;
-        if (cncMemory.state != MANUAL_CONTROL)
-            //clamp speed according to max allowed speed
-            duration = duration < correctedMinDuration ? correctedMinDuration : duration;
-        cncMemory.position.speed = (int32_t) (stepFactor == 0 ? 0 : duration / stepFactor);
-        TIM3->ARR = duration;
-        TIM3->CNT = 0;
+    setDirectionGPIO(step.axes);
+    cncMemory.position.speed = stepSpeed(step);
+}
+
+//preloads the duration of the following step, or has the timer stop at the end of the current one
+static void armNextStep() {
+    if (queuedSteps() && !programStepsUseDMA()) {
+        TIM3->ARR = stepQueue.steps[stepQueue.readCount % STEP_QUEUE_SIZE].duration;
+        TIM_SelectOnePulseMode(TIM3, TIM_OPMode_Repetitive);
+        stepQueue.nextArmed = 1;
+    } else {
         TIM_SelectOnePulseMode(TIM3, TIM_OPMode_Single);
-        TIM_Cmd(TIM3, ENABLE);
-        return 1;
+        stepQueue.nextArmed = 0;
     }
-    else
-        return 0;
+}
+
+//TIM3 counts at clockFrequency from the APB1 timer clock, twice slower than the core
+static uint32_t stepTimerCycles(uint32_t ticks) {
+    return ticks * 2 * (TIM3->PSC + 1U);
+}
+
+static void stopTimerSteps() {
+    TIM_Cmd(TIM3, DISABLE);
+    stopStepEdgeTiming();
+    TIM_ClearITPendingBit(TIM3, TIM_IT_CC1 | TIM_IT_Update);
+    GPIO_ResetBits(motorsPinout.gpio, motorPins.steps);
+    stepQueue.running = 0;
+    stepQueue.nextArmed = 0;
+    cncMemory.position.speed = 0;
+}
+
+//the timer has to be stopped
+static void startTimerSteps() {
+    TIM3->ARR = stepQueue.steps[stepQueue.readCount % STEP_QUEUE_SIZE].duration;
+    //loads ARR and resets the counter, without raising the update interrupt
+    TIM_GenerateEvent(TIM3, TIM_EventSource_Update);
+    beginStep();
+    armNextStep();
+    stepQueue.running = 1;
+    stepQueue.usingDMA = 0;
+    //the counter restarts from 0, the compare event comes when it reaches CCR1
+    startStepEdgeTiming(stepTimerCycles(TIM3->CCR1));
+    TIM_Cmd(TIM3, ENABLE);
 }
 
 int startHoming() {
@@ -137,78 +455,78 @@ int startHoming() {
 };
 
 static step_t homingStep(int axis, int forwards, uint16_t speed) {
-    axes_t axes[] = {{.xStep = 1, .xDirection = motorDirection.homeX}, {.yStep = 1, .yDirection = motorDirection.homeY}, {.zStep = 1, .zDirection = motorDirection.homeZ}};
-    step_t step = {.duration = speed, .axes=axes[axis]};
-    if (!forwards) {
-        step.axes.xDirection = (uint8_t) !step.axes.xDirection;
-        step.axes.yDirection = (uint8_t) !step.axes.yDirection;
-        step.axes.zDirection = (uint8_t) !step.axes.zDirection;
+    uint8_t towardsSwitch = (uint8_t) (motorDirection.homeForwards & 1 << axis);
+    return (step_t) {.duration = speed, .axes = {
+            .steps = (uint8_t) (1 << axis),
+            .directions = forwards ? towardsSwitch : (uint8_t) (towardsSwitch ^ 1 << axis)}};
+}
+
+static int limitSwitch(int axis) {
+    spi_input_t input = cncMemory.spiInput;
+    switch (axis) {
+        case AXIS_X:
+            return input.limitX;
+        case AXIS_Y:
+            return input.limitY;
+        case AXIS_Z:
+            return input.limitZ;
+        case AXIS_A:
+            return input.limitA;
+        case AXIS_B:
+            return input.limitB;
+        default:
+            return input.limitC;
     }
-    return step;
+}
+
+//Z first to park the tool far from the clutter on the table, the rotary axes last
+static const uint8_t homingOrder[] = {AXIS_Z, AXIS_X, AXIS_Y, AXIS_A, AXIS_B, AXIS_C};
+
+//the home is where the switch was sampled tripped, the steps made while the filter and the loop caught up are kept
+static void setHomeAtTrip(int axis) {
+    int32_t trip = limitSwitchTripPosition(axis);
+    //when first time homing, we avoid moving the declared origin in case the axis had been zeroed before homing
+    if (!(cncMemory.homedAxes & 1 << axis))
+        cncMemory.workOffset.axes[axis] += trip;
+    //the step interrupt moves the position too
+    __disable_irq();
+    cncMemory.position.axes[axis] -= trip;
+    __enable_irq();
+    cncMemory.homedAxes |= 1 << axis;
 }
 
 static step_t nextStepFromHomingProgram() {
-    const uint16_t fastApproachSpeed = 40;
-    const uint16_t backupSpeed = fastApproachSpeed;
-    const uint16_t slowTouchSpeed = 500;
+    //at the default 200kHz clockFrequency, a step every 2 SPI exchanges: the trip is latched within a step
+    const uint16_t approachSpeed = 40;
+    const uint16_t backupSpeed = approachSpeed;
     const int backupSteps = 700;
     static int backupStepIndex;
+    static int homingIndex;
+    static int axis;
     crBeginGuarded(!cncMemory.stopHomingFlag, (step_t) {.duration = 0});
             //if we are already on a switch, back up
-            crYieldUntil(homingStep(2, 0, backupSpeed), !cncMemory.spiInput.limitZ);
-            crYieldUntil(homingStep(0, 0, backupSpeed), !cncMemory.spiInput.limitX);
-            crYieldUntil(homingStep(1, 0, backupSpeed), !cncMemory.spiInput.limitY);
-
-            //home Z first to park the tool far from the clutter on the table
-            //run fast to the switch
-            crYieldUntil(homingStep(2, 1, fastApproachSpeed), cncMemory.spiInput.limitZ);
-            //back up from the switch
-            crYieldUntil(homingStep(2, 0, backupSpeed), !cncMemory.spiInput.limitZ);
-            backupStepIndex = backupSteps;
-            crYieldUntil(homingStep(2, 0, backupSpeed), backupStepIndex-- == 0);
-            // get there slowly again
-            crYieldUntil(homingStep(2, 1, slowTouchSpeed), cncMemory.spiInput.limitZ);
-            //when first time homing, we avoid moving the declared origin in case the axis had been zeroed before homing
-            if (!cncMemory.zHomed)
-                cncMemory.workOffset.z += cncMemory.position.z;
-            cncMemory.position.z = 0;
-            cncMemory.zHomed = 1;
-            //back up from the switch
-            crYieldUntil(homingStep(2, 0, backupSpeed), !cncMemory.spiInput.limitZ);
-            backupStepIndex = backupSteps;
-            crYieldUntil(homingStep(2, 0, backupSpeed), backupStepIndex-- == 0);
-
-            //home X
-            crYieldUntil(homingStep(0, 1, fastApproachSpeed), cncMemory.spiInput.limitX);
-            crYieldUntil(homingStep(0, 0, backupSpeed), !cncMemory.spiInput.limitX);
-            backupStepIndex = backupSteps;
-            crYieldUntil(homingStep(0, 0, backupSpeed), backupStepIndex-- == 0);
-            crYieldUntil(homingStep(0, 1, slowTouchSpeed), cncMemory.spiInput.limitX);
-            if (!cncMemory.xHomed)
-                cncMemory.workOffset.x += cncMemory.position.x;
-            cncMemory.position.x = 0;
-            cncMemory.xHomed = 1;
-            crYieldUntil(homingStep(0, 0, backupSpeed), !cncMemory.spiInput.limitX);
-            backupStepIndex = backupSteps;
-            crYieldUntil(homingStep(0, 0, backupSpeed), backupStepIndex-- == 0);
-
-            //home Y
-            crYieldUntil(homingStep(1, 1, fastApproachSpeed), cncMemory.spiInput.limitY);
-            crYieldUntil(homingStep(1, 0, backupSpeed), !cncMemory.spiInput.limitY);
-            backupStepIndex = backupSteps;
-            crYieldUntil(homingStep(1, 0, backupSpeed), backupStepIndex-- == 0);
-            crYieldUntil(homingStep(1, 1, slowTouchSpeed), cncMemory.spiInput.limitY);
-            if (!cncMemory.yHomed)
-                cncMemory.workOffset.y += cncMemory.position.y;
-            cncMemory.position.y = 0;
-            cncMemory.yHomed = 1;
-            crYieldUntil(homingStep(1, 0, backupSpeed), !cncMemory.spiInput.limitY);
-            backupStepIndex = backupSteps;
-            crYieldUntil(homingStep(1, 0, backupSpeed), backupStepIndex-- == 0);
+            for (homingIndex = 0; homingIndex < AXES_COUNT; homingIndex++) {
+                axis = homingOrder[homingIndex];
+                crYieldUntil(homingStep(axis, 0, backupSpeed), !limitSwitch(axis));
+            }
 
+            for (homingIndex = 0; homingIndex < AXES_COUNT; homingIndex++) {
+                axis = homingOrder[homingIndex];
+                //a single touch, the position is latched when the switch trips
+                crYieldUntil(homingStep(axis, 1, approachSpeed), limitSwitch(axis));
+                setHomeAtTrip(axis);
+                //back up from the switch
+                crYieldUntil(homingStep(axis, 0, backupSpeed), !limitSwitch(axis));
+                backupStepIndex = backupSteps;
+                crYieldUntil(homingStep(axis, 0, backupSpeed), backupStepIndex-- == 0);
+            }
+
+            //the machine position is known, it's kept across the power cycles
+            savePosition();
             cncMemory.state = READY;
-            crReturn((step_t) {.duration = 0});
     crFinish;
+    //homing is over, an idle step
+    return (step_t) {.duration = 0};
 }
 
 static step_t nextHomingStep() {
@@ -220,42 +538,24 @@ static step_t nextHomingStep() {
     return step;
 }
 
-//returns 1 if a step was started
-int startNextStep() {
+//returns a zero duration step when there is nothing to do
+static step_t nextStep() {
     if (cncMemory.state == MANUAL_CONTROL)
-        return startStep(nextManualStep());
+        return nextManualStep();
     else if (cncMemory.state == RUNNING_PROGRAM)
-        return startStep(nextProgramStep());
+        return nextProgramStep();
     else if (cncMemory.state == HOMING)
-        return startStep(nextHomingStep());
-    else
-        cncMemory.position.speed = 0;
-    return 0;
+        return nextHomingStep();
+    return (step_t) {.duration = 0};
 }
 
 static void updateMemoryPosition(step_t step) {
-    if (step.axes.xStep)
-        cncMemory.position.x += step.axes.xDirection ? 1 : -1;
-    if (step.axes.yStep)
-        cncMemory.position.y += step.axes.yDirection ? 1 : -1;
-    if (step.axes.zStep)
-        cncMemory.position.z += step.axes.zDirection ? 1 : -1;
-}
-
-static int stepTimeHasCome() {
-    return TIM_GetITStatus(TIM3, TIM_IT_CC1) != RESET;
-}
-
-static void clearStepTimeHasCome() {
-    TIM_ClearITPendingBit(TIM3, TIM_IT_CC1);
-}
-
-static int stepIsOver() {
-    return TIM_GetITStatus(TIM3, TIM_IT_Update) != RESET;
-}
-
-static void clearStepIsOver() {
-    TIM_ClearITPendingBit(TIM3, TIM_IT_Update);
+    if (!step.axes.steps)
+        return;
+    cncMemory.executedSteps++;
+    for (int i = 0; i < AXES_COUNT; i++)
+        if (step.axes.steps & 1 << i)
+            cncMemory.position.axes[i] += step.axes.directions & 1 << i ? 1 : -1;
 }
 
 static int emergencyStopFilter = 300;
@@ -270,36 +570,376 @@ uint32_t isEmergencyStopped() {
 }
 
 static void setStepGPIO(axes_t axes) {
-    uint16_t steps = 0;
-    if (axes.xStep)
-        steps |= motorsPinout.xStep;
-    if (axes.yStep)
-        steps |= motorsPinout.yStep;
-    if (axes.zStep)
-        steps |= motorsPinout.zStep;
-    GPIO_SetBits(motorsPinout.gpio, steps);
+    GPIO_SetBits(motorsPinout.gpio, stepsGPIO(axes));
+}
+
+#if STEP_DMA
+//the CPU refills one half of the table while the DMA plays the other one
+#define STEP_DMA_TABLE_SIZE 64U
+#define STEP_DMA_HALF_SIZE (STEP_DMA_TABLE_SIZE / 2)
+//duration of the entries written when there is no step to play, in clockFrequency periods
+#define STEP_DMA_IDLE_DURATION 20U
+
+//DMA1 can't reach the GPIOs on AHB1, hence TIM8 and DMA2 channel 7 instead of TIM3
+static const struct {
+    TIM_TypeDef *timer;
+    //update, compare 1 and compare 2 requests
+    DMA_Stream_TypeDef *startStream, *stepStream, *durationStream;
+    uint32_t channel;
+    uint8_t irqN;
+    uint32_t halfTransferFlag, transferCompleteFlag;
+} stepDMAPinout = {
+        .timer = TIM8,
+        .startStream = DMA2_Stream1,
+        .stepStream = DMA2_Stream2,
+        .durationStream = DMA2_Stream3,
+        .channel = DMA_Channel_7,
+        .irqN = DMA2_Stream3_IRQn,
+        .halfTransferFlag = DMA_IT_HTIF3,
+        .transferCompleteFlag = DMA_IT_TCIF3
+};
+
+static struct {
+    //BSRR word written at the update event that ends entry i, it sets up the directions of entry i + 1
+    uint32_t startWords[STEP_DMA_TABLE_SIZE];
+    //BSRR word written at compare 1, it raises the step pins of entry i
+    uint32_t stepWords[STEP_DMA_TABLE_SIZE];
+    //ARR value written at compare 2, at the beginning of entry i
+    uint16_t durations[STEP_DMA_TABLE_SIZE];
+    //to update the position once the entry has been played
+    step_t steps[STEP_DMA_TABLE_SIZE];
+    uint32_t nextAccountedEntry;
+    //the entry holds a step popped from the queue that was not played yet
+    uint8_t pending[STEP_DMA_TABLE_SIZE];
+    //successive halves filled without any step
+    uint32_t idleHalves;
+} stepTable;
+
+static uint32_t startWord(axes_t axes) {
+    uint16_t directions = directionsGPIO(axes);
+    uint16_t reset = (uint16_t) ((motorPins.directions & ~directions) | motorPins.steps);
+    return (uint32_t) reset << 16 | directions;
+}
+
+static void fillTableHalf(uint32_t half) {
+    int hasSteps = 0;
+    for (uint32_t i = half * STEP_DMA_HALF_SIZE; i < (half + 1) * STEP_DMA_HALF_SIZE; i++) {
+        int hasStep = queuedSteps() && cncMemory.state == RUNNING_PROGRAM;
+        step_t step = hasStep ? popStep() : (step_t) {.duration = STEP_DMA_IDLE_DURATION};
+        uint32_t idleWord = (uint32_t) motorPins.steps << 16;
+        stepTable.startWords[(i + STEP_DMA_TABLE_SIZE - 1) % STEP_DMA_TABLE_SIZE] = hasStep ? startWord(step.axes) : idleWord;
+        stepTable.stepWords[i] = stepsGPIO(step.axes);
+        stepTable.durations[i] = step.duration;
+        stepTable.steps[i] = step;
+        stepTable.pending[i] = (uint8_t) hasStep;
+        hasSteps |= hasStep;
+    }
+    stepTable.idleHalves = hasSteps ? 0 : stepTable.idleHalves + 1;
+}
+
+//the entries between from and to (excluded) have raised their step pins
+static void accountTableEntries(uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i != to; i = (i + 1) % STEP_DMA_TABLE_SIZE) {
+        updateMemoryPosition(stepTable.steps[i]);
+        cncMemory.currentStep = stepTable.steps[i];
+        stepTable.pending[i] = 0;
+    }
+    cncMemory.position.speed = stepSpeed(cncMemory.currentStep);
+    stepTable.nextAccountedEntry = to;
+}
+
+static void stopDMASteps() {
+    TIM_Cmd(stepDMAPinout.timer, DISABLE);
+    DMA_Cmd(stepDMAPinout.startStream, DISABLE);
+    DMA_Cmd(stepDMAPinout.stepStream, DISABLE);
+    DMA_Cmd(stepDMAPinout.durationStream, DISABLE);
+    DMA_ClearITPendingBit(stepDMAPinout.durationStream,
+            stepDMAPinout.halfTransferFlag | stepDMAPinout.transferCompleteFlag);
+    uint32_t played = STEP_DMA_TABLE_SIZE - DMA_GetCurrDataCounter(stepDMAPinout.durationStream);
+    accountTableEntries(stepTable.nextAccountedEntry, played % STEP_DMA_TABLE_SIZE);
+    GPIO_ResetBits(motorsPinout.gpio, motorPins.steps);
+    stepQueue.running = 0;
+    stepQueue.usingDMA = 0;
+    cncMemory.position.speed = 0;
+}
+
+//the steps that the table still holds go back in front of the queue, to be played on resume
+static void pauseDMASteps() {
+    stopDMASteps();
+    uint16_t pendingCount = 0;
+    for (uint32_t i = 0; i < STEP_DMA_TABLE_SIZE; i++)
+        pendingCount += stepTable.pending[i];
+    stepQueue.readCount -= pendingCount;
+    uint16_t slot = stepQueue.readCount;
+    for (uint32_t j = 0; j < STEP_DMA_TABLE_SIZE; j++) {
+        uint32_t i = (stepTable.nextAccountedEntry + j) % STEP_DMA_TABLE_SIZE;
+        if (stepTable.pending[i]) {
+            stepQueue.steps[slot++ % STEP_QUEUE_SIZE] = stepTable.steps[i];
+            stepTable.pending[i] = 0;
+        }
+    }
+}
+
+//the timer and the streams have to be stopped
+static void startDMASteps() {
+    stepTable.idleHalves = 0;
+    stepTable.nextAccountedEntry = 0;
+    fillTableHalf(0);
+    fillTableHalf(1);
+    DMA_SetCurrDataCounter(stepDMAPinout.startStream, STEP_DMA_TABLE_SIZE);
+    DMA_SetCurrDataCounter(stepDMAPinout.stepStream, STEP_DMA_TABLE_SIZE);
+    DMA_SetCurrDataCounter(stepDMAPinout.durationStream, STEP_DMA_TABLE_SIZE);
+    DMA_Cmd(stepDMAPinout.startStream, ENABLE);
+    DMA_Cmd(stepDMAPinout.stepStream, ENABLE);
+    DMA_Cmd(stepDMAPinout.durationStream, ENABLE);
+    //the first entry has no update event before it
+    uint32_t firstWord = stepTable.startWords[STEP_DMA_TABLE_SIZE - 1];
+    GPIO_ResetBits(motorsPinout.gpio, (uint16_t) (firstWord >> 16));
+    GPIO_SetBits(motorsPinout.gpio, (uint16_t) firstWord);
+    stepDMAPinout.timer->ARR = stepTable.durations[0];
+    stepDMAPinout.timer->CNT = 0;
+    stepQueue.running = 1;
+    stepQueue.usingDMA = 1;
+    TIM_Cmd(stepDMAPinout.timer, ENABLE);
+}
+
+static void initStepDMA() {
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM8, ENABLE);
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
+    TIM_Cmd(stepDMAPinout.timer, DISABLE);
+    TIM_TimeBaseInit(stepDMAPinout.timer, &((TIM_TimeBaseInitTypeDef) {
+            .TIM_Period = 10000,
+            .TIM_Prescaler = stepTiming.dmaTimerPrescaler,
+            .TIM_ClockDivision = 0,
+            .TIM_CounterMode = TIM_CounterMode_Up,
+            .TIM_RepetitionCounter = 0}));
+    //ARR is written by the DMA at the start of the period it applies to
+    TIM_ARRPreloadConfig(stepDMAPinout.timer, DISABLE);
+    TIM_OC1Init(stepDMAPinout.timer, &(TIM_OCInitTypeDef) {
+            .TIM_OCMode = TIM_OCMode_Timing,
+            .TIM_Pulse = 1});
+    TIM_OC2Init(stepDMAPinout.timer, &(TIM_OCInitTypeDef) {
+            .TIM_OCMode = TIM_OCMode_Timing,
+            .TIM_Pulse = 1});
+    TIM_DMACmd(stepDMAPinout.timer, TIM_DMA_Update | TIM_DMA_CC1 | TIM_DMA_CC2, ENABLE);
+    struct {
+        DMA_Stream_TypeDef *stream;
+        uint32_t destination, source, peripheralSize, memorySize, priority;
+    } streams[] = {
+            {stepDMAPinout.startStream, (uint32_t) &motorsPinout.gpio->BSRRL, (uint32_t) stepTable.startWords,
+                    DMA_PeripheralDataSize_Word, DMA_MemoryDataSize_Word, DMA_Priority_VeryHigh},
+            {stepDMAPinout.stepStream, (uint32_t) &motorsPinout.gpio->BSRRL, (uint32_t) stepTable.stepWords,
+                    DMA_PeripheralDataSize_Word, DMA_MemoryDataSize_Word, DMA_Priority_VeryHigh},
+            //after the step stream, so that a refill doesn't overwrite a step word that was not played yet
+            {stepDMAPinout.durationStream, (uint32_t) &stepDMAPinout.timer->ARR, (uint32_t) stepTable.durations,
+                    DMA_PeripheralDataSize_HalfWord, DMA_MemoryDataSize_HalfWord, DMA_Priority_High}};
+    for (uint32_t i = 0; i < sizeof(streams) / sizeof(*streams); i++) {
+        DMA_Cmd(streams[i].stream, DISABLE);
+        DMA_Init(streams[i].stream, &(DMA_InitTypeDef) {
+                .DMA_Channel = stepDMAPinout.channel,
+                .DMA_PeripheralBaseAddr = streams[i].destination,
+                .DMA_Memory0BaseAddr = streams[i].source,
+                .DMA_DIR = DMA_DIR_MemoryToPeripheral,
+                .DMA_BufferSize = STEP_DMA_TABLE_SIZE,
+                .DMA_PeripheralInc = DMA_PeripheralInc_Disable,
+                .DMA_MemoryInc = DMA_MemoryInc_Enable,
+                .DMA_PeripheralDataSize = streams[i].peripheralSize,
+                .DMA_MemoryDataSize = streams[i].memorySize,
+                .DMA_Mode = DMA_Mode_Circular,
+                .DMA_Priority = streams[i].priority,
+                .DMA_FIFOMode = DMA_FIFOMode_Disable,
+                .DMA_FIFOThreshold = DMA_FIFOThreshold_HalfFull,
+                .DMA_MemoryBurst = DMA_MemoryBurst_Single,
+                .DMA_PeripheralBurst = DMA_PeripheralBurst_Single});
+    }
+    DMA_ITConfig(stepDMAPinout.durationStream, DMA_IT_HT | DMA_IT_TC, ENABLE);
+    NVIC_Init(&(NVIC_InitTypeDef) {
+            .NVIC_IRQChannel = stepDMAPinout.irqN,
+            .NVIC_IRQChannelPreemptionPriority = 0,
+            .NVIC_IRQChannelSubPriority = 0,
+            .NVIC_IRQChannelCmd = ENABLE});
+}
+#endif
+
+static void startSteps() {
+#if STEP_DMA
+    if (programStepsUseDMA()) {
+        startDMASteps();
+        return;
+    }
+#endif
+    startTimerSteps();
+}
+
+static void stopSteps() {
+#if STEP_DMA
+    if (stepQueue.usingDMA) {
+        stopDMASteps();
+        return;
+    }
+#endif
+    stopTimerSteps();
+}
+
+//TIM3 stops by itself at the next step boundary, but the DMA table would go on with the steps it holds
+static void pauseProgram() {
+    __disable_irq();
+    cncMemory.state = PAUSED_PROGRAM;
+#if STEP_DMA
+    if (stepQueue.usingDMA)
+        pauseDMASteps();
+#endif
+    __enable_irq();
+}
+
+static void stepBoundary() {
+    if (stepQueue.nextArmed && stepsAllowed()) {
+        beginStep();
+        armNextStep();
+    } else {
+        stopTimerSteps();
+        if (queuedSteps() && stepsAllowed())
+            startSteps();
+    }
+}
+
+static void stepEdge() {
+    setStepGPIO(cncMemory.currentStep.axes);
+    //the counter goes from 0 to ARR, the duration of the current step
+    timeStepEdge(stepTimerCycles(cncMemory.currentStep.duration + 1U));
+    updateMemoryPosition(cncMemory.currentStep);
+}
+
+__attribute__ ((used)) void TIM3_IRQHandler(void) {
+    uint32_t profileStart = beginInterruptProfile();
+    //a handler late by more than CCR1 ticks finds both flags, the counter past CCR1 tells that the compare event
+    //belongs to the step that began at the update: the boundary goes first
+    if (TIM_GetITStatus(TIM3, TIM_IT_CC1) != RESET
+            && !(TIM_GetITStatus(TIM3, TIM_IT_Update) != RESET && TIM3->CNT >= TIM3->CCR1)) {
+        TIM_ClearITPendingBit(TIM3, TIM_IT_CC1);
+        stepEdge();
+    }
+    if (TIM_GetITStatus(TIM3, TIM_IT_Update) != RESET) {
+        TIM_ClearITPendingBit(TIM3, TIM_IT_Update);
+        stepBoundary();
+    }
+    //stepBoundary() clears the flag when it stops the timer
+    if (TIM_GetITStatus(TIM3, TIM_IT_CC1) != RESET) {
+        TIM_ClearITPendingBit(TIM3, TIM_IT_CC1);
+        stepEdge();
+    }
+    endInterruptProfile(ISR_STEP_TIMER, profileStart);
+}
+
+#if STEP_DMA
+//a half of the table has been played, refill it
+static void refillStepTable() {
+    uint32_t half;
+    if (DMA_GetITStatus(stepDMAPinout.durationStream, stepDMAPinout.halfTransferFlag) != RESET) {
+        DMA_ClearITPendingBit(stepDMAPinout.durationStream, stepDMAPinout.halfTransferFlag);
+        half = 0;
+    } else if (DMA_GetITStatus(stepDMAPinout.durationStream, stepDMAPinout.transferCompleteFlag) != RESET) {
+        DMA_ClearITPendingBit(stepDMAPinout.durationStream, stepDMAPinout.transferCompleteFlag);
+        half = 1;
+    } else
+        return;
+    accountTableEntries(half * STEP_DMA_HALF_SIZE, ((half + 1) * STEP_DMA_HALF_SIZE) % STEP_DMA_TABLE_SIZE);
+    if (stepTable.idleHalves >= 2) {
+        //both halves are only idle entries
+        stopDMASteps();
+        if (queuedSteps() && stepsAllowed())
+            startSteps();
+    } else
+        fillTableHalf(half);
 }
 
+__attribute__ ((used)) void DMA2_Stream3_IRQHandler(void) {
+    uint32_t profileStart = beginInterruptProfile();
+    refillStepTable();
+    endInterruptProfile(ISR_STEP_DMA, profileStart);
+}
+#endif
+
+//a timer has to count at clockFrequency
+int parametersAreValid(const parameters_t *parameters) {
+    for (int i = 0; i < AXES_COUNT; i++)
+        if (!parameters->axes[i].stepsPerMillimeter || !parameters->axes[i].maxSpeed
+                || !parameters->axes[i].maxAcceleration)
+            return 0;
+    return parameters->clockFrequency > SystemCoreClock / 65536 && parameters->clockFrequency <= SystemCoreClock / 4;
+}
+
+static int machineIsIdle() {
+    return cncMemory.state == READY && !stepQueue.running && !queuedSteps();
+}
+
+//refused while the steppers can move
+int setParameters(const parameters_t *parameters) {
+    if (!machineIsIdle() || !parametersAreValid(parameters))
+        return 0;
+    cncMemory.parameters = *parameters;
+    deriveStepTiming();
+    TIM_PrescalerConfig(TIM3, stepTiming.stepTimerPrescaler, TIM_PSCReloadMode_Immediate);
+    TIM_ClearITPendingBit(TIM3, TIM_IT_CC1 | TIM_IT_Update);
+#if STEP_DMA
+    TIM_PrescalerConfig(stepDMAPinout.timer, stepTiming.dmaTimerPrescaler, TIM_PSCReloadMode_Immediate);
+    TIM_ClearITPendingBit(stepDMAPinout.timer, TIM_IT_Update);
+#endif
+    return 1;
+}
+
+static void startStepsIfStopped() {
+    __disable_irq();
+    if (!stepQueue.running && queuedSteps() && stepsAllowed())
+        startSteps();
+    __enable_irq();
+}
+
+static void pushStep(step_t step) {
+    stepQueue.steps[stepQueue.writeCount % STEP_QUEUE_SIZE] = step;
+    stepQueue.writeCount++;
+    programMarks.pushedSteps++;
+    startStepsIfStopped();
+}
+
+static void flushSteps() {
+    __disable_irq();
+    stopSteps();
+    stepQueue.readCount = stepQueue.writeCount;
+    __enable_irq();
+}
+
+//the steps are executed by TIM3_IRQHandler(), this just keeps the queue filled
 static void run() {
     crBegin;
+            if (cncMemory.state == ABORTING_PROGRAM) {
+                flushSteps();
+                beginProgram(PROGRAM_STEPS, 0);
+            }
             if (cncMemory.state == RUNNING_PROGRAM)
+                chainNextProgram();
+            if (cncMemory.state == RUNNING_PROGRAM && programDecoderIsEmpty())
                 checkProgramEnd();
             crYieldVoidUntil(!isEmergencyStopped() && cncMemory.state != PAUSED_PROGRAM);
-
-            if (startNextStep()) {
-                crYieldVoidUntil(stepTimeHasCome());
-                setStepGPIO(cncMemory.currentStep.axes);
-                updateMemoryPosition(cncMemory.currentStep);
-                clearStepTimeHasCome();
-                crYieldVoidUntil(stepIsOver());
-                clearStepIsOver();
+            //manual and homing steps depend on live inputs, only one is computed ahead of the running one
+            if (queuedSteps() < (cncMemory.state == RUNNING_PROGRAM ? STEP_QUEUE_AHEAD : 1)) {
+                step_t step = nextStep();
+                if (step.duration)
+                    pushStep(clampStep(step));
             }
+            startStepsIfStopped();
+            //nothing to play although the program is not over: the decoder had no data
+            recordStarvation(cncMemory.state == RUNNING_PROGRAM && !stepQueue.running);
     crFinish;
 }
 
 __attribute__ ((noreturn)) void main(void) {
     //enable FPU
     SCB->CPACR |= 0b000000000111100000000000000000000UL;
+    initCycleCounter();
+    //before anything is derived from the parameters or the host can ask for them
+    loadSettings();
+    deriveStepTiming();
 
     STM_EVAL_LEDInit(LED3);
     STM_EVAL_LEDInit(LED4);
@@ -312,10 +952,9 @@ __attribute__ ((noreturn)) void main(void) {
 
     RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOE, ENABLE);
 
+    initMotorPins();
     GPIO_Init(motorsPinout.gpio, &(GPIO_InitTypeDef) {
-            .GPIO_Pin = motorsPinout.xDirection | motorsPinout.xStep
-                    | motorsPinout.yDirection | motorsPinout.yStep
-                    | motorsPinout.zDirection | motorsPinout.zStep,
+            .GPIO_Pin = motorPins.directions | motorPins.steps,
             .GPIO_Mode = GPIO_Mode_OUT,
             .GPIO_Speed = GPIO_Speed_2MHz,
             .GPIO_OType = GPIO_OType_OD,
@@ -334,7 +973,7 @@ __attribute__ ((noreturn)) void main(void) {
     TIM3->CNT = 0;
     TIM_TimeBaseInit(TIM3, &((TIM_TimeBaseInitTypeDef) {
             .TIM_Period = 10000,
-            .TIM_Prescaler = (uint16_t) ((SystemCoreClock / 2) / cncMemory.parameters.clockFrequency) - 1,
+            .TIM_Prescaler = stepTiming.stepTimerPrescaler,
             .TIM_ClockDivision = 0,
             .TIM_CounterMode = TIM_CounterMode_Up}));
     /* Channel1 for step */
@@ -344,12 +983,22 @@ __attribute__ ((noreturn)) void main(void) {
             .TIM_Pulse = 1,
             .TIM_OCPolarity = TIM_OCPolarity_High});
     TIM_OC1PreloadConfig(TIM3, TIM_OCPreload_Disable);
+    //the duration of the next step is written during the current one
+    TIM_ARRPreloadConfig(TIM3, ENABLE);
     TIM_ITConfig(TIM3, TIM_IT_CC1 | TIM_IT_Update, ENABLE);
+    NVIC_Init(&(NVIC_InitTypeDef) {
+            .NVIC_IRQChannel = TIM3_IRQn,
+            .NVIC_IRQChannelPreemptionPriority = 0,
+            .NVIC_IRQChannelSubPriority = 0,
+            .NVIC_IRQChannelCmd = ENABLE});
+#if STEP_DMA
+    initStepDMA();
+#endif
 
     initSPISystem();
     initUSB();
     initManualControls();
-    SysTick_Config(SystemCoreClock / 100000 - 1);
+    SysTick_Config(SystemCoreClock / TICK_FREQUENCY - 1);
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wmissing-noreturn"
@@ -357,20 +1006,34 @@ __attribute__ ((noreturn)) void main(void) {
         if (isEmergencyStopped()) {
             //pause the program so that it doesn't restart when releasing the button
             if (cncMemory.state == RUNNING_PROGRAM)
-                cncMemory.state = PAUSED_PROGRAM;
+                pauseProgram();
             cncMemory.spiOutput.run = 0;
         }
+        enterLoopSection(LOOP_SPI);
         handleSPI();
+        enterLoopSection(LOOP_SPI_PERIODIC);
         periodicSpiFunction();
-        copyUSBufferIfPossible();
+        enterLoopSection(LOOP_BULK_RECEPTION);
+        armBulkReceptionIfPossible();
+        enterLoopSection(LOOP_CREDITS);
+        reportCreditsIfPossible();
+        enterLoopSection(LOOP_TELEMETRY);
+        sendTelemetryIfDue();
+        enterLoopSection(LOOP_PROGRAM_START);
         if ((cncMemory.state == READY || cncMemory.state == MANUAL_CONTROL) && !isEmergencyStopped())
             tryToStartProgram();
+        enterLoopSection(LOOP_RUN);
         run();
+        enterLoopSection(LOOP_STORAGE);
+        if (machineIsIdle())
+            saveSettingsIfChanged();
     }
 #pragma clang diagnostic pop
 }
 
 __attribute__ ((used)) void SysTick_Handler(void) {
+    uint32_t profileStart = beginInterruptProfile();
     cncMemory.tick++;
     periodicUICallback();
+    endInterruptProfile(ISR_SYSTICK, profileStart);
 }
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include "stm32f4xx_conf.h"
 #include "stm32f4_discovery.h"
 #include "arm_math.h"
@@ -18,151 +19,271 @@ static const struct {
         .yOrientation = 1,
         .zOrientation = 1};
 
+//the joystick is filtered at TICK_FREQUENCY, the jog periods are recomputed every JOG_UPDATE_TICKS
+#define JOG_UPDATE_TICKS 100
+//joystick positions are Q15, full deflection is JOYSTICK_ONE
+#define JOYSTICK_BITS 15
+#define JOYSTICK_ONE (1 << JOYSTICK_BITS)
+//the filtered ADC values are Q16
+#define ADC_FRACTION_BITS 16
+//the exponential feed curves are indexed by the FEED_CURVE_BITS upper bits of the joystick magnitude
+#define FEED_CURVE_BITS 8
+#define FEED_CURVE_POINTS ((1 << FEED_CURVE_BITS) + 1)
+//feeds are in mm/min, Q8
+#define FEED_FRACTION_BITS 8
+//periods are in step timer ticks, Q8
+#define PERIOD_FRACTION_BITS 8
+#define MAX_JOG_PERIOD (1 << 30)
+#define MAX_STEP_DURATION 0xFFFFU
+
 static volatile struct {
-    float32_t x, y, z;
-    float32_t deadzoneRadius;
-    float32_t snapOnAxisRadius;
+    //Q15
+    int32_t deadzoneRadius;
+    int32_t snapOnAxisRadius;
     int32_t minFeed;
     int32_t maxFeed;
     int32_t maxZFeed;
-    float32_t zeroX, zeroY, zeroZ;
-    uint64_t lastTick;
-    vec3f_t lastSpeed;
+    //Q16 ADC units
+    int32_t zero[3];
     volatile __attribute__((aligned (4))) uint8_t adcValue[3];
-    vec3f_t filteredAdc;
+    int32_t filteredAdc[3];
+    //incremented by periodicUICallback() every JOG_UPDATE_TICKS
+    uint32_t inputSequence;
 } manualControlStatus = {
-        .deadzoneRadius = 0.01F,
-        .snapOnAxisRadius = 0.70F,
+        .deadzoneRadius = JOYSTICK_ONE / 100,
+        .snapOnAxisRadius = JOYSTICK_ONE * 70 / 100,
         .minFeed = 5,
         .maxFeed = 4000,
         .maxZFeed = 1000,
-        .zeroX = 128,
-        .zeroY = 128,
-        .zeroZ = 128,
-        .lastTick = 0,
-        .lastSpeed = {0, 0, 0},
+        .zero = {128 << ADC_FRACTION_BITS, 128 << ADC_FRACTION_BITS, 128 << ADC_FRACTION_BITS},
         .adcValue = {0, 0, 0},
-        .filteredAdc= {0, 0, 0}};
+        .filteredAdc = {0, 0, 0},
+        .inputSequence = 0};
+
+//minFeed * (maxFeed / minFeed) ^ magnitude, built by initManualControls()
+static struct {
+    uint32_t xy[FEED_CURVE_POINTS];
+    uint32_t z[FEED_CURVE_POINTS];
+} feedCurves;
+
+//the step path only compares these, they are recomputed when the joystick moves
+static struct {
+    uint32_t appliedSequence;
+    //tracks the joystick within maxAcceleration, mm/min Q8
+    int32_t velocity[3];
+    //in timer ticks, a step doesn't wait past the next update
+    uint32_t maxDuration;
+    //0 when the axis doesn't move
+    int32_t periods[3];
+    //until the next step of each axis
+    int32_t remaining[3];
+    uint8_t directions[3];
+} jog = {
+        .appliedSequence = 0,
+        .velocity = {0, 0, 0},
+        .maxDuration = MAX_STEP_DURATION,
+        .periods = {0, 0, 0},
+        .remaining = {0, 0, 0},
+        .directions = {0, 0, 0}};
+
+static uint32_t squareRoot(uint64_t value) {
+    uint64_t root = 0;
+    for (uint64_t bit = 1ULL << 62; bit; bit >>= 2)
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else
+            root >>= 1;
+    return (uint32_t) root;
+}
 
+static int32_t norm(const int32_t *vector) {
+    return (int32_t) squareRoot((uint64_t) ((int64_t) vector[0] * vector[0] + (int64_t) vector[1] * vector[1]
+            + (int64_t) vector[2] * vector[2]));
+}
 
-static float32_t norm(vec3f_t vector) {
-    //fuck [golberg91]
-    return sqrtf(vector.x * vector.x + vector.y * vector.y + vector.z * vector.z);
+static void scaleVector(int32_t *vector, int32_t numerator, int32_t denominator) {
+    for (int i = 0; i < 3; i++)
+        vector[i] = (int32_t) ((int64_t) vector[i] * numerator / denominator);
 }
 
-static char findMajorAxis(vec3f_t vector) {
-    float32_t absX = fabsf(vector.x), absY = fabsf(vector.y), absZ = fabsf(vector.z);
-    return (char) ((absX >= absY && absX >= absZ) ? 'x' : (absY >= absX && absY >= absZ) ? 'y' : 'z');
+static int findMajorAxis(const int32_t *vector) {
+    int32_t absX = abs(vector[0]), absY = abs(vector[1]), absZ = abs(vector[2]);
+    return (absX >= absY && absX >= absZ) ? 0 : (absY >= absX && absY >= absZ) ? 1 : 2;
 }
 
-static vec3f_t snapAxes(vec3f_t speedVector) {
-    char majorAxis = findMajorAxis(speedVector);
+static void snapAxes(int32_t *position) {
+    int majorAxis = findMajorAxis(position);
     //is always alone
-    if (majorAxis == 'z')
-        return (vec3f_t) {.z = speedVector.z};
-    else
-        speedVector.z = 0;
-    if (norm(speedVector) > manualControlStatus.snapOnAxisRadius)
-        return speedVector;
-    return majorAxis == 'x' ? (vec3f_t) {.x = speedVector.x} : (vec3f_t) {.y = speedVector.y};
+    if (majorAxis == 2) {
+        position[0] = 0;
+        position[1] = 0;
+        return;
+    }
+    position[2] = 0;
+    if (norm(position) > manualControlStatus.snapOnAxisRadius)
+        return;
+    position[1 - majorAxis] = 0;
 }
 
-static vec3f_t joystick2speed(vec3f_t joystickPosition) {
-    float32_t magnitude = norm(joystickPosition);
-    if (magnitude == 0)
-        return joystickPosition;
-    float32_t minSpeed = manualControlStatus.minFeed / 60.0F;
-    float32_t maxSpeed = manualControlStatus.maxFeed / 60.0F;
-    float32_t ratio = powf(maxSpeed, magnitude) * powf(minSpeed, (1 - magnitude));
-    return (vec3f_t) {joystickPosition.x * ratio, joystickPosition.y * ratio,
-            joystickPosition.z * (powf(manualControlStatus.maxZFeed / 60.0F, magnitude) * powf(minSpeed, (1 - magnitude)))};
+static void buildFeedCurve(uint32_t *curve, int32_t minFeed, int32_t maxFeed) {
+    for (int i = 0; i < FEED_CURVE_POINTS; i++)
+        curve[i] = (uint32_t) (minFeed * powf((float32_t) maxFeed / minFeed, (float32_t) i / (FEED_CURVE_POINTS - 1))
+                * (1 << FEED_FRACTION_BITS));
 }
 
-static uint16_t deadlineForDate(float32_t speed, uint64_t date) {
-    uint64_t period = (uint64_t) (cncMemory.parameters.clockFrequency / fabsf(speed) / cncMemory.parameters.stepsPerMillimeter);
-    return (uint16_t) (period - date % period);
+//linear between the points of the curve
+static uint32_t feedAt(const uint32_t *curve, int32_t magnitude) {
+    uint32_t index = (uint32_t) magnitude >> (JOYSTICK_BITS - FEED_CURVE_BITS);
+    uint32_t fraction = (uint32_t) magnitude & ((1U << (JOYSTICK_BITS - FEED_CURVE_BITS)) - 1);
+    if (index >= FEED_CURVE_POINTS - 1)
+        return curve[FEED_CURVE_POINTS - 1];
+    return curve[index] + (uint32_t) (((uint64_t) (curve[index + 1] - curve[index]) * fraction)
+            >> (JOYSTICK_BITS - FEED_CURVE_BITS));
 }
 
 uint32_t isToolProbeTripped() {
     return (uint32_t) !GPIO_ReadInputDataBit(uiPinout.gpio, uiPinout.toolLength);
 }
 
-static step_t nextStep(vec3f_t speed, uint64_t date) {
-    step_t result = {
-            .duration = 0,
-            .axes = {
-                    .xDirection = (uint8_t) (speed.x > 0),
-                    .yDirection = (uint8_t) (speed.y > 0),
-                    .zDirection = (uint8_t) (speed.z > 0)}};
-    if (speed.x != 0) {
-        result.duration = deadlineForDate(speed.x, date);
-        result.axes.xStep = 1;
-    }
-    if (speed.y != 0) {
-        uint16_t deadlineY = deadlineForDate(speed.y, date);
-        if (deadlineY <= result.duration || result.duration == 0) {
-            result.axes.yStep = 1;
-            if (deadlineY < result.duration)
-                result.axes.xStep = 0;
-            result.duration = deadlineY;
-        }
+static void clampPositionTo1(int32_t *position) {
+    int32_t magnitude = norm(position);
+    if (magnitude > JOYSTICK_ONE)
+        scaleVector(position, JOYSTICK_ONE, magnitude);
+}
+
+static void deadZoneJoystick(int32_t *position) {
+    int32_t magnitude = norm(position);
+    int32_t deadzoneRadius = manualControlStatus.deadzoneRadius;
+    if (magnitude <= deadzoneRadius) {
+        position[0] = position[1] = position[2] = 0;
+        return;
     }
-    if (speed.z != 0) {
-        uint16_t deadlineZ = deadlineForDate(speed.z, date);
-        if (deadlineZ <= result.duration || result.duration == 0) {
-            result.axes.zStep = 1;
-            if (deadlineZ < result.duration) {
-                result.axes.xStep = 0;
-                result.axes.yStep = 0;
-            }
-            result.duration = deadlineZ;
+    //(magnitude - deadzone) / (1 - deadzone) / magnitude
+    scaleVector(position, (int32_t) ((int64_t) (magnitude - deadzoneRadius) * JOYSTICK_ONE
+            / (JOYSTICK_ONE - deadzoneRadius)), magnitude);
+}
+
+//mm/min Q8
+static int32_t jogFeed(int32_t component, int32_t magnitude, const uint32_t *curve) {
+    int32_t feed = (int32_t) ((uint64_t) abs(component) * feedAt(curve, magnitude) >> JOYSTICK_BITS);
+    return component < 0 ? -feed : feed;
+}
+
+static int32_t jogPeriod(int32_t velocity, int axis) {
+    uint64_t feed = (uint64_t) abs(velocity);
+    if (feed == 0)
+        return 0;
+    uint64_t period = ((uint64_t) cncMemory.parameters.clockFrequency * 60
+            << (FEED_FRACTION_BITS + PERIOD_FRACTION_BITS)) / (feed * cncMemory.parameters.axes[axis].stepsPerMillimeter);
+    return (int32_t) (period < MAX_JOG_PERIOD ? period : MAX_JOG_PERIOD);
+}
+
+//the change of the velocity vector is scaled down until every axis is within its own maxAcceleration
+static void trackVelocity(const int32_t *target, uint32_t elapsedUpdates) {
+    int32_t delta[3];
+    //the most limited axis sets the ratio maxDelta / |delta|, compared without dividing
+    int64_t limitingMaxDelta = 1;
+    int32_t limitingDelta = 0;
+    for (int i = 0; i < 3; i++) {
+        delta[i] = target[i] - jog.velocity[i];
+        int64_t maxDelta = ((int64_t) cncMemory.parameters.axes[i].maxAcceleration * 60 * JOG_UPDATE_TICKS
+                * elapsedUpdates << FEED_FRACTION_BITS) / TICK_FREQUENCY;
+        if (abs(delta[i]) > maxDelta && maxDelta * limitingDelta < limitingMaxDelta * abs(delta[i])) {
+            limitingMaxDelta = maxDelta;
+            limitingDelta = abs(delta[i]);
         }
     }
-    if (isToolProbeTripped()) {
-        // if tool length is tripped, only going z up is allowed
-        result.axes.xStep = 0;
-        result.axes.yStep = 0;
-        if (!result.axes.zDirection)
-            result.axes.zStep = 0;
-    }
-    return result;
+    if (limitingDelta)
+        scaleVector(delta, (int32_t) limitingMaxDelta, limitingDelta);
+    for (int i = 0; i < 3; i++)
+        jog.velocity[i] += delta[i];
 }
 
-static vec3f_t clampPositionTo1(vec3f_t joystickPosition) {
-    float32_t magnitude = norm(joystickPosition);
-    if (magnitude > 1)
-        return (vec3f_t) {joystickPosition.x / magnitude, joystickPosition.y / magnitude, joystickPosition.z / magnitude};
-    return joystickPosition;
+//once per filter update, out of the step path
+static void updateJogPeriods(uint32_t elapsedUpdates) {
+    const int8_t orientations[3] = {uiPinout.xOrientation, uiPinout.yOrientation, uiPinout.zOrientation};
+    int32_t position[3];
+    for (int i = 0; i < 3; i++)
+        //Q16 over 128 ADC units is Q15
+        position[i] = (manualControlStatus.filteredAdc[i] - manualControlStatus.zero[i])
+                / (1 << (ADC_FRACTION_BITS - JOYSTICK_BITS + 7)) * orientations[i];
+    clampPositionTo1(position);
+    deadZoneJoystick(position);
+    snapAxes(position);
+    int32_t magnitude = norm(position);
+    int32_t target[3];
+    for (int i = 0; i < 3; i++)
+        target[i] = jogFeed(position[i], magnitude, i == 2 ? feedCurves.z : feedCurves.xy);
+    if (isToolProbeTripped()) {
+        //slows down to the only allowed move, z up
+        target[0] = 0;
+        target[1] = 0;
+        if (target[2] < 0)
+            target[2] = 0;
+    }
+    trackVelocity(target, elapsedUpdates);
+    for (int i = 0; i < 3; i++) {
+        int32_t period = jogPeriod(jog.velocity[i], i);
+        //a starting axis waits a whole period, a running one keeps its phase
+        if (period && !jog.periods[i])
+            jog.remaining[i] = period;
+        else if (period)
+            jog.remaining[i] = (int32_t) ((int64_t) jog.remaining[i] * period / jog.periods[i]);
+        jog.periods[i] = period;
+        jog.directions[i] = (uint8_t) (jog.velocity[i] > 0);
+    }
+    jog.maxDuration = cncMemory.parameters.clockFrequency * JOG_UPDATE_TICKS / TICK_FREQUENCY;
 }
 
-static vec3f_t deadZoneJoystick(vec3f_t joystickPosition) {
-    float32_t magnitude = norm(joystickPosition);
-    float32_t factor = (magnitude - manualControlStatus.deadzoneRadius) / (1 - manualControlStatus.deadzoneRadius) / magnitude;
-    if (factor <= 0 || !isfinite(factor))
-        factor = 0;
-    return (vec3f_t) {joystickPosition.x * factor, joystickPosition.y * factor, joystickPosition.z * factor};
+static void resetJog() {
+    jog.appliedSequence = manualControlStatus.inputSequence;
+    for (int i = 0; i < 3; i++) {
+        jog.velocity[i] = 0;
+        jog.periods[i] = 0;
+    }
 }
 
 step_t nextManualStep() {
-    uint64_t currentTick = cncMemory.tick;
-    vec3f_t joystickPosition = {
-            .x = (manualControlStatus.filteredAdc.x - manualControlStatus.zeroX) / 128.0F * uiPinout.xOrientation,
-            .y = (manualControlStatus.filteredAdc.y - manualControlStatus.zeroY) / 128.0F * uiPinout.yOrientation,
-            .z = (manualControlStatus.filteredAdc.z - manualControlStatus.zeroZ) / 128.0F * uiPinout.zOrientation};
-    joystickPosition = clampPositionTo1(joystickPosition);
-    joystickPosition = deadZoneJoystick(joystickPosition);
-    joystickPosition = snapAxes(joystickPosition);
-    vec3f_t speed = joystick2speed(joystickPosition);
-    step_t result = nextStep(speed, currentTick);
-    manualControlStatus.lastSpeed = speed;
-    manualControlStatus.lastTick = currentTick;
+    uint32_t inputSequence = manualControlStatus.inputSequence;
+    if (inputSequence != jog.appliedSequence) {
+        updateJogPeriods(inputSequence - jog.appliedSequence);
+        jog.appliedSequence = inputSequence;
+    }
+    //the joystick only moves X, Y and Z
+    step_t result = {
+            .duration = 0,
+            .axes = {
+                    .steps = 0,
+                    .directions = (uint8_t) (jog.directions[0] << AXIS_X | jog.directions[1] << AXIS_Y
+                            | jog.directions[2] << AXIS_Z)}};
+    int32_t next = INT32_MAX;
+    for (int i = 0; i < 3; i++)
+        if (jog.periods[i] && jog.remaining[i] < next)
+            next = jog.remaining[i];
+    if (next == INT32_MAX)
+        return result;
+    //whole ticks, the fraction is carried by the remaining times
+    uint32_t ticks = next <= 0 ? 0 : ((uint32_t) next + (1U << PERIOD_FRACTION_BITS) - 1) >> PERIOD_FRACTION_BITS;
+    //the timer counts from 0 to the duration, a slow axis waits through idle steps
+    result.duration = (uint16_t) (ticks < 2 ? 1 : ticks - 1 < jog.maxDuration ? ticks - 1 : jog.maxDuration);
+    for (int i = 0; i < 3; i++)
+        if (jog.periods[i]) {
+            jog.remaining[i] -= (int32_t) (result.duration + 1U) << PERIOD_FRACTION_BITS;
+            if (jog.remaining[i] <= 0) {
+                result.axes.steps |= 1 << i;
+                jog.remaining[i] += jog.periods[i];
+            }
+        }
+    if (isToolProbeTripped() && !(result.axes.directions & 1 << AXIS_Z))
+        // if tool length is tripped, z doesn't go further down, the other axes slow down
+        result.axes.steps &= ~(1 << AXIS_Z);
     return result;
 }
 
 void zeroJoystick() {
-    manualControlStatus.zeroX = manualControlStatus.filteredAdc.x;
-    manualControlStatus.zeroY = manualControlStatus.filteredAdc.y;
-    manualControlStatus.zeroZ = manualControlStatus.filteredAdc.z;
+    for (int i = 0; i < 3; i++)
+        manualControlStatus.zero[i] = manualControlStatus.filteredAdc[i];
 }
 
 uint32_t toggleManualMode() {
@@ -170,6 +291,7 @@ uint32_t toggleManualMode() {
         case READY:
             STM_EVAL_LEDOn(LED3);
             zeroJoystick();
+            resetJog();
             cncMemory.state = MANUAL_CONTROL;
             return 1;
         case MANUAL_CONTROL:
@@ -182,6 +304,8 @@ uint32_t toggleManualMode() {
 }
 
 void initManualControls() {
+    buildFeedCurve(feedCurves.xy, manualControlStatus.minFeed, manualControlStatus.maxFeed);
+    buildFeedCurve(feedCurves.z, manualControlStatus.minFeed, manualControlStatus.maxZFeed);
     RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_GPIOA, ENABLE);
     GPIO_Init(uiPinout.gpio, &(GPIO_InitTypeDef) {
             .GPIO_Pin = uiPinout.manualButton,
@@ -243,19 +367,23 @@ void handleButton() {
     crBegin;
             pressCounts = 0;
             crYieldVoidUntil(!(rawValue = GPIO_ReadInputDataBit(uiPinout.gpio, uiPinout.manualButton))
-                    || rawValue && ++pressCounts >= UI_DEBOUNCE_MAX_CHECKS);
+                    || (rawValue && ++pressCounts >= UI_DEBOUNCE_MAX_CHECKS));
             if (rawValue)
                 toggleManualMode();
     crFinish;
 }
 
+//the time constant of the filter is 2^UI_FILTER_SHIFT ticks
+#define UI_FILTER_SHIFT 7
+
 void periodicUICallback(void) {
-    float32_t factor = 0.99f;
-    manualControlStatus.filteredAdc.x = manualControlStatus.filteredAdc.x * factor
-            + manualControlStatus.adcValue[0] * (1.0f - factor);
-    manualControlStatus.filteredAdc.y = manualControlStatus.filteredAdc.y * factor
-            + manualControlStatus.adcValue[1] * (1.0f - factor);
-    manualControlStatus.filteredAdc.z = manualControlStatus.filteredAdc.z * factor
-            + manualControlStatus.adcValue[2] * (1.0f - factor);
+    static uint32_t updateTicks = 0;
+    for (int i = 0; i < 3; i++)
+        manualControlStatus.filteredAdc[i] += ((manualControlStatus.adcValue[i] << ADC_FRACTION_BITS)
+                - manualControlStatus.filteredAdc[i]) >> UI_FILTER_SHIFT;
+    if (++updateTicks == JOG_UPDATE_TICKS) {
+        updateTicks = 0;
+        manualControlStatus.inputSequence++;
+    }
     handleButton();
-}
\ No newline at end of file
+}
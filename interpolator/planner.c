@@ -0,0 +1,239 @@
+#include <string.h>
+#include "stm32f4xx_conf.h"
+#include "arm_math.h"
+#include "cnc.h"
+
+//int32 x, y, z steps, then float32 entry, cruise and exit speeds in mm/s and acceleration in mm/s^2
+//see createSegmentProgramEncoder() in worker.js
+//the host's entry and exit speeds only see its own chunk, the junctions are replanned here
+#define SEGMENT_RECORD_LENGTH 28
+#define MAX_STEP_DURATION 0xFFFFU
+//power of 2, the ring counters wrap
+#define PLANNER_BLOCKS 16U
+//distance in mm between the corner and the arc the junction speed is computed for
+#define JUNCTION_DEVIATION 0.02f
+
+typedef struct {
+    uint32_t majorSteps;
+    uint32_t deltas[AXES_COUNT];
+    //only the directions, the steps are interpolated
+    axes_t axes;
+    //in mm
+    float32_t length;
+    float32_t unit[AXES_COUNT];
+    float32_t squaredNominalSpeed;
+    float32_t acceleration;
+    float32_t minSpeed;
+    //from the corner with the previous block and the nominal speeds
+    float32_t squaredMaxEntrySpeed;
+    //planned, the acceleration ramp starts at entryPosition (non zero when replanned while interpolated)
+    float32_t squaredEntrySpeed;
+    float32_t entryPosition;
+} block_t;
+
+//blocks[readCount] is being interpolated, it stays in the ring until its last step is returned
+static struct {
+    block_t blocks[PLANNER_BLOCKS];
+    uint8_t writeCount;
+    uint8_t readCount;
+    //of the block being interpolated
+    uint32_t remainingSteps;
+    uint32_t errors[AXES_COUNT];
+    float32_t squaredSpeed;
+} planner = {
+        .writeCount = 0,
+        .readCount = 0,
+        .remainingSteps = 0
+};
+
+static int32_t readInt32(const uint8_t *bytes) {
+    return bytes[3] << 24 | bytes[2] << 16 | bytes[1] << 8 | bytes[0];
+}
+
+static float32_t readFloat32(const uint8_t *bytes) {
+    float32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static float32_t minFloat(float32_t a, float32_t b) {
+    return a < b ? a : b;
+}
+
+static uint8_t plannedBlocks() {
+    return (uint8_t) (planner.writeCount - planner.readCount);
+}
+
+static block_t *blockAt(uint8_t count) {
+    return &planner.blocks[count % PLANNER_BLOCKS];
+}
+
+void resetSegmentInterpolator() {
+    planner.readCount = planner.writeCount;
+    planner.remainingSteps = 0;
+}
+
+int segmentInterpolatorIsEmpty() {
+    return plannedBlocks() == 0;
+}
+
+//the steps of the blocks in the ring that are not returned yet
+uint32_t segmentInterpolatorPendingSteps() {
+    uint32_t steps = planner.remainingSteps;
+    if (!plannedBlocks())
+        return 0;
+    for (uint8_t count = (uint8_t) (planner.readCount + 1); count != planner.writeCount; count++)
+        steps += blockAt(count)->majorSteps;
+    return steps;
+}
+
+static void startBlock(const block_t *block) {
+    planner.remainingSteps = block->majorSteps;
+    for (int i = 0; i < AXES_COUNT; i++)
+        planner.errors[i] = block->majorSteps / 2;
+}
+
+//grbl's junction deviation: the speed on a circle tangent to both blocks, JUNCTION_DEVIATION away from the corner
+static float32_t squaredJunctionSpeed(const block_t *previous, const block_t *block) {
+    float32_t cosTheta = 0;
+    for (int i = 0; i < AXES_COUNT; i++)
+        cosTheta -= previous->unit[i] * block->unit[i];
+    float32_t squaredSpeed = minFloat(previous->squaredNominalSpeed, block->squaredNominalSpeed);
+    if (cosTheta > 0.999999f)
+        //reversal
+        return 0;
+    if (cosTheta < -0.999999f)
+        //straight
+        return squaredSpeed;
+    float32_t sinHalfTheta = sqrtf(0.5f * (1 - cosTheta));
+    float32_t acceleration = minFloat(previous->acceleration, block->acceleration);
+    return minFloat(squaredSpeed, acceleration * JUNCTION_DEVIATION * sinHalfTheta / (1 - sinHalfTheta));
+}
+
+//the last block of the ring has to stop, nothing is known after it
+static float32_t squaredExitSpeed(uint8_t count) {
+    count++;
+    return count == planner.writeCount ? 0 : blockAt(count)->squaredEntrySpeed;
+}
+
+//backward pass from the last block, then forward pass from the block being interpolated
+static void replan() {
+    float32_t squaredSpeed = 0;
+    for (uint8_t count = (uint8_t) (planner.writeCount - 1); count != planner.readCount; count--) {
+        block_t *block = blockAt(count);
+        block->squaredEntrySpeed = minFloat(block->squaredMaxEntrySpeed,
+                squaredSpeed + 2 * block->acceleration * block->length);
+        squaredSpeed = block->squaredEntrySpeed;
+    }
+    block_t *current = blockAt(planner.readCount);
+    uint32_t doneSteps = current->majorSteps - planner.remainingSteps;
+    if (doneSteps) {
+        //the ramps of the block being interpolated restart from where it is
+        current->entryPosition = doneSteps * current->length / current->majorSteps;
+        current->squaredEntrySpeed = planner.squaredSpeed;
+    }
+    squaredSpeed = current->squaredEntrySpeed + 2 * current->acceleration * (current->length - current->entryPosition);
+    for (uint8_t count = (uint8_t) (planner.readCount + 1); count != planner.writeCount; count++) {
+        block_t *block = blockAt(count);
+        block->squaredEntrySpeed = minFloat(block->squaredEntrySpeed, squaredSpeed);
+        squaredSpeed = block->squaredEntrySpeed + 2 * block->acceleration * block->length;
+    }
+}
+
+//returns 0 when the ring is full or the next record is not received yet
+static int readBlock() {
+    uint8_t record[SEGMENT_RECORD_LENGTH];
+    uint32_t remainingLength = remainingProgramLength();
+    uint8_t lastByte;
+    if (remainingLength && remainingLength < SEGMENT_RECORD_LENGTH && peekFromProgram(remainingLength - 1, &lastByte))
+        //the program ends in the middle of a record, drop it
+        skipFromProgram(remainingLength);
+    //the ring outlives the program, main.c chains the next one once this one is read
+    if (plannedBlocks() == PLANNER_BLOCKS || remainingProgramLength() < SEGMENT_RECORD_LENGTH
+            || !readFromProgram(SEGMENT_RECORD_LENGTH, record))
+        return 0;
+    block_t *block = blockAt(planner.writeCount);
+    //the records are X, Y and Z moves, the rotary axes stay still
+    int32_t deltas[AXES_COUNT] = {readInt32(record), readInt32(record + 4), readInt32(record + 8)};
+    block->axes = (axes_t) {.steps = 0, .directions = 0};
+    block->majorSteps = 0;
+    float32_t millimeters[AXES_COUNT];
+    float32_t squaredLength = 0;
+    for (int i = 0; i < AXES_COUNT; i++) {
+        if (deltas[i] >= 0)
+            block->axes.directions |= 1 << i;
+        block->deltas[i] = (uint32_t) (deltas[i] < 0 ? -deltas[i] : deltas[i]);
+        if (block->deltas[i] > block->majorSteps)
+            block->majorSteps = block->deltas[i];
+        millimeters[i] = (float32_t) deltas[i] / cncMemory.parameters.axes[i].stepsPerMillimeter;
+        squaredLength += millimeters[i] * millimeters[i];
+    }
+    if (!block->majorSteps)
+        //nothing to interpolate and no direction for the junction, dropped
+        return 1;
+    block->length = sqrtf(squaredLength);
+    //the block goes as fast as its most limiting axis lets it
+    float32_t maxSpeed = readFloat32(record + 16);
+    float32_t maxAcceleration = readFloat32(record + 24);
+    for (int i = 0; i < AXES_COUNT; i++) {
+        block->unit[i] = millimeters[i] / block->length;
+        float32_t component = fabsf(block->unit[i]);
+        if (component > 0) {
+            maxSpeed = minFloat(maxSpeed, cncMemory.parameters.axes[i].maxSpeed / 60.0f / component);
+            maxAcceleration = minFloat(maxAcceleration, cncMemory.parameters.axes[i].maxAcceleration / component);
+        }
+    }
+    float32_t cruiseSpeed = maxSpeed;
+    block->squaredNominalSpeed = cruiseSpeed * cruiseSpeed;
+    block->acceleration = maxAcceleration;
+    //like simulation.planProgram(), a floor speed lets the block start from a standstill
+    block->minSpeed = cruiseSpeed / 20;
+    block->squaredMaxEntrySpeed = plannedBlocks() ?
+            squaredJunctionSpeed(blockAt((uint8_t) (planner.writeCount - 1)), block) : 0;
+    block->squaredEntrySpeed = block->squaredMaxEntrySpeed;
+    block->entryPosition = 0;
+    if (!plannedBlocks())
+        startBlock(block);
+    planner.writeCount++;
+    replan();
+    return 1;
+}
+
+//trapezoidal profile between the planned entry and exit speeds
+static float32_t squaredSpeedAt(const block_t *block, float32_t position) {
+    float32_t accelerating = block->squaredEntrySpeed + 2 * block->acceleration * (position - block->entryPosition);
+    float32_t decelerating = squaredExitSpeed(planner.readCount) + 2 * block->acceleration * (block->length - position);
+    return minFloat(block->squaredNominalSpeed, minFloat(accelerating, decelerating));
+}
+
+//Bresenham on the major axis of the current block, returns a zero duration step when there is nothing to interpolate
+step_t nextSegmentStep() {
+    //one block per call keeps the time spent here bounded
+    readBlock();
+    if (!plannedBlocks())
+        return (step_t) {.duration = 0};
+    block_t *block = blockAt(planner.readCount);
+    uint32_t doneSteps = block->majorSteps - planner.remainingSteps;
+    float32_t stepLength = block->length / block->majorSteps;
+    //taken in the middle of the step
+    planner.squaredSpeed = squaredSpeedAt(block, (doneSteps + 0.5f) * stepLength);
+    float32_t speed = sqrtf(planner.squaredSpeed);
+    speed = speed > block->minSpeed ? speed : block->minSpeed;
+    float32_t duration = ceilf(cncMemory.parameters.clockFrequency * stepLength / speed);
+    step_t step = {
+            .duration = (uint16_t) (duration < MAX_STEP_DURATION ? duration : MAX_STEP_DURATION),
+            .axes = block->axes};
+    for (int i = 0; i < AXES_COUNT; i++) {
+        planner.errors[i] += block->deltas[i];
+        if (planner.errors[i] >= block->majorSteps) {
+            planner.errors[i] -= block->majorSteps;
+            step.axes.steps |= 1 << i;
+        }
+    }
+    if (--planner.remainingSteps == 0) {
+        planner.readCount++;
+        if (plannedBlocks())
+            startBlock(blockAt(planner.readCount));
+    }
+    return step;
+}
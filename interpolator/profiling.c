@@ -0,0 +1,134 @@
+#include "stm32f4xx_conf.h"
+#include "cnc.h"
+
+//the superloop call that was running, set by main() before each call
+static volatile loop_section_t loopSection = LOOP_SPI;
+
+static struct {
+    //DWT->CYCCNT when loopSection was entered
+    uint32_t sectionStart;
+    //interruptCycles when loopSection was entered
+    uint32_t sectionInterruptCycles;
+    //of the outermost handlers, the nested ones are already in there, it wraps like DWT->CYCCNT
+    volatile uint32_t interruptCycles;
+    volatile uint8_t interruptDepth;
+    cycle_profile_t profile;
+} cycleProfile = {
+        .interruptDepth = 0
+};
+
+//TIM3 step edges, the lateness is measured against the hardware compare event, not against the previous edge
+static struct {
+    //DWT->CYCCNT value of the next compare event, the 32 bits counter wraps every 25s at 168MHz
+    uint32_t expectedEdge;
+    uint8_t timing;
+    step_jitter_t statistics;
+} stepJitter = {
+        .timing = 0
+};
+
+void initCycleCounter() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    resetStepJitter();
+    resetCycleProfile();
+}
+
+static void account(cycle_account_t *account, uint32_t cycles) {
+    account->calls++;
+    account->totalCycles += cycles;
+    if (cycles > account->maxCycles)
+        account->maxCycles = cycles;
+}
+
+//closes the section that was running
+void enterLoopSection(loop_section_t section) {
+    __disable_irq();
+    uint32_t now = DWT->CYCCNT;
+    uint32_t interruptCycles = cycleProfile.interruptCycles;
+    __enable_irq();
+    uint32_t elapsed = now - cycleProfile.sectionStart;
+    cycleProfile.profile.elapsedCycles += elapsed;
+    account(&cycleProfile.profile.sections[loopSection],
+            elapsed - (interruptCycles - cycleProfile.sectionInterruptCycles));
+    cycleProfile.sectionStart = now;
+    cycleProfile.sectionInterruptCycles = interruptCycles;
+    loopSection = section;
+}
+
+//first thing in a handler, the value goes to endInterruptProfile()
+uint32_t beginInterruptProfile() {
+    cycleProfile.interruptDepth++;
+    return DWT->CYCCNT;
+}
+
+//the cycles of a handler include the ones of the handlers that preempted it
+void endInterruptProfile(profiled_interrupt_t interrupt, uint32_t start) {
+    uint32_t cycles = DWT->CYCCNT - start;
+    account(&cycleProfile.profile.interrupts[interrupt], cycles);
+    if (--cycleProfile.interruptDepth == 0)
+        cycleProfile.interruptCycles += cycles;
+}
+
+//the section running at the reset starts over
+void resetCycleProfile() {
+    __disable_irq();
+    cycleProfile.profile = (cycle_profile_t) {.elapsedCycles = 0};
+    cycleProfile.sectionStart = DWT->CYCCNT;
+    cycleProfile.sectionInterruptCycles = cycleProfile.interruptCycles;
+    __enable_irq();
+}
+
+void readCycleProfile(cycle_profile_t *profile) {
+    __disable_irq();
+    *profile = cycleProfile.profile;
+    __enable_irq();
+}
+
+void resetStepJitter() {
+    __disable_irq();
+    stepJitter.statistics = (step_jitter_t) {.edges = 0};
+    __enable_irq();
+}
+
+void readStepJitter(step_jitter_t *jitter) {
+    __disable_irq();
+    *jitter = stepJitter.statistics;
+    __enable_irq();
+}
+
+//bin 0 is under 32 cycles, then bin n covers [16 << n, 32 << n[ and the last one is open
+static uint32_t jitterBin(uint32_t latency) {
+    uint32_t bin = 0;
+    for (latency >>= 5; latency && bin < STEP_JITTER_BINS - 1; latency >>= 1)
+        bin++;
+    return bin;
+}
+
+//the timer was started, its first compare event comes firstEdgeCycles later
+void startStepEdgeTiming(uint32_t firstEdgeCycles) {
+    stepJitter.expectedEdge = DWT->CYCCNT + firstEdgeCycles;
+    stepJitter.timing = 1;
+}
+
+void stopStepEdgeTiming() {
+    stepJitter.timing = 0;
+}
+
+//called by TIM3_IRQHandler() right after the step pins are set, the next compare event comes periodCycles later
+void timeStepEdge(uint32_t periodCycles) {
+    uint32_t now = DWT->CYCCNT;
+    if (!stepJitter.timing)
+        return;
+    int32_t lateness = (int32_t) (now - stepJitter.expectedEdge);
+    uint32_t latency = (uint32_t) (lateness < 0 ? 0 : lateness);
+    step_jitter_t *statistics = &stepJitter.statistics;
+    statistics->edges++;
+    statistics->bins[jitterBin(latency)]++;
+    if (latency > statistics->worstLatency) {
+        statistics->worstLatency = latency;
+        statistics->worstSection = loopSection;
+    }
+    stepJitter.expectedEdge += periodCycles;
+}
@@ -22,13 +22,67 @@ static const struct {
         .spiEnablePin = GPIO_Pin_12
 };
 
+//the exchanges happen at this rate whatever the main loop does, it's also the sampling rate of the inputs
+#ifndef SPI_EXCHANGE_FREQUENCY
+#define SPI_EXCHANGE_FREQUENCY 10000
+#endif
+//TIM7 has a 16 bits counter and no prescaler here
+#if SPI_EXCHANGE_FREQUENCY < 1300
+#error "SPI_EXCHANGE_FREQUENCY is below what TIM7 can count"
+#endif
+
+//a TIM7 update makes DMA1 write the output byte to SPI2, the received byte is stored by another DMA1 stream
+//whose transfer interrupt pulses the latch; the CPU never waits for the SPI
+static const struct {
+    TIM_TypeDef *timer;
+    uint32_t timerApb1Periph;
+    DMA_Stream_TypeDef *outputStream, *inputStream;
+    uint32_t outputChannel, inputChannel;
+    uint8_t irqN;
+    uint32_t halfTransferFlag, transferCompleteFlag;
+} spiDMAPinout = {
+        .timer = TIM7,
+        .timerApb1Periph = RCC_APB1Periph_TIM7,
+        .outputStream = DMA1_Stream2,
+        .inputStream = DMA1_Stream3,
+        .outputChannel = DMA_Channel_1,
+        .inputChannel = DMA_Channel_0,
+        .irqN = DMA1_Stream3_IRQn,
+        .halfTransferFlag = DMA_IT_HTIF3,
+        .transferCompleteFlag = DMA_IT_TCIF3
+};
+
+static struct {
+    //serialized by handleSPI(), sent by the next exchange
+    uint8_t output;
+    //the DMA alternates between the 2 entries, the interrupt reads the one that was just completed
+    uint8_t inputs[2];
+} spiExchange;
+
+//the limit switch bit of each axis in the serialized input
+static const spi_input_t limitInputs[] = {{.limitX = 1}, {.limitY = 1}, {.limitZ = 1}, {.limitA = 1}, {.limitB = 1},
+        {.limitC = 1}};
+
+//where the axes were when their limit switch was first sampled tripped, before the filter confirms it
+static struct {
+    //positions at the previous latch pulse, when the inputs being shifted in were sampled
+    int32_t sampledPositions[AXES_COUNT];
+    int32_t tripPositions[AXES_COUNT];
+    //limit bits sampled tripped while the filtered input still says released
+    uint8_t pendingTrips;
+} limitLatch;
+
 // 1 -> high is true, 0 -> low is true
 static const spi_input_t spiInputPolarity = {
         .drv = 0,
         .upf = 0,
         .limitX = 1,
         .limitY = 1,
-        .limitZ = 1
+        .limitZ = 1,
+        //the inputs of the rotary axes are pulled up when nothing is wired
+        .limitA = 0,
+        .limitB = 0,
+        .limitC = 0
 };
 
 // 1 -> high is true, 0 -> low is true
@@ -46,6 +100,66 @@ static uint16_t myLog2(int value) {
     return 31 - __builtin_clz(value);
 }
 
+static void flashShiftRegisters() {
+    GPIO_ResetBits(spiPinout.gpio, spiPinout.spiEnablePin);
+    GPIO_SetBits(spiPinout.gpio, spiPinout.spiEnablePin);
+}
+
+static uint8_t serializeSpiOutput() {
+    return (uint8_t) (((spi_output_serializer_t) {.s = cncMemory.spiOutput}).n
+            ^ ~((spi_output_serializer_t) {.s = spiOutputPolarity}).n);
+}
+
+static void initSPIDMA() {
+    RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA1, ENABLE);
+    RCC_APB1PeriphClockCmd(spiDMAPinout.timerApb1Periph, ENABLE);
+    struct {
+        DMA_Stream_TypeDef *stream;
+        uint32_t channel, direction, memory, length, memoryIncrement;
+    } streams[] = {
+            {spiDMAPinout.outputStream, spiDMAPinout.outputChannel, DMA_DIR_MemoryToPeripheral,
+                    (uint32_t) &spiExchange.output, 1, DMA_MemoryInc_Disable},
+            {spiDMAPinout.inputStream, spiDMAPinout.inputChannel, DMA_DIR_PeripheralToMemory,
+                    (uint32_t) spiExchange.inputs, sizeof(spiExchange.inputs), DMA_MemoryInc_Enable}};
+    for (uint32_t i = 0; i < sizeof(streams) / sizeof(*streams); i++) {
+        DMA_Cmd(streams[i].stream, DISABLE);
+        DMA_Init(streams[i].stream, &(DMA_InitTypeDef) {
+                .DMA_Channel = streams[i].channel,
+                .DMA_PeripheralBaseAddr = (uint32_t) &spiPinout.spi->DR,
+                .DMA_Memory0BaseAddr = streams[i].memory,
+                .DMA_DIR = streams[i].direction,
+                .DMA_BufferSize = streams[i].length,
+                .DMA_PeripheralInc = DMA_PeripheralInc_Disable,
+                .DMA_MemoryInc = streams[i].memoryIncrement,
+                .DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte,
+                .DMA_MemoryDataSize = DMA_MemoryDataSize_Byte,
+                .DMA_Mode = DMA_Mode_Circular,
+                .DMA_Priority = DMA_Priority_Medium,
+                .DMA_FIFOMode = DMA_FIFOMode_Disable,
+                .DMA_FIFOThreshold = DMA_FIFOThreshold_HalfFull,
+                .DMA_MemoryBurst = DMA_MemoryBurst_Single,
+                .DMA_PeripheralBurst = DMA_PeripheralBurst_Single});
+        DMA_Cmd(streams[i].stream, ENABLE);
+    }
+    DMA_ITConfig(spiDMAPinout.inputStream, DMA_IT_HT | DMA_IT_TC, ENABLE);
+    //below the step interrupts, a latch pulse can wait a few microseconds
+    NVIC_Init(&(NVIC_InitTypeDef) {
+            .NVIC_IRQChannel = spiDMAPinout.irqN,
+            .NVIC_IRQChannelPreemptionPriority = 1,
+            .NVIC_IRQChannelSubPriority = 0,
+            .NVIC_IRQChannelCmd = ENABLE});
+    //TIM7 counts at the APB1 timer clock, twice slower than the core
+    TIM_TimeBaseInit(spiDMAPinout.timer, &((TIM_TimeBaseInitTypeDef) {
+            .TIM_Period = SystemCoreClock / 2 / SPI_EXCHANGE_FREQUENCY - 1,
+            .TIM_Prescaler = 0,
+            .TIM_ClockDivision = 0,
+            .TIM_CounterMode = TIM_CounterMode_Up}));
+    TIM_DMACmd(spiDMAPinout.timer, TIM_DMA_Update, ENABLE);
+    //the first exchange shifts in whatever the registers held before this latch pulse
+    flashShiftRegisters();
+    TIM_Cmd(spiDMAPinout.timer, ENABLE);
+}
+
 void initSPISystem() {
     RCC_APB1PeriphClockCmd(spiPinout.spiApb1Periph, ENABLE);
     RCC_AHB1PeriphClockCmd(spiPinout.gpioAhb1Periph, ENABLE);
@@ -82,27 +196,43 @@ void initSPISystem() {
             .SPI_CRCPolynomial = 7
     });
     SPI_TIModeCmd(spiPinout.spi, DISABLE);
+    SPI_I2S_DMACmd(spiPinout.spi, SPI_I2S_DMAReq_Rx, ENABLE);
     SPI_Cmd(spiPinout.spi, ENABLE);
+    spiExchange.output = serializeSpiOutput();
+    initSPIDMA();
 }
 
-static void flashShiftRegisters() {
-    GPIO_ResetBits(spiPinout.gpio, spiPinout.spiEnablePin);
-    GPIO_SetBits(spiPinout.gpio, spiPinout.spiEnablePin);
+//only prepares the byte of the next exchange, the exchange itself is started by TIM7
+void handleSPI() {
+    spiExchange.output = serializeSpiOutput();
 }
 
-void handleSPI() {
-    crBegin;
-            flashShiftRegisters();
-            SPI_I2S_SendData(spiPinout.spi, ((spi_output_serializer_t) {.s=cncMemory.spiOutput}).n ^ ~((spi_output_serializer_t) {.s = spiOutputPolarity}).n);
-            while ((spiPinout.spi->SR & SPI_SR_TXE) == 0)
-                crYield();
-            while ((spiPinout.spi->SR & SPI_SR_RXNE) == 0)
-                crYield();
-            cncMemory.unfilteredSpiInput = (uint8_t) SPI_I2S_ReceiveData(spiPinout.spi) ^ ~((spi_input_serializer_t) {.s = spiInputPolarity}).n;
-            while ((spiPinout.spi->SR & SPI_SR_BSY) != 0)
-                crYield();
-            flashShiftRegisters();
-    crFinish;
+//a bit going back to its filtered value before the filter confirmed it was a glitch, the next trip is latched again
+static void latchLimitSwitches(uint8_t input) {
+    uint8_t trips = input & (uint8_t) ~((spi_input_serializer_t) {.s = cncMemory.spiInput}).n;
+    for (int axis = 0; axis < AXES_COUNT; axis++) {
+        if (trips & ~limitLatch.pendingTrips & ((spi_input_serializer_t) {.s = limitInputs[axis]}).n)
+            limitLatch.tripPositions[axis] = limitLatch.sampledPositions[axis];
+        limitLatch.sampledPositions[axis] = cncMemory.position.axes[axis];
+    }
+    limitLatch.pendingTrips = trips;
+}
+
+//within a step of the real trip when the axis steps slower than SPI_EXCHANGE_FREQUENCY
+int32_t limitSwitchTripPosition(int axis) {
+    return limitLatch.tripPositions[axis];
+}
+
+//the latch pulse moves the byte that was just shifted out to the outputs and samples the inputs for the next exchange
+__attribute__ ((used)) void DMA1_Stream3_IRQHandler(void) {
+    uint32_t profileStart = beginInterruptProfile();
+    //the half transfer completes the first entry, the transfer the second one; the newest wins if both are pending
+    int entry = DMA_GetITStatus(spiDMAPinout.inputStream, spiDMAPinout.transferCompleteFlag) == SET;
+    DMA_ClearITPendingBit(spiDMAPinout.inputStream, spiDMAPinout.halfTransferFlag | spiDMAPinout.transferCompleteFlag);
+    flashShiftRegisters();
+    cncMemory.unfilteredSpiInput = spiExchange.inputs[entry] ^ ~((spi_input_serializer_t) {.s = spiInputPolarity}).n;
+    latchLimitSwitches(cncMemory.unfilteredSpiInput);
+    endInterruptProfile(ISR_SPI_DMA, profileStart);
 }
 
 static void debounceRunbit() {
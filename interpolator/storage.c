@@ -0,0 +1,196 @@
+#include <string.h>
+#include "stm32f4xx_conf.h"
+#include "cnc.h"
+
+//emulated EEPROM on the last two 128KB sectors of the STM32F407, away from the image at the bottom of the flash
+//the records are appended to the current sector, when it's full the other one is erased and takes over
+static const struct {
+    uint32_t offsets[2];
+    uint16_t sectors[2];
+    uint32_t size;
+} storageSectors = {
+        .offsets = {0xC0000, 0xE0000},
+        .sectors = {FLASH_Sector_10, FLASH_Sector_11},
+        .size = 0x20000
+};
+
+//the first word of a sector, the newest sector has the highest one
+#define ERASED_WORD 0xFFFFFFFFU
+//a record is this word ORed with its data length in words, the data, then the checksum of the data
+#define RECORD_HEADER 0x5E770000U
+#define RECORD_HEADER_MASK 0xFFFF0000U
+
+typedef struct {
+    parameters_t parameters;
+    offset_t workOffset;
+    //the position and homed axes at the last savePosition(), not the live ones
+    int32_t position[AXES_COUNT];
+    uint32_t homedAxes;
+} stored_settings_t;
+
+#define SETTINGS_WORDS (sizeof(stored_settings_t) / 4)
+
+static struct {
+    //-1 when no sector could be used, the next save erases one
+    int sector;
+    uint32_t generation;
+    //offset of the next record in the sector
+    uint32_t writeOffset;
+    //what is in the flash, compared to cncMemory by saveSettingsIfChanged()
+    stored_settings_t stored;
+    //set by savePosition(), the position goes with the next record
+    int positionRequested;
+} storage = {
+        .sector = -1,
+        .generation = 0,
+        .positionRequested = 0
+};
+
+static uint32_t sectorAddress(int sector) {
+    return FLASH_BASE + storageSectors.offsets[sector];
+}
+
+static uint32_t readWord(uint32_t address) {
+    uint32_t word;
+    memcpy(&word, (const void *) (uintptr_t) address, sizeof(word));
+    return word;
+}
+
+//FNV-1a on the words, an interrupted write leaves a record that doesn't check
+static uint32_t checksum(const uint32_t *words, uint32_t count) {
+    uint32_t hash = 2166136261U;
+    for (uint32_t i = 0; i < count; i++) {
+        hash ^= words[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+//the position moves with every job, it's only taken when asked for, otherwise the stored one is kept
+static void takeSnapshot(stored_settings_t *settings, int withPosition) {
+    memset(settings, 0, sizeof(*settings));
+    settings->parameters = cncMemory.parameters;
+    settings->workOffset = cncMemory.workOffset;
+    for (int i = 0; i < AXES_COUNT; i++)
+        settings->position[i] = withPosition ? cncMemory.position.axes[i] : storage.stored.position[i];
+    settings->homedAxes = withPosition ? cncMemory.homedAxes : storage.stored.homedAxes;
+}
+
+//returns the offset after the last record of the sector, the newest valid record goes to settings
+static uint32_t scanSector(int sector, stored_settings_t *settings, int *found) {
+    uint32_t base = sectorAddress(sector);
+    uint32_t offset = 4;
+    *found = 0;
+    while (offset + 4 <= storageSectors.size) {
+        uint32_t header = readWord(base + offset);
+        if (header == ERASED_WORD)
+            break;
+        uint32_t length = header & ~RECORD_HEADER_MASK;
+        if ((header & RECORD_HEADER_MASK) != RECORD_HEADER || offset + (length + 2) * 4 > storageSectors.size)
+            //garbage, nothing can be appended after it
+            return storageSectors.size;
+        if (length == SETTINGS_WORDS) {
+            uint32_t words[SETTINGS_WORDS];
+            memcpy(words, (const void *) (uintptr_t) (base + offset + 4), sizeof(words));
+            if (checksum(words, SETTINGS_WORDS) == readWord(base + offset + 4 + sizeof(words))) {
+                memcpy(settings, words, sizeof(*settings));
+                *found = 1;
+            }
+        }
+        //records of another AXES_COUNT are skipped
+        offset += (length + 2) * 4;
+    }
+    return offset;
+}
+
+//called by main() before the peripherals are started, the compiled in values stay when nothing valid is found
+void loadSettings() {
+    int order[2] = {0, 1};
+    uint32_t generations[2] = {readWord(sectorAddress(0)), readWord(sectorAddress(1))};
+    if (generations[1] != ERASED_WORD && (generations[0] == ERASED_WORD || generations[1] > generations[0])) {
+        order[0] = 1;
+        order[1] = 0;
+    }
+    takeSnapshot(&storage.stored, 1);
+    for (int i = 0; i < 2; i++) {
+        int sector = order[i];
+        if (generations[sector] == ERASED_WORD)
+            continue;
+        stored_settings_t settings;
+        int found;
+        uint32_t end = scanSector(sector, &settings, &found);
+        if (i == 0) {
+            storage.sector = sector;
+            storage.generation = generations[sector];
+            storage.writeOffset = end;
+        }
+        if (found && parametersAreValid(&settings.parameters)) {
+            cncMemory.parameters = settings.parameters;
+            cncMemory.workOffset = settings.workOffset;
+            //the saved position of the axes homed at the time, but the machine may have been moved while the power
+            //was off: the axes are not homed until the next homing
+            for (int axis = 0; axis < AXES_COUNT; axis++)
+                if (settings.homedAxes & 1U << axis)
+                    cncMemory.position.axes[axis] = settings.position[axis];
+            //what is in the flash, cncMemory.homedAxes is not
+            storage.stored = settings;
+            break;
+        }
+    }
+}
+
+static int programWords(uint32_t address, const uint32_t *words, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++)
+        if (FLASH_ProgramWord(address + i * 4, words[i]) != FLASH_COMPLETE)
+            return 0;
+    return 1;
+}
+
+static int startSector() {
+    int sector = storage.sector == 0 ? 1 : 0;
+    uint32_t generation = storage.sector < 0 ? 0 : storage.generation + 1;
+    if (FLASH_EraseSector(storageSectors.sectors[sector], VoltageRange_3) != FLASH_COMPLETE
+            || !programWords(sectorAddress(sector), &generation, 1))
+        return 0;
+    storage.sector = sector;
+    storage.generation = generation;
+    storage.writeOffset = 4;
+    return 1;
+}
+
+static int appendRecord(const stored_settings_t *settings) {
+    uint32_t record[SETTINGS_WORDS + 2];
+    uint32_t recordLength = sizeof(record);
+    record[0] = RECORD_HEADER | SETTINGS_WORDS;
+    memcpy(record + 1, settings, sizeof(*settings));
+    record[SETTINGS_WORDS + 1] = checksum(record + 1, SETTINGS_WORDS);
+    if ((storage.sector < 0 || storage.writeOffset + recordLength > storageSectors.size) && !startSector())
+        return 0;
+    uint32_t address = sectorAddress(storage.sector) + storage.writeOffset;
+    //the offset moves even on failure, a half written record is skipped by the checksum
+    storage.writeOffset += recordLength;
+    return programWords(address, record, SETTINGS_WORDS + 2);
+}
+
+//called at the end of the homing and by REQUEST_SAVE_POSITION once the machine is parked
+void savePosition() {
+    storage.positionRequested = 1;
+}
+
+//an erase stalls the instruction fetches from the flash for up to 2s, the caller only saves when the machine is idle
+void saveSettingsIfChanged() {
+    //cleared before the snapshot, a request arriving meanwhile waits for the next call
+    int withPosition = storage.positionRequested;
+    storage.positionRequested = 0;
+    stored_settings_t settings;
+    takeSnapshot(&settings, withPosition);
+    if (!memcmp(&settings, &storage.stored, sizeof(settings)))
+        return;
+    FLASH_Unlock();
+    FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR
+            | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+    appendRecord(&settings);
+    FLASH_Lock();
+    //not retried on failure, the next change tries again
+    storage.stored = settings;
+}
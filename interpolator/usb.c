@@ -10,19 +10,30 @@
 
 static USB_OTG_CORE_HANDLE usbDevice __attribute__((aligned (4)));
 
+//where the bulk endpoint is connected while aborting
 #define BUFFER_SIZE     64U
 static uint8_t buffer[BUFFER_SIZE];
 
+static void armBulkReception();
+
+static void resetCreditReport();
+
+static void resetTelemetry();
+
 static uint8_t cncInit(void *pdev, uint8_t cfgidx) {
     DCD_EP_Open(pdev, INTERRUPT_ENDPOINT, INTERRUPT_PACKET_SIZE, USB_OTG_EP_INT);
+    resetCreditReport();
     DCD_EP_Open(pdev, BULK_ENDPOINT, BULK_PACKET_SIZE, USB_OTG_EP_BULK);
-    DCD_EP_PrepareRx(pdev, BULK_ENDPOINT, buffer, BUFFER_SIZE);
+    DCD_EP_Open(pdev, TELEMETRY_ENDPOINT, TELEMETRY_PACKET_SIZE, USB_OTG_EP_INT);
+    resetTelemetry();
+    armBulkReception();
     return USBD_OK;
 }
 
 static uint8_t cncDeInit(void *pdev, uint8_t cfgidx) {
     DCD_EP_Close(pdev, INTERRUPT_ENDPOINT);
     DCD_EP_Close(pdev, BULK_ENDPOINT);
+    DCD_EP_Close(pdev, TELEMETRY_ENDPOINT);
     return USBD_OK;
 }
 
@@ -39,7 +50,13 @@ enum {
     REQUEST_RESUME_PROGRAM = 8,
     REQUEST_RESET_SPI_OUTPUT = 9,
     REQUEST_HOME = 10,
-    REQUEST_WORK_OFFSET = 11
+    REQUEST_WORK_OFFSET = 11,
+    REQUEST_TELEMETRY_PERIOD = 12,
+    REQUEST_BUFFER_STATISTICS = 13,
+    REQUEST_STEP_JITTER = 14,
+    REQUEST_CYCLE_PROFILE = 15,
+    REQUEST_SAVE_POSITION = 16,
+    REQUEST_CREDITS = 17
 };
 
 typedef enum {
@@ -66,48 +83,109 @@ typedef struct {
     ctrl_req_direction_t direction : 1;
 } __attribute__((packed)) bmRequest_t;
 
-#define CIRCULAR_BUFFER_SIZE    16384U
+//a power of 2, so that the 32 bits counters wrap on a multiple of it; make CIRCULAR_BUFFER_SIZE=65536 for a deeper one
+#ifndef CIRCULAR_BUFFER_SIZE
+#define CIRCULAR_BUFFER_SIZE    32768U
+#endif
+#if CIRCULAR_BUFFER_SIZE & (CIRCULAR_BUFFER_SIZE - 1)
+#error "CIRCULAR_BUFFER_SIZE must be a power of 2"
+#endif
+//the core splits a transfer in as many packets as needed, they all land in the buffer without an intermediate copy
+#define MAX_BULK_TRANSFER       (16 * BULK_PACKET_SIZE)
+
+//nothing else uses the CCM, the buffer goes there when the linker script has the section and the buffer fits; the FS
+//core is fed by the CPU, not by a DMA
+//the last packet of a transfer can go past the end, it's then moved to the start
+#if CCM_RAM_SECTION && CIRCULAR_BUFFER_SIZE + BULK_PACKET_SIZE <= CCM_RAM_SIZE
+static uint8_t circularBufferBytes[CIRCULAR_BUFFER_SIZE + BULK_PACKET_SIZE] CCM_RAM;
+#else
+static uint8_t circularBufferBytes[CIRCULAR_BUFFER_SIZE + BULK_PACKET_SIZE];
+#endif
+
 static struct {
-    uint8_t buffer[CIRCULAR_BUFFER_SIZE];
-    uint16_t writeCount;
-    uint16_t readCount;
-    uint32_t signaled;
+    volatile uint32_t writeCount;
+    volatile uint32_t readCount;
+    //a transfer is pending on the bulk endpoint
+    volatile uint8_t armed;
     uint32_t programLength;
     uint32_t programID;
+    //since power up, everything the host sent ends up consumed, even when thrown away by an abort
+    volatile uint32_t receivedBytes;
+    volatile uint32_t consumedBytes;
 } circularBuffer = {
         .writeCount = 0,
         .readCount = 0,
-        .signaled = 0,
+        .armed = 0,
         .programLength = 0,
-        .programID = 0
+        .programID = 0,
+        .receivedBytes = 0,
+        .consumedBytes = 0
+};
+
+//sent on the interrupt endpoint when it changes, see Runner in runner.js
+typedef struct {
+    uint32_t freeBytes;
+    uint32_t consumedBytes;
+    uint32_t receivedBytes;
+    uint32_t programID;
+    uint32_t bufferSize;
+    uint32_t sequence;
+} credit_report_t;
+
+static struct {
+    credit_report_t report;
+    volatile uint8_t busy;
+    uint8_t sent;
+} creditReport = {
+        .busy = 0,
+        .sent = 0
 };
 
+static void resetCreditReport() {
+    creditReport.busy = 0;
+    creditReport.sent = 0;
+}
+
+//with the sequence of the last report
+static credit_report_t currentCredits() {
+    uint32_t consumedBytes = circularBuffer.consumedBytes;
+    uint32_t receivedBytes = circularBuffer.receivedBytes;
+    return (credit_report_t) {
+            .freeBytes = CIRCULAR_BUFFER_SIZE - (receivedBytes - consumedBytes),
+            .consumedBytes = consumedBytes,
+            .receivedBytes = receivedBytes,
+            .programID = circularBuffer.programID,
+            //a packet of slack, the endpoint can only be armed for whole packets
+            .bufferSize = CIRCULAR_BUFFER_SIZE - BULK_PACKET_SIZE,
+            .sequence = creditReport.report.sequence};
+}
+
 typedef enum {
     CONTROL_READY = 0,
     CONTROL_WAITING_AXES_VALUES = 1,
-    CONTROL_WAITING_WORK_OFFSET = 2
+    CONTROL_WAITING_WORK_OFFSET = 2,
+    CONTROL_WAITING_PARAMETERS = 3
 } control_endpoint_mode_t;
 
 static struct {
     control_endpoint_mode_t state;
-    int32_t positionBuffer[3];
+    int32_t positionBuffer[AXES_COUNT];
+    parameters_t parametersBuffer;
     uint8_t axesMasks;
     USB_SETUP_REQ request;
 } controlEndpointState = {
         .state = CONTROL_READY,
-        .positionBuffer = {0, 0, 0},
+        .positionBuffer = {0},
         .axesMasks = 0
 };
 
-static uint8_t setPositionFromUSB(void *pdev, USB_SETUP_REQ *req, uint16_t axisMask, int32_t position[3]) {
+//bit n of axisMask defines axis n
+static uint8_t setPositionFromUSB(void *pdev, USB_SETUP_REQ *req, uint16_t axisMask, int32_t position[AXES_COUNT]) {
     controlEndpointState.state = CONTROL_READY;
     if (cncMemory.state == MANUAL_CONTROL || cncMemory.state == READY) {
-        if (axisMask & 0b001)
-            cncMemory.workOffset.x = position[0] - cncMemory.position.x;
-        if (axisMask & 0b010)
-            cncMemory.workOffset.y = position[1] - cncMemory.position.y;
-        if (axisMask & 0b100)
-            cncMemory.workOffset.z = position[2] - cncMemory.position.z;
+        for (int i = 0; i < AXES_COUNT; i++)
+            if (axisMask & 1 << i)
+                cncMemory.workOffset.axes[i] = position[i] - cncMemory.position.axes[i];
         return USBD_OK;
     } else {
         USBD_CtlError(pdev, req);
@@ -115,6 +193,126 @@ static uint8_t setPositionFromUSB(void *pdev, USB_SETUP_REQ *req, uint16_t axisM
     }
 }
 
+//since the last REQUEST_BUFFER_STATISTICS reset, see CNCMachine.readBufferStatistics()
+static struct {
+    uint32_t starvationEvents;
+    //sampled when a program starts, the end of the stream would always bring it to 0
+    uint32_t minFillLevel;
+    uint32_t receivedBytesOrigin;
+    uint32_t executedStepsOrigin;
+    uint64_t starvedTicks;
+    uint64_t starvedSince;
+    uint8_t starved;
+} bufferStatistics = {
+        .starvationEvents = 0,
+        .minFillLevel = CIRCULAR_BUFFER_SIZE,
+        .receivedBytesOrigin = 0,
+        .executedStepsOrigin = 0,
+        .starvedTicks = 0,
+        .starved = 0
+};
+
+static void resetBufferStatistics() {
+    bufferStatistics.starvationEvents = 0;
+    bufferStatistics.minFillLevel = CIRCULAR_BUFFER_SIZE;
+    bufferStatistics.receivedBytesOrigin = circularBuffer.receivedBytes;
+    bufferStatistics.executedStepsOrigin = cncMemory.executedSteps;
+    bufferStatistics.starvedTicks = 0;
+    bufferStatistics.starvedSince = cncMemory.tick;
+}
+
+//called on every pass of the main loop
+void recordStarvation(int starved) {
+    if (starved == bufferStatistics.starved)
+        return;
+    if (starved) {
+        bufferStatistics.starvationEvents++;
+        bufferStatistics.starvedSince = cncMemory.tick;
+    } else
+        bufferStatistics.starvedTicks += cncMemory.tick - bufferStatistics.starvedSince;
+    bufferStatistics.starved = (uint8_t) starved;
+}
+
+static uint32_t stateWord() {
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "OCSimplifyInspection"
+    return cncMemory.homedAxes << 18 | isToolProbeTripped() << 17 | isEmergencyStopped() << 16
+            | cncMemory.state;
+#pragma clang diagnostic pop
+}
+
+static uint32_t spiWord() {
+    return ((spi_output_serializer_t) {.s = cncMemory.spiOutput}).n << 16
+            | ((spi_input_serializer_t) {.s = cncMemory.spiInput}).n;
+}
+
+//the program of the steps being played, the decoder can already be in the next one
+static uint32_t runningProgramID() {
+    if (cncMemory.state == RUNNING_PROGRAM || cncMemory.state == ABORTING_PROGRAM)
+        return playedProgramID();
+    return 0;
+}
+
+//see CNCMachine.decodeTelemetry(), the fields are read together, with the interrupts masked
+typedef struct __attribute__((packed)) {
+    uint64_t tick;
+    //with the work offset added, like REQUEST_POSITION, the record is longer than a packet beyond 4 axes
+    position_t position;
+    offset_t workOffset;
+    //REQUEST_STATE
+    uint32_t state;
+    uint32_t spi;
+    uint32_t programID;
+    uint32_t executedSteps;
+    uint32_t sequence;
+} telemetry_t;
+
+static struct {
+    telemetry_t record;
+    //in ms, 0 stops the stream
+    uint16_t period;
+    uint64_t nextTick;
+    volatile uint8_t busy;
+} telemetry = {
+        .period = 0,
+        .busy = 0
+};
+
+static void resetTelemetry() {
+    telemetry.period = 0;
+    telemetry.busy = 0;
+}
+
+//the record is armed when due, the host gets it at its next poll of the endpoint
+void sendTelemetryIfDue() {
+    if (!telemetry.period || telemetry.busy || usbDevice.dev.device_status != USB_OTG_CONFIGURED)
+        return;
+    __disable_irq();
+    uint64_t tick = cncMemory.tick;
+    if (tick < telemetry.nextTick) {
+        __enable_irq();
+        return;
+    }
+    position_t position = cncMemory.position;
+    offset_t workOffset = cncMemory.workOffset;
+    uint32_t executedSteps = cncMemory.executedSteps;
+    __enable_irq();
+    for (int i = 0; i < AXES_COUNT; i++)
+        position.axes[i] += workOffset.axes[i];
+    telemetry.record = (telemetry_t) {
+            .tick = tick,
+            .position = position,
+            .workOffset = workOffset,
+            .state = stateWord(),
+            .spi = spiWord(),
+            .programID = runningProgramID(),
+            .executedSteps = executedSteps,
+            .sequence = telemetry.record.sequence + 1};
+    telemetry.nextTick = tick + (uint64_t) telemetry.period * (TICK_FREQUENCY / 1000);
+    telemetry.busy = 1;
+    DCD_EP_Tx(&usbDevice, TELEMETRY_ENDPOINT, (uint8_t *) &telemetry.record, sizeof(telemetry.record));
+}
+
 static uint8_t cncSetup(void *pdev, USB_SETUP_REQ *req) {
     bmRequest_t parsed =
             ((union {
@@ -129,9 +327,8 @@ static uint8_t cncSetup(void *pdev, USB_SETUP_REQ *req) {
                         case REQUEST_POSITION: {
                             static volatile position_t localPosition;
                             localPosition = cncMemory.position;
-                            localPosition.x += cncMemory.workOffset.x;
-                            localPosition.y += cncMemory.workOffset.y;
-                            localPosition.z += cncMemory.workOffset.z;
+                            for (int i = 0; i < AXES_COUNT; i++)
+                                localPosition.axes[i] += cncMemory.workOffset.axes[i];
                             USBD_CtlSendData(pdev, (uint8_t *) &localPosition, (uint16_t) sizeof(localPosition));
                             return USBD_OK;
                         }
@@ -141,25 +338,50 @@ static uint8_t cncSetup(void *pdev, USB_SETUP_REQ *req) {
                         case REQUEST_STATE: {
                             //using a static, so that it doesn't get cleaned up before the driver reads it
                             static volatile uint32_t state[3];
-#pragma clang diagnostic push
-#pragma ide diagnostic ignored "OCSimplifyInspection"
-                            state[0] = !!cncMemory.zHomed << 20 | !!cncMemory.yHomed << 19 | !!cncMemory.xHomed << 18
-                                    | isToolProbeTripped() << 17 | isEmergencyStopped() << 16
-                                    | cncMemory.state;
-                            state[1] = ((spi_output_serializer_t) {.s = cncMemory.spiOutput}).n << 16
-                                    | ((spi_input_serializer_t) {.s = cncMemory.spiInput}).n;
-#pragma clang diagnostic pop
-                            state[2] = 0;
-                            if (cncMemory.state == RUNNING_PROGRAM || cncMemory.state == ABORTING_PROGRAM)
-                                state[2] = circularBuffer.programID;
+                            state[0] = stateWord();
+                            state[1] = spiWord();
+                            state[2] = runningProgramID();
                             USBD_CtlSendData(pdev, (uint8_t *) &state, (uint16_t) sizeof(state));
                             return USBD_OK;
                         }
+                        case REQUEST_BUFFER_STATISTICS: {
+                            static volatile uint32_t statistics[6];
+                            uint64_t starvedTicks = bufferStatistics.starvedTicks;
+                            if (bufferStatistics.starved)
+                                starvedTicks += cncMemory.tick - bufferStatistics.starvedSince;
+                            statistics[0] = bufferStatistics.starvationEvents;
+                            statistics[1] = bufferStatistics.minFillLevel;
+                            statistics[2] = circularBuffer.receivedBytes - bufferStatistics.receivedBytesOrigin;
+                            statistics[3] = cncMemory.executedSteps - bufferStatistics.executedStepsOrigin;
+                            statistics[4] = (uint32_t) starvedTicks;
+                            statistics[5] = (uint32_t) (starvedTicks >> 32);
+                            USBD_CtlSendData(pdev, (uint8_t *) &statistics, (uint16_t) sizeof(statistics));
+                            return USBD_OK;
+                        }
+                        case REQUEST_STEP_JITTER: {
+                            //edges, worst latency, worst section then the bins, see profiling.c
+                            static step_jitter_t jitter;
+                            readStepJitter(&jitter);
+                            USBD_CtlSendData(pdev, (uint8_t *) &jitter, (uint16_t) sizeof(jitter));
+                            return USBD_OK;
+                        }
+                        case REQUEST_CYCLE_PROFILE: {
+                            //the loop sections then the interrupts, in the order of their enums
+                            static cycle_profile_t profile;
+                            readCycleProfile(&profile);
+                            USBD_CtlSendData(pdev, (uint8_t *) &profile, (uint16_t) sizeof(profile));
+                            return USBD_OK;
+                        }
+                        case REQUEST_CREDITS: {
+                            //no report comes before the buffer moves, the host reads the counters when it starts
+                            static credit_report_t credits;
+                            credits = currentCredits();
+                            USBD_CtlSendData(pdev, (uint8_t *) &credits, (uint16_t) sizeof(credits));
+                            return USBD_OK;
+                        }
                         case REQUEST_WORK_OFFSET: {
-                            static volatile int32_t workOffset[3];
-                            workOffset[0] = cncMemory.workOffset.x;
-                            workOffset[1] = cncMemory.workOffset.y;
-                            workOffset[2] = cncMemory.workOffset.z;
+                            static volatile offset_t workOffset;
+                            workOffset = cncMemory.workOffset;
                             USBD_CtlSendData(pdev, (uint8_t *) &workOffset, (uint16_t) sizeof(workOffset));
                             return USBD_OK;
                         }
@@ -184,6 +406,12 @@ static uint8_t cncSetup(void *pdev, USB_SETUP_REQ *req) {
                             USBD_CtlPrepareRx(pdev, (uint8_t *) controlEndpointState.positionBuffer, sizeof(controlEndpointState.positionBuffer));
                             USBD_CtlSendStatus(pdev);
                             return USBD_OK;
+                        case REQUEST_PARAMETERS:
+                            controlEndpointState.state = CONTROL_WAITING_PARAMETERS;
+                            controlEndpointState.request = *req;
+                            USBD_CtlPrepareRx(pdev, (uint8_t *) &controlEndpointState.parametersBuffer, sizeof(controlEndpointState.parametersBuffer));
+                            USBD_CtlSendStatus(pdev);
+                            return USBD_OK;
                         case REQUEST_DEFINE_AXIS_POSITION:
                             controlEndpointState.state = CONTROL_WAITING_AXES_VALUES;
                             controlEndpointState.axesMasks = (uint8_t) req->wValue;
@@ -202,6 +430,23 @@ static uint8_t cncSetup(void *pdev, USB_SETUP_REQ *req) {
                         case REQUEST_HOME:
                             startHoming();
                             return USBD_OK;
+                        case REQUEST_BUFFER_STATISTICS:
+                            resetBufferStatistics();
+                            return USBD_OK;
+                        case REQUEST_STEP_JITTER:
+                            resetStepJitter();
+                            return USBD_OK;
+                        case REQUEST_CYCLE_PROFILE:
+                            resetCycleProfile();
+                            return USBD_OK;
+                        case REQUEST_SAVE_POSITION:
+                            //written when the machine is idle
+                            savePosition();
+                            return USBD_OK;
+                        case REQUEST_TELEMETRY_PERIOD:
+                            telemetry.period = req->wValue;
+                            telemetry.nextTick = 0;
+                            return USBD_OK;
                         case REQUEST_ABORT:
                             if (cncMemory.state == HOMING) {
                                 cncMemory.stopHomingFlag = 1;
@@ -214,18 +459,21 @@ static uint8_t cncSetup(void *pdev, USB_SETUP_REQ *req) {
                             circularBuffer.programLength = 0;
                             circularBuffer.writeCount = 0;
                             circularBuffer.readCount = 0;
-                            circularBuffer.signaled = 0;
+                            circularBuffer.consumedBytes = circularBuffer.receivedBytes;
+                            circularBuffer.armed = 0;
+                            //run() flushes the steps, the machine stays there until REQUEST_CLEAR_ABORT
+                            return USBD_OK;
                         case REQUEST_RESUME_PROGRAM:
                             cncMemory.state = RUNNING_PROGRAM;
                             return USBD_OK;
                         case REQUEST_CLEAR_ABORT:
-                            DCD_EP_PrepareRx(&usbDevice, BULK_ENDPOINT, buffer, BUFFER_SIZE);
                             circularBuffer.programID = 0;
                             circularBuffer.programLength = 0;
                             circularBuffer.writeCount = 0;
                             circularBuffer.readCount = 0;
-                            circularBuffer.signaled = 0;
+                            circularBuffer.consumedBytes = circularBuffer.receivedBytes;
                             cncMemory.state = READY;
+                            armBulkReception();
                             return USBD_OK;
                         default:
                             USBD_CtlError(pdev, req);
@@ -245,20 +493,26 @@ uint8_t cncReceiveControlData(void *pdev) {
     if (controlEndpointState.state == CONTROL_WAITING_WORK_OFFSET) {
         controlEndpointState.state = CONTROL_READY;
         if (cncMemory.state == MANUAL_CONTROL || cncMemory.state == READY) {
-            cncMemory.workOffset.x = controlEndpointState.positionBuffer[0];
-            cncMemory.workOffset.y = controlEndpointState.positionBuffer[1];
-            cncMemory.workOffset.z = controlEndpointState.positionBuffer[2];
+            for (int i = 0; i < AXES_COUNT; i++)
+                cncMemory.workOffset.axes[i] = controlEndpointState.positionBuffer[i];
             return USBD_OK;
         } else {
             USBD_CtlError(pdev, &(controlEndpointState.request));
             return USBD_FAIL;
         }
     }
+    if (controlEndpointState.state == CONTROL_WAITING_PARAMETERS) {
+        controlEndpointState.state = CONTROL_READY;
+        if (setParameters(&controlEndpointState.parametersBuffer))
+            return USBD_OK;
+        USBD_CtlError(pdev, &(controlEndpointState.request));
+        return USBD_FAIL;
+    }
     return USBD_FAIL;
 }
 
-uint16_t fillLevel() {
-    return (uint16_t) (circularBuffer.writeCount - circularBuffer.readCount);
+uint32_t fillLevel() {
+    return circularBuffer.writeCount - circularBuffer.readCount;
 }
 
 int32_t readBufferArray2(uint32_t count, uint8_t *array) {
@@ -266,32 +520,65 @@ int32_t readBufferArray2(uint32_t count, uint8_t *array) {
         return 0;
     }
     for (int i = 0; i < count; i++) {
-        array[i] = circularBuffer.buffer[circularBuffer.readCount % CIRCULAR_BUFFER_SIZE];
+        array[i] = circularBufferBytes[circularBuffer.readCount % CIRCULAR_BUFFER_SIZE];
         circularBuffer.readCount++;
     }
+    circularBuffer.consumedBytes += count;
     return 1;
 }
 
 #define PROGRAM_HEADER_LENGTH 8
 
-//referenced from worker.js
-typedef enum {
-    PROGRAM_STEPS = 0,
-    PROGRAM_START_SPINDLE = 1,
-    PROGRAM_STOP_SPINDLE = 2,
-    PROGRAM_START_SOCKET = 3,
-    PROGRAM_STOP_SOCKET = 4
-} program_type_t;
+static int isMotionProgram(program_type_t type) {
+    return type == PROGRAM_STEPS || type == PROGRAM_COMPRESSED_STEPS || type == PROGRAM_SEGMENTS
+            || type == PROGRAM_WIDE_STEPS || type == PROGRAM_COMPRESSED_WIDE_STEPS;
+}
+
+static uint32_t headerProgramID(const uint8_t *header) {
+    return (uint32_t) (header[7] << 24 | header[6] << 16 | header[5] << 8 | header[4]);
+}
+
+static void enterProgram(const uint8_t *header) {
+    if (fillLevel() < bufferStatistics.minFillLevel)
+        bufferStatistics.minFillLevel = fillLevel();
+    circularBuffer.programLength = header[3] << 16 | header[2] << 8 | header[1];
+    circularBuffer.programID = headerProgramID(header);
+}
+
+static int peekProgramHeader(uint8_t *header) {
+    if (fillLevel() < PROGRAM_HEADER_LENGTH)
+        return 0;
+    for (uint32_t i = 0; i < PROGRAM_HEADER_LENGTH; i++)
+        header[i] = circularBufferBytes[(circularBuffer.readCount + i) % CIRCULAR_BUFFER_SIZE];
+    return 1;
+}
+
+//the bytes of the running program are all decoded and the next one is a motion program that is already received
+int peekNextProgram(program_type_t *type, uint32_t *programID) {
+    uint8_t header[PROGRAM_HEADER_LENGTH];
+    if (circularBuffer.programLength || !peekProgramHeader(header) || !isMotionProgram((program_type_t) header[0]))
+        return 0;
+    *type = (program_type_t) header[0];
+    *programID = headerProgramID(header);
+    return 1;
+}
+
+//the program found by peekNextProgram() takes over, the state stays RUNNING_PROGRAM
+void enterNextProgram() {
+    uint8_t header[PROGRAM_HEADER_LENGTH];
+    readBufferArray2(PROGRAM_HEADER_LENGTH, header);
+    enterProgram(header);
+}
 
 void tryToStartProgram() {
     uint8_t array[PROGRAM_HEADER_LENGTH];
     crBegin;
             if (readBufferArray2(PROGRAM_HEADER_LENGTH, array)) {
                 program_type_t programType = (program_type_t) (array[0]);
-                if (programType == PROGRAM_STEPS) {
+                if (isMotionProgram(programType)) {
                     cncMemory.state = RUNNING_PROGRAM;
-                    circularBuffer.programLength = array[3] << 16 | array[2] << 8 | array[1];
-                    circularBuffer.programID = array[7] << 24 | array[6] << 16 | array[5] << 8 | array[4];
+                    enterProgram(array);
+                    beginProgram(programType, circularBuffer.programID);
                 } else if (programType == PROGRAM_START_SPINDLE) {
                     cncMemory.spiOutput.run = 1;
                     crYieldVoidUntil(cncMemory.spiInput.drv);
@@ -314,34 +601,52 @@ void checkProgramEnd() {
     }
 }
 
-void copyUSBufferIfPossible() {
-    static uint32_t lastSignal = 0;
-    static uint32_t seenSignal = 0;
-    static uint32_t count;
-    crBegin;
-            crYieldVoidUntil((seenSignal = circularBuffer.signaled) != lastSignal);
-            count = USBD_GetRxCount(&usbDevice, BULK_ENDPOINT_NUM);
-            crYieldVoidUntil(fillLevel() < CIRCULAR_BUFFER_SIZE - count);
-            unsigned int bufferPosition = circularBuffer.writeCount % CIRCULAR_BUFFER_SIZE;
-            int overflowingCount = bufferPosition + count - CIRCULAR_BUFFER_SIZE;
-            if (overflowingCount < 0)
-                overflowingCount = 0;
-            unsigned int saturatedCount = count - overflowingCount;
-            memcpy(circularBuffer.buffer + bufferPosition, buffer, saturatedCount);
-            if (overflowingCount > 0)
-                memcpy(circularBuffer.buffer, buffer + saturatedCount, overflowingCount);
-            circularBuffer.writeCount += count;
-            lastSignal = seenSignal;
-            DCD_EP_PrepareRx(&usbDevice, BULK_ENDPOINT, buffer, BUFFER_SIZE);
-    crFinish;
+//the transfer goes to the free space after writeCount, in whole packets
+//it only completes when full or on a short packet: Runner ends the programs filling their last packet with an empty one
+static void armBulkReception() {
+    uint32_t freeSpace = CIRCULAR_BUFFER_SIZE - fillLevel();
+    uint32_t toEnd = CIRCULAR_BUFFER_SIZE - circularBuffer.writeCount % CIRCULAR_BUFFER_SIZE + BULK_PACKET_SIZE;
+    uint32_t length = freeSpace < toEnd ? freeSpace : toEnd;
+    length = length < MAX_BULK_TRANSFER ? length : MAX_BULK_TRANSFER;
+    length -= length % BULK_PACKET_SIZE;
+    if (!length)
+        //the main loop will retry when some space is freed
+        return;
+    circularBuffer.armed = 1;
+    DCD_EP_PrepareRx(&usbDevice, BULK_ENDPOINT, circularBufferBytes + circularBuffer.writeCount % CIRCULAR_BUFFER_SIZE,
+            (uint16_t) length);
+}
+
+//the endpoint NAKs when the buffer was too full to re-arm it in the interrupt
+void armBulkReceptionIfPossible() {
+    if (circularBuffer.armed || cncMemory.state == ABORTING_PROGRAM)
+        return;
+    __disable_irq();
+    if (!circularBuffer.armed && cncMemory.state != ABORTING_PROGRAM)
+        armBulkReception();
+    __enable_irq();
 }
 
 static uint8_t cncDataOut(void *pdev, uint8_t epnum) {
-    if (cncMemory.state == ABORTING_PROGRAM)
-        //just throw away the content
-        DCD_EP_PrepareRx(&usbDevice, BULK_ENDPOINT, buffer, BUFFER_SIZE);
-    else
-        circularBuffer.signaled++;
+    uint32_t count = USBD_GetRxCount(&usbDevice, BULK_ENDPOINT_NUM);
+    circularBuffer.receivedBytes += count;
+    if (!circularBuffer.armed) {
+        //the transfer went to the /dev/null
+        circularBuffer.consumedBytes += count;
+        if (cncMemory.state == ABORTING_PROGRAM)
+            //just throw away the content
+            DCD_EP_PrepareRx(&usbDevice, BULK_ENDPOINT, buffer, BUFFER_SIZE);
+        else
+            armBulkReception();
+        return USBD_OK;
+    }
+    uint32_t bufferPosition = circularBuffer.writeCount % CIRCULAR_BUFFER_SIZE;
+    if (bufferPosition + count > CIRCULAR_BUFFER_SIZE)
+        memcpy(circularBufferBytes, circularBufferBytes + CIRCULAR_BUFFER_SIZE,
+                bufferPosition + count - CIRCULAR_BUFFER_SIZE);
+    circularBuffer.writeCount += count;
+    circularBuffer.armed = 0;
+    armBulkReception();
     return USBD_OK;
 }
 
@@ -352,6 +657,55 @@ int32_t readFromProgram(uint32_t count, uint8_t *array) {
     return 1;
 }
 
+//reads a byte of the program without consuming it, returns 0 if it's not received yet or past the program end
+int32_t peekFromProgram(uint32_t offset, uint8_t *byte) {
+    if (offset >= circularBuffer.programLength || offset >= fillLevel())
+        return 0;
+    *byte = circularBufferBytes[(circularBuffer.readCount + offset) % CIRCULAR_BUFFER_SIZE];
+    return 1;
+}
+
+uint32_t remainingProgramLength() {
+    return circularBuffer.programLength;
+}
+
+//the bytes have to be in the buffer, see peekFromProgram()
+void skipFromProgram(uint32_t count) {
+    circularBuffer.readCount += count;
+    circularBuffer.consumedBytes += count;
+    circularBuffer.programLength -= count;
+}
+
+//the rest of the program is dropped as it is received
+void skipReceivedProgram() {
+    uint32_t received = fillLevel();
+    skipFromProgram(received < circularBuffer.programLength ? received : circularBuffer.programLength);
+}
+
+//the host knows what it sent, it can keep bufferSize - (sent - consumedBytes) bytes in flight without ever being NAKed
+void reportCreditsIfPossible() {
+    if (creditReport.busy || usbDevice.dev.device_status != USB_OTG_CONFIGURED)
+        return;
+    credit_report_t credits = currentCredits();
+    if (creditReport.sent && credits.consumedBytes == creditReport.report.consumedBytes
+            && credits.receivedBytes == creditReport.report.receivedBytes
+            && credits.programID == creditReport.report.programID)
+        return;
+    credits.sequence++;
+    creditReport.report = credits;
+    creditReport.sent = 1;
+    creditReport.busy = 1;
+    DCD_EP_Tx(&usbDevice, INTERRUPT_ENDPOINT, (uint8_t *) &creditReport.report, sizeof(creditReport.report));
+}
+
+static uint8_t cncDataIn(void *pdev, uint8_t epnum) {
+    if (epnum == INTERRUPT_ENDPOINT_NUM)
+        creditReport.busy = 0;
+    if (epnum == TELEMETRY_ENDPOINT_NUM)
+        telemetry.busy = 0;
+    return USBD_OK;
+}
+
 static void USBD_USR_DeviceReset(uint8_t speed) {
 }
 
@@ -371,6 +725,7 @@ static struct {
                 .DeInit = cncDeInit,
                 .Setup = cncSetup,
                 .EP0_TxSent = cncReceiveControlData,
+                .DataIn = cncDataIn,
                 .DataOut = cncDataOut,
                 .GetConfigDescriptor = cncGetCfgDesc},
         .usrCB = {
@@ -399,5 +754,7 @@ __attribute__ ((used)) void OTG_FS_WKUP_IRQHandler(void) {
 }
 
 __attribute__ ((used)) void OTG_FS_IRQHandler(void) {
+    uint32_t profileStart = beginInterruptProfile();
     USBD_OTG_ISR_Handler(&usbDevice);
+    endInterruptProfile(ISR_USB, profileStart);
 }
@@ -96,7 +96,7 @@ static const struct __attribute__((packed)) {
     struct __attribute__((packed)) {
         uint8_t bLength, bDescriptorType, bInterfaceNumber, bAlternateSetting, bNumEndpoints, bInterfaceClass,
                 bInterfaceSubClass, bInterfaceProtocol, iInterface;
-        EndPoint_t firstEndpoint, secondEndpoint;
+        EndPoint_t firstEndpoint, secondEndpoint, thirdEndpoint;
     } interface;
 } configurationDescriptor __attribute__((aligned (4))) = {
         .bLength = 9,
@@ -113,7 +113,7 @@ static const struct __attribute__((packed)) {
                 .bDescriptorType = USB_INTERFACE_DESCRIPTOR_TYPE,
                 .bInterfaceNumber = 0,
                 .bAlternateSetting = 0,
-                .bNumEndpoints = 2,
+                .bNumEndpoints = 3,
                 .bInterfaceClass = VENDOR_CLASS,
                 .bInterfaceSubClass = 0x01,
                 .bInterfaceProtocol = 0x00,
@@ -125,7 +125,7 @@ static const struct __attribute__((packed)) {
                         .bmAttributes = (uint8_t) 0b00000011,
                         .wMaxPacketSizeL = LOBYTE(INTERRUPT_PACKET_SIZE),
                         .wMaxPacketSizeH = HIBYTE(INTERRUPT_PACKET_SIZE),
-                        .bInterval = 100},
+                        .bInterval = 10},
                 .secondEndpoint = {
                         .bLength = 7,
                         .bDescriptorType = USB_ENDPOINT_DESCRIPTOR_TYPE,
@@ -133,7 +133,15 @@ static const struct __attribute__((packed)) {
                         .bmAttributes = (uint8_t) 0b00000010,
                         .wMaxPacketSizeL = LOBYTE(BULK_PACKET_SIZE),
                         .wMaxPacketSizeH = HIBYTE(BULK_PACKET_SIZE),
-                        .bInterval = 0}
+                        .bInterval = 0},
+                .thirdEndpoint = {
+                        .bLength = 7,
+                        .bDescriptorType = USB_ENDPOINT_DESCRIPTOR_TYPE,
+                        .bEndpointAddress = TELEMETRY_ENDPOINT,
+                        .bmAttributes = (uint8_t) 0b00000011,
+                        .wMaxPacketSizeL = LOBYTE(TELEMETRY_PACKET_SIZE),
+                        .wMaxPacketSizeH = HIBYTE(TELEMETRY_PACKET_SIZE),
+                        .bInterval = 1}
         }
 };
 
@@ -4,13 +4,33 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
     var CONTROL_COMMANDS = {
         REQUEST_POSITION: 0, REQUEST_PARAMETERS: 1, REQUEST_STATE: 2, REQUEST_TOGGLE_MANUAL_STATE: 3,
         REQUEST_DEFINE_AXIS_POSITION: 4, REQUEST_ABORT: 5, REQUEST_CLEAR_ABORT: 6, REQUEST_SET_SPI_OUTPUT: 7,
-        REQUEST_RESUME_PROGRAM: 8, REQUEST_RESET_SPI_OUTPUT: 9, REQUEST_HOME: 10, REQUEST_WORK_OFFSET: 11
+        REQUEST_RESUME_PROGRAM: 8, REQUEST_RESET_SPI_OUTPUT: 9, REQUEST_HOME: 10, REQUEST_WORK_OFFSET: 11,
+        REQUEST_TELEMETRY_PERIOD: 12, REQUEST_BUFFER_STATISTICS: 13, REQUEST_STEP_JITTER: 14,
+        REQUEST_CYCLE_PROFILE: 15, REQUEST_SAVE_POSITION: 16, REQUEST_CREDITS: 17
     };
+    // usb.c:telemetry_t, the positions and offsets have a word per axis
+    var TELEMETRY_ENDPOINT = 2;
+
+    function telemetryLength(axesCount) {
+        return 8 + (axesCount + 1) * 4 + axesCount * 4 + 20;
+    }
+
+    // cnc.h:AXES_COUNT goes from 3 to 6, the firmware tells with the length of its parameters
+    var AXES_NAMES = ['X', 'Y', 'Z', 'A', 'B', 'C'];
+    var AXIS_PARAMETERS_LENGTH = 12;
+    // cnc.h:loop_section_t
+    var LOOP_SECTIONS = ['handleSPI', 'periodicSpiFunction', 'armBulkReceptionIfPossible', 'reportCreditsIfPossible',
+        'sendTelemetryIfDue', 'tryToStartProgram', 'run', 'saveSettingsIfChanged'];
+    var STEP_JITTER_BINS = 16;
+    // cnc.h:profiled_interrupt_t
+    var PROFILED_INTERRUPTS = ['SysTick_Handler', 'OTG_FS_IRQHandler', 'TIM3_IRQHandler', 'DMA2_Stream3_IRQHandler',
+        'DMA1_Stream3_IRQHandler'];
     var EVENTS = {PROGRAM_END: 1, PROGRAM_START: 2, MOVED: 3, ENTER_MANUAL_MODE: 4, EXIT_MANUAL_MODE: 5};
     var STATES = {READY: 0, RUNNING_PROGRAM: 1, MANUAL_CONTROL: 2, ABORTING_PROGRAM: 3, PAUSED_PROGRAM: 4, HOMING: 5};
     var SPI_OUTPUT_MAPPING = {RUN_SPINDLE: 1, SOCKET: 1 << 6};
     var SPI_INPUT_MAPPING = {
-        SPINDLE_RUNNING: 1 << 0, SPINDLE_AT_SPEED: 1 << 1, LIMIT_Z: 1 << 2, LIMIT_X: 1 << 3, LIMIT_Y: 1 << 4
+        SPINDLE_RUNNING: 1 << 0, SPINDLE_AT_SPEED: 1 << 1, LIMIT_Z: 1 << 2, LIMIT_X: 1 << 3, LIMIT_Y: 1 << 4,
+        LIMIT_A: 1 << 5, LIMIT_B: 1 << 6, LIMIT_C: 1 << 7
     };
     var Axis = Ember.Object.extend({
         name: null,
@@ -19,6 +39,10 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
         limit: false,
         homed: false,
         offset: 0,
+        // from the firmware's parameters, maxFeedrate in mm/min and maxAcceleration in mm/s^2
+        stepsPerMillimeter: 640,
+        maxFeedrate: 2000,
+        maxAcceleration: 100,
         definePosition: function (newPosition) {
             this.get('machine').setAxisValue(this.get('name'), newPosition);
         },
@@ -34,18 +58,29 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
             var connection = Connection.create();
             this.set('connection', connection);
             this.set('runner', new Runner(connection));
-            this.set('axes', ['X', 'Y', 'Z'].map(function (name) {
-                return Axis.create({name: name, machine: _this});
-            }));
+            this.set('axes', []);
+            this.setAxesCount(3);
             this.connect();
         },
+        // the axes that are already there are kept
+        setAxesCount: function (count) {
+            var axes = this.get('axes');
+            while (axes.length > count)
+                axes.popObject();
+            while (axes.length < count)
+                axes.pushObject(Axis.create({name: AXES_NAMES[axes.length], machine: this}));
+        },
         connection: null,
         runner: null,
         axes: null,
-        stepsPerMillimeter: 640,
-        maxFeedrate: 2000,
-        maxAcceleration: 100,
         clockFrequency: 200000,
+        // ms between 2 telemetry records
+        telemetryPeriod: 50,
+        // usb.c:TICK_FREQUENCY
+        tickFrequency: 100000,
+        // seconds, from the machine's clock
+        machineTime: 0,
+        executedSteps: 0,
         feedRate: 0,
         currentState: null,
         spiInput: 0,
@@ -57,27 +92,74 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
                     return _this.askForConfiguration();
                 })
                 .then(function () {
-                    _this.askForPosition();
-                    _this.askForState();
-                    _this.askForWorkOffset();
+                    return _this.startTelemetry().catch(function () {
+                        console.log('no telemetry stream, polling');
+                        _this.askForPosition();
+                        _this.askForState();
+                        _this.askForWorkOffset();
+                    });
+                });
+        },
+        startTelemetry: function () {
+            var _this = this;
+            return this.quickControlTransfer(CONTROL_COMMANDS.REQUEST_TELEMETRY_PERIOD, this.get('telemetryPeriod'))
+                .then(function () {
+                    _this.readTelemetry();
                 });
         },
+        readTelemetry: function () {
+            var _this = this;
+            var transfer = {direction: 'in', endpoint: TELEMETRY_ENDPOINT, length: telemetryLength(this.get('axes.length'))};
+            return this.get('connection').interruptTransfer(transfer).then(function (data) {
+                _this.decodeTelemetry(data);
+                _this.readTelemetry();
+            }, function () {
+                console.error('error getting telemetry', arguments);
+                return _this.get('connection').reset().then(function () {
+                    return _this.connect();
+                });
+            });
+        },
         askForConfiguration: function () {
             var _this = this;
             return _this.get('connection')
-                .controlTransfer({request: CONTROL_COMMANDS.REQUEST_PARAMETERS, length: 16})
+                .controlTransfer({
+                    request: CONTROL_COMMANDS.REQUEST_PARAMETERS,
+                    length: AXES_NAMES.length * AXIS_PARAMETERS_LENGTH + 4
+                })
                 .then(function (data) {
                     console.log('received configuration');
+                    // 3 words per axis, see cnc.h:axis_parameters_t, then the clock frequency
+                    var axesCount = (data.byteLength - 4) / AXIS_PARAMETERS_LENGTH;
                     var params = new Int32Array(data);
-                    _this.set('stepsPerMillimeter', params[0]);
-                    _this.set('maxFeedrate', params[1]);
-                    _this.set('maxAcceleration', params[2]);
-                    _this.set('clockFrequency', params[3]);
+                    _this.setAxesCount(axesCount);
+                    _this.get('axes').forEach(function (axis, i) {
+                        axis.set('stepsPerMillimeter', params[3 * i]);
+                        axis.set('maxFeedrate', params[3 * i + 1]);
+                        axis.set('maxAcceleration', params[3 * i + 2]);
+                    });
+                    _this.set('clockFrequency', params[3 * axesCount]);
                 });
         },
+        // only accepted in the READY state, the firmware recomputes its step timing from them
+        // axesParameters: [{stepsPerMillimeter, maxFeedrate, maxAcceleration}] for each axis of the firmware
+        setConfiguration: function (axesParameters, clockFrequency) {
+            var _this = this;
+            var words = [];
+            axesParameters.forEach(function (axis) {
+                words.push(axis.stepsPerMillimeter, axis.maxFeedrate, axis.maxAcceleration);
+            });
+            words.push(clockFrequency);
+            var data = new Uint32Array(words).buffer;
+            return this.get('connection').controlTransfer({
+                direction: 'out', request: CONTROL_COMMANDS.REQUEST_PARAMETERS, data: data
+            }).then(function () {
+                return _this.askForConfiguration();
+            });
+        },
         askForPosition: function () {
             var _this = this;
-            var positionTransfer = {request: CONTROL_COMMANDS.REQUEST_POSITION, length: 16};
+            var positionTransfer = {request: CONTROL_COMMANDS.REQUEST_POSITION, length: (this.get('axes.length') + 1) * 4};
             return _this.get('connection').controlTransfer(positionTransfer).then(function (data) {
                 _this.decodeAxesPosition(data);
                 Ember.run.later(_this, _this.askForPosition, 500);
@@ -104,34 +186,31 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
         },
         askForWorkOffset: function () {
             var _this = this;
-            var transfer = {request: CONTROL_COMMANDS.REQUEST_WORK_OFFSET, length: 12};
+            var transfer = {request: CONTROL_COMMANDS.REQUEST_WORK_OFFSET, length: this.get('axes.length') * 4};
             return this.get('connection').controlTransfer(transfer).then(
                 function (data) {
-                    var buffer = new Int32Array(data);
-                    var resolution = _this.get('stepsPerMillimeter');
-                    _this.get('axes')[0].set('offset', buffer[0] / resolution);
-                    _this.get('axes')[1].set('offset', buffer[1] / resolution);
-                    _this.get('axes')[2].set('offset', buffer[2] / resolution);
+                    _this.decodeWorkOffset(data);
                     Ember.run.later(_this, _this.askForWorkOffset, 1000);
                 }, function () {
                     console.error('error getting work offset', arguments);
                 });
         },
         setWorkOffset: function () {
-            var resolution = this.get('stepsPerMillimeter');
-            var x = this.get('axes')[0].get('offset') * resolution;
-            var y = this.get('axes')[1].get('offset') * resolution;
-            var z = this.get('axes')[2].get('offset') * resolution;
-            var data = new Int32Array([x, y, z]).buffer;
+            var data = new Int32Array(this.get('axes').map(function (axis) {
+                return axis.get('offset') * axis.get('stepsPerMillimeter');
+            })).buffer;
             return this.get('connection').controlTransfer({
                 direction: 'out', request: CONTROL_COMMANDS.REQUEST_WORK_OFFSET, data: data
             });
         },
         setAxisValue: function (axis, valueInmm) {
-            var values = {X: 0, Y: 0, Z: 0};
-            values[axis] = valueInmm * this.get('stepsPerMillimeter');
-            var encodedAxis = parseInt({X: '001', Y: '010', Z: '100'}[axis], 2);
-            var data = new Int32Array([values.X, values.Y, values.Z]).buffer;
+            var axes = this.get('axes');
+            var index = axes.indexOf(axes.findBy('name', axis));
+            var values = new Int32Array(axes.length);
+            values[index] = valueInmm * axes[index].get('stepsPerMillimeter');
+            // bit n defines axis n
+            var encodedAxis = 1 << index;
+            var data = values.buffer;
             return this.get('connection').controlTransfer({
                 direction: 'out',
                 request: CONTROL_COMMANDS.REQUEST_DEFINE_AXIS_POSITION,
@@ -145,12 +224,35 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
         setManualMode: function () {
             this.quickControlTransfer(CONTROL_COMMANDS.REQUEST_TOGGLE_MANUAL_STATE);
         },
+        // a coherent snapshot of the position, work offset and state, timestamped with the machine's tick
+        decodeTelemetry: function (data) {
+            var dataView = new DataView(data);
+            var tick = dataView.getUint32(0, true) + dataView.getUint32(4, true) * 0x100000000;
+            this.set('machineTime', tick / this.get('tickFrequency'));
+            var axesCount = this.get('axes.length');
+            var offsetStart = 8 + (axesCount + 1) * 4;
+            var stateStart = offsetStart + axesCount * 4;
+            this.decodeAxesPosition(data.slice(8, offsetStart));
+            this.decodeWorkOffset(data.slice(offsetStart, stateStart));
+            this.decodeState(data.slice(stateStart, stateStart + 12));
+            this.set('executedSteps', dataView.getUint32(stateStart + 12, true));
+        },
+        decodeWorkOffset: function (data) {
+            var buffer = new Int32Array(data);
+            this.get('axes').forEach(function (axis, i) {
+                axis.set('offset', buffer[i] / axis.get('stepsPerMillimeter'));
+            });
+        },
         decodeAxesPosition: function (data) {
             var buffer = new Int32Array(data);
-            this.get('axes')[0].set('position', buffer[0] / this.get('stepsPerMillimeter'));
-            this.get('axes')[1].set('position', buffer[1] / this.get('stepsPerMillimeter'));
-            this.get('axes')[2].set('position', buffer[2] / this.get('stepsPerMillimeter'));
-            var feedrate = buffer[3] == 0 ? 0 : 60 * this.get('clockFrequency') / this.get('stepsPerMillimeter') / buffer[3];
+            var axes = this.get('axes');
+            axes.forEach(function (axis, i) {
+                axis.set('position', buffer[i] / axis.get('stepsPerMillimeter'));
+            });
+            // the firmware reports the duration of a unit step, X's resolution is taken for all axes
+            // the speed comes after the axes
+            var speed = buffer[axes.length];
+            var feedrate = speed == 0 ? 0 : 60 * this.get('clockFrequency') / axes[0].get('stepsPerMillimeter') / speed;
             this.set('feedRate', feedrate);
             $('#webView')[0].contentWindow.postMessage({
                 type: 'toolPosition',
@@ -164,17 +266,19 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
             var bitPart = dataView.getUint8(2, true);
             this.set('estop', !!(bitPart & (1 << 0)));
             this.set('toolProbe', !!(bitPart & (1 << 1)));
-            this.get('axes')[0].set('homed', !!(bitPart & (1 << 2)));
-            this.get('axes')[1].set('homed', !!(bitPart & (1 << 3)));
-            this.get('axes')[2].set('homed', !!(bitPart & (1 << 4)));
+            // bit n + 2 is axis n
+            this.get('axes').forEach(function (axis, i) {
+                axis.set('homed', !!(bitPart & (1 << (i + 2))));
+            });
             this.set('spiInput', dataView.getUint8(4, true));
             this.set('spiOutput', dataView.getUint8(6, true));
             this.set('programID', dataView.getUint32(8, true));
             this.set('spindleRunning', !!(this.get('spiInput') & SPI_INPUT_MAPPING.SPINDLE_RUNNING));
             this.set('spindleUpToSpeed', !!(this.get('spiInput') & SPI_INPUT_MAPPING.SPINDLE_AT_SPEED));
-            this.get('axes')[0].set('limit', !!(this.get('spiInput') & SPI_INPUT_MAPPING.LIMIT_X));
-            this.get('axes')[1].set('limit', !!(this.get('spiInput') & SPI_INPUT_MAPPING.LIMIT_Y));
-            this.get('axes')[2].set('limit', !!(this.get('spiInput') & SPI_INPUT_MAPPING.LIMIT_Z));
+            var spiInput = this.get('spiInput');
+            this.get('axes').forEach(function (axis) {
+                axis.set('limit', !!(spiInput & SPI_INPUT_MAPPING['LIMIT_' + axis.get('name')]));
+            });
             this.set('socketOn', !!(this.get('spiOutput') & SPI_OUTPUT_MAPPING.SOCKET));
             var operations = this.get('runner').programs[this.get('programID')];
             $('#webView')[0].contentWindow.postMessage({
@@ -183,16 +287,103 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
             }, '*');
         },
         getParameters: function () {
-            var keys = ['stepsPerMillimeter', 'maxFeedrate', 'maxAcceleration', 'clockFrequency'];
-            var res = {};
-            for (var i = 0; i < keys.length; i++)
-                res[keys[i]] = this.get(keys[i]);
             var axes = this.get('axes');
+            var res = {clockFrequency: this.get('clockFrequency')};
+            // the tool paths only move X, Y and Z
+            res.axes = axes.slice(0, 3).map(function (axis) {
+                return axis.getProperties('stepsPerMillimeter', 'maxFeedrate', 'maxAcceleration');
+            });
+            // the travel moves go as fast as the fastest axis, the planner slows them down on the others
+            res.maxFeedrate = Math.max.apply(null, res.axes.map(function (axis) {
+                return axis.maxFeedrate;
+            }));
             res.position = new util.Point(axes[0].get('position'), axes[1].get('position'), axes[2].get('position'));
             return res;
         },
         sendGcode: function (code) {
-            this.get('runner').executeProgram({type: 'gcode', program: code, parameters: this.getParameters()});
+            this.resetBufferStatistics();
+            this.resetStepJitter();
+            this.resetCycleProfile();
+            this.logBufferStatisticsAfter(this.get('runner').executeProgram({type: 'gcode', program: code, parameters: this.getParameters()}));
+        },
+        // counted by the firmware since the reset, see usb.c:bufferStatistics
+        resetBufferStatistics: function () {
+            return this.quickControlTransfer(CONTROL_COMMANDS.REQUEST_BUFFER_STATISTICS);
+        },
+        readBufferStatistics: function () {
+            var _this = this;
+            var transfer = {request: CONTROL_COMMANDS.REQUEST_BUFFER_STATISTICS, length: 24};
+            return this.get('connection').controlTransfer(transfer).then(function (data) {
+                var buffer = new Uint32Array(data);
+                return {
+                    starvationEvents: buffer[0],
+                    minFillLevel: buffer[1],
+                    receivedBytes: buffer[2],
+                    executedSteps: buffer[3],
+                    starvedSeconds: (buffer[4] + buffer[5] * 0x100000000) / _this.get('tickFrequency')
+                };
+            });
+        },
+        // lateness of the step edges in core cycles, see profiling.c
+        resetStepJitter: function () {
+            return this.quickControlTransfer(CONTROL_COMMANDS.REQUEST_STEP_JITTER);
+        },
+        readStepJitter: function () {
+            var transfer = {request: CONTROL_COMMANDS.REQUEST_STEP_JITTER, length: (3 + STEP_JITTER_BINS) * 4};
+            return this.get('connection').controlTransfer(transfer).then(function (data) {
+                var buffer = new Uint32Array(data);
+                return {
+                    edges: buffer[0],
+                    worstLatency: buffer[1],
+                    worstSection: LOOP_SECTIONS[buffer[2]],
+                    // bin 0 is under 32 cycles, then bin n starts at 16 << n cycles
+                    histogram: Array.prototype.slice.call(buffer, 3)
+                };
+            });
+        },
+        // cycles spent in each call of the superloop and in the interrupt handlers, see cnc.h:cycle_profile_t
+        resetCycleProfile: function () {
+            return this.quickControlTransfer(CONTROL_COMMANDS.REQUEST_CYCLE_PROFILE);
+        },
+        readCycleProfile: function () {
+            var accounts = LOOP_SECTIONS.concat(PROFILED_INTERRUPTS);
+            var transfer = {request: CONTROL_COMMANDS.REQUEST_CYCLE_PROFILE, length: 8 + accounts.length * 16};
+            return this.get('connection').controlTransfer(transfer).then(function (data) {
+                var view = new DataView(data);
+
+                function readUint64(offset) {
+                    return view.getUint32(offset, true) + view.getUint32(offset + 4, true) * 0x100000000;
+                }
+
+                var profile = {elapsedCycles: readUint64(0)};
+                for (var i = 0; i < accounts.length; i++) {
+                    var offset = 8 + i * 16;
+                    profile[accounts[i]] = {
+                        totalCycles: readUint64(offset),
+                        calls: view.getUint32(offset + 8, true),
+                        maxCycles: view.getUint32(offset + 12, true)
+                    };
+                }
+                return profile;
+            });
+        },
+        logBufferStatisticsAfter: function (promise) {
+            var _this = this;
+
+            function log() {
+                _this.readBufferStatistics().then(function (statistics) {
+                    console.log('buffer statistics', statistics);
+                });
+                _this.readStepJitter().then(function (jitter) {
+                    console.log('step jitter', jitter);
+                });
+                _this.readCycleProfile().then(function (profile) {
+                    console.log('cycle profile', profile);
+                });
+            }
+
+            promise.then(log, log);
+            return promise;
         },
         abort: function () {
             var _this = this;
@@ -206,9 +397,12 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
         },
         transmitProgram: function () {
             var deferred = RSVP.defer();
+            this.resetBufferStatistics();
+            this.resetStepJitter();
+            this.resetCycleProfile();
             $('#webView')[0].contentWindow.postMessage({type: 'gimme program', parameters: this.getParameters()}, '*',
                 [this.get('runner').getCodeChannel(deferred)]);
-            return deferred.promise;
+            return this.logBufferStatisticsAfter(deferred.promise);
         },
         resumeProgram: function () {
             return this.quickControlTransfer(CONTROL_COMMANDS.REQUEST_RESUME_PROGRAM);
@@ -226,6 +420,10 @@ define(['RSVP', 'jQuery', 'Ember', 'cnc/controller/connection', 'cnc/controller/
         home: function () {
             return this.quickControlTransfer(CONTROL_COMMANDS.REQUEST_HOME);
         },
+        // once the machine is parked, its position survives the power cycle, see storage.c
+        savePosition: function () {
+            return this.quickControlTransfer(CONTROL_COMMANDS.REQUEST_SAVE_POSITION);
+        },
         spiInputBinary: function () {
             return this.get('spiInput').toString(2);
         }.property('spiInput'),
@@ -1,59 +1,179 @@
 "use strict";
 define(['RSVP'], function (RSVP) {
     var ENDPOINT = 1;
+    // full speed, see BULK_PACKET_SIZE in usb.c
+    var BULK_PACKET_SIZE = 64;
     var STALL_ERROR = 4;
+    // credit reports, see usb.c:reportCreditsIfPossible()
+    var CREDIT_ENDPOINT = 1;
+    var CREDIT_REPORT_LENGTH = 24;
+    // the same report on the control endpoint, see REQUEST_CREDITS in usb.c and CNCMachine.js
+    var REQUEST_CREDITS = 17;
 
     function Runner(connection) {
         this.connection = connection;
         this.worker = null;
         this.aborted = false;
         this.programs = {};
+        // bytes handed to bulkTransfer since the connection, the firmware counts the same bytes as received
+        this.sentBytes = 0;
+        this.credits = null;
+        this.creditListener = null;
+        // the current polling, an older one still waiting for a report ignores it
+        this.creditPolling = null;
+        // the bulk transfers since startCapture(), to be replayed by interpolator/host/interpolator-replay
+        this.capture = null;
     }
 
     Runner.prototype = {
+        // the firmware sends a report when its ring buffer moves, the last one is kept
+        // nothing is sent before the counters are read: the firmware counts since its power up, and a report
+        // arriving after a transfer could not tell whether it includes it
+        pollCredits: function () {
+            var _this = this;
+            if (this.creditPolling)
+                return;
+            var polling = this.creditPolling = {};
+            this.credits = null;
+            function update(data) {
+                if (_this.creditPolling !== polling)
+                    return false;
+                var view = new DataView(data);
+                _this.credits = {
+                    freeBytes: view.getUint32(0, true),
+                    consumedBytes: view.getUint32(4, true),
+                    receivedBytes: view.getUint32(8, true),
+                    programID: view.getUint32(12, true),
+                    bufferSize: view.getUint32(16, true),
+                    sequence: view.getUint32(20, true)
+                };
+                if (_this.creditListener)
+                    _this.creditListener();
+                return true;
+            }
+
+            function fail(errorCode) {
+                if (_this.creditPolling !== polling)
+                    return;
+                // an older firmware, or the device is gone: back to the bulk endpoint's back-pressure
+                console.log('credit report errorCode', errorCode);
+                _this.creditPolling = null;
+                _this.credits = null;
+                if (_this.creditListener)
+                    _this.creditListener();
+            }
+
+            function poll() {
+                _this.connection.interruptTransfer({direction: 'in', endpoint: CREDIT_ENDPOINT, length: CREDIT_REPORT_LENGTH})
+                    .then(function (data) {
+                        if (update(data))
+                            poll();
+                    }, fail);
+            }
+
+            this.connection.controlTransfer({request: REQUEST_CREDITS, length: CREDIT_REPORT_LENGTH})
+                .then(function (data) {
+                    // no transfer is in flight yet
+                    if (_this.creditPolling === polling)
+                        _this.sentBytes = new DataView(data).getUint32(8, true);
+                    if (update(data))
+                        poll();
+                }, fail);
+        },
+        stopCredits: function () {
+            this.creditPolling = null;
+            this.credits = null;
+        },
+        startCapture: function () {
+            this.capture = [];
+        },
+        // the raw stream, what the firmware received in order
+        stopCapture: function () {
+            var blob = new Blob(this.capture || [], {type: 'application/octet-stream'});
+            this.capture = null;
+            return blob;
+        },
+        // the 32 bits counters of the firmware wrap
+        availableCredit: function () {
+            return this.credits.bufferSize - ((this.sentBytes - this.credits.consumedBytes) >>> 0);
+        },
         getCodeChannel: function (deferred) {
             this.aborted = false;
             this.worker = new Worker("worker.js");
             this.loop = loop;
             this.programs = {};
+            this.creditListener = loop;
+            this.pollCredits();
             var workQueue = [];
             var sentToUSBProgramsCount = 0;
-            var running = false;
+            var inFlightTransfers = 0;
+            var finished = false;
             var _this = this;
 
+            // with the credits, as many transfers as the ring buffer can take are in flight, none of them gets NAKed
+            function canSend(formattedData) {
+                // the counters are being read
+                if (_this.creditPolling && _this.credits == null)
+                    return false;
+                if (_this.credits == null)
+                    return inFlightTransfers == 0;
+                return formattedData.byteLength <= _this.availableCredit();
+            }
+
             function loop() {
-                if (workQueue.length && !_this.aborted) {
-                    running = true;
+                if (finished) {
+                    if (_this.aborted)
+                        _this.aborted.resolve();
+                    return;
+                }
+                while (workQueue.length && !_this.aborted && canSend(workQueue[0])) {
                     chrome.power.requestKeepAwake('system');
-                    sendSpeed(workQueue.shift()).then(loop, function (errorCode) {
+                    inFlightTransfers++;
+                    sendSpeed(workQueue.shift()).then(function () {
+                        inFlightTransfers--;
+                        loop();
+                    }, function (errorCode) {
                         console.log('sendSpeed errorCode', errorCode);
                         _this.terminateWorker();
                         if (errorCode != STALL_ERROR)
                             console.log('error in bulkSend', errorCode, chrome.runtime.lastError);
+                        finished = true;
+                        _this.creditListener = null;
+                        _this.stopCredits();
                         deferred.reject(chrome.runtime.lastError, arguments);
                         return null;
                     });
-                } else {
-                    //starved or finished
-                    running = false;
-                    if (_this.worker == null || _this.aborted)
-                        sendSpeed(new ArrayBuffer(0)).finally(function () {//flush
-                            if (_this.aborted)
-                                _this.aborted.resolve();
-                            deferred.resolve();
-                            chrome.power.releaseKeepAwake();
-                        });
+                }
+                //starved or finished
+                if ((!workQueue.length || _this.aborted) && inFlightTransfers == 0 && (_this.worker == null || _this.aborted)) {
+                    finished = true;
+                    _this.creditListener = null;
+                    _this.stopCredits();
+                    sendSpeed(new ArrayBuffer(0)).finally(function () {//flush
+                        if (_this.aborted)
+                            _this.aborted.resolve();
+                        deferred.resolve();
+                        chrome.power.releaseKeepAwake();
+                    });
                 }
             }
 
             function sendSpeed(formattedData) {
                 sentToUSBProgramsCount++;
+                _this.sentBytes = (_this.sentBytes + formattedData.byteLength) >>> 0;
+                if (_this.capture)
+                    _this.capture.push(formattedData.slice(0));
                 if (_this.worker != null)
                     _this.worker.outputPort.postMessage({
                         operation: 'updateSentToUSBProgramsCount',
                         count: sentToUSBProgramsCount
                     });
-                return _this.connection.bulkTransfer({direction: 'out', endpoint: ENDPOINT, data: formattedData});
+                var transfer = _this.connection.bulkTransfer({direction: 'out', endpoint: ENDPOINT, data: formattedData});
+                // the firmware arms several packets, a transfer filling its last packet only ends with an empty one
+                if (formattedData.byteLength == 0 || formattedData.byteLength % BULK_PACKET_SIZE)
+                    return transfer;
+                var end = _this.connection.bulkTransfer({direction: 'out', endpoint: ENDPOINT, data: new ArrayBuffer(0)});
+                return RSVP.all([transfer, end]);
             }
 
             var inputChannel = new MessageChannel();
@@ -67,8 +187,7 @@ define(['RSVP'], function (RSVP) {
                     workQueue.push(data.program);
                 else
                     _this.terminateWorker();
-                if (!running)
-                    loop();
+                loop();
             };
             return inputChannel.port2;
         },
@@ -92,4 +211,4 @@ define(['RSVP'], function (RSVP) {
         }
     };
     return Runner;
-});
\ No newline at end of file
+});
@@ -1,5 +1,5 @@
 "use strict";
-define([], function () {
+define(['cnc/util'], function (util) {
     function differentiator(stepCollector) {
         var previousPoint = null;
         return function (point, ratio) {
@@ -14,9 +14,14 @@ define([], function () {
         };
     }
 
+    // stepSize is a point, in mm per step along each axis
+    function toSteps(point, stepSize) {
+        return new util.Point(point.x / stepSize.x, point.y / stepSize.y, point.z / stepSize.z).round();
+    }
+
     function rasterizeLine(line, stepSize, stepCollector) {
-        var fromStep = line.from.scale(1 / stepSize).round();
-        var toStep = line.to.scale(1 / stepSize).round();
+        var fromStep = toSteps(line.from, stepSize);
+        var toStep = toSteps(line.to, stepSize);
         var dv = toStep.sub(fromStep);
         line.dv = dv;
         var steps = Math.max(Math.abs(dv.x), Math.abs(dv.y), Math.abs(dv.z));
@@ -28,19 +33,23 @@ define([], function () {
     }
 
     function rasterizeArc(arc, stepSize, stepCollector, pointAtRatio) {
-        var arcSteps = Math.ceil(arc.radius * Math.abs(arc.angularDistance) / stepSize);
+        var lastCoord = arc.plane.lastCoord;
+        // the finest axis of the plane is not allowed to skip a step
+        var planeStepSize = Math.min(stepSize[arc.plane.firstCoord], stepSize[arc.plane.secondCoord]);
+        var arcSteps = Math.ceil(arc.radius * Math.abs(arc.angularDistance) / planeStepSize);
         var startPoint = pointAtRatio(0);
         var endPoint = pointAtRatio(1);
-        var linearSteps = Math.ceil(Math.abs(endPoint[arc.plane.lastCoord] - startPoint[arc.plane.lastCoord]) / stepSize);
+        var linearSteps = Math.ceil(Math.abs(endPoint[lastCoord] - startPoint[lastCoord]) / stepSize[lastCoord]);
         var steps = Math.max(arcSteps, linearSteps);
         var filter = differentiator(stepCollector);
         for (var i = 0; i <= steps; i++) {
             var ratio = i / steps;
-            filter(pointAtRatio(ratio).scale(1 / stepSize).round(), ratio);
+            filter(toSteps(pointAtRatio(ratio), stepSize), ratio);
         }
     }
 
     return {
+        toSteps: toSteps,
         rasterizeLine: rasterizeLine,
         rasterizeArc: rasterizeArc
     }
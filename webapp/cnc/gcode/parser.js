@@ -271,7 +271,6 @@ define(['libs/jsparse', 'cnc/util'], function (jp, util) {
         var origins = [];
         for (var i = 0; i < 10; i++)
             origins.push(new util.Point(0, 0, 0));
-        var path = [];
         var machineState = {
             position: new util.Point(0, 0, 0),
             distanceMode: absoluteDistance,
@@ -281,12 +280,12 @@ define(['libs/jsparse', 'cnc/util'], function (jp, util) {
             feedRate: Math.min(200, maxFeedRate),
             travelFeedRate: Math.min(travelFeedRate, maxFeedRate),
             pathControl: 61,
-            path: path,
+            path: [],
             parser: createParser(),
             origins: origins,
             currentOrigin: 1,
             addPathFragment: function (fragment) {
-                path.push(fragment);
+                machineState.path.push(fragment);
                 pathListener(fragment);
             },
             absolutePoint: function (parsedMove) {
@@ -525,7 +524,28 @@ define(['libs/jsparse', 'cnc/util'], function (jp, util) {
             machineState.motionMode(parsed, machineState);
     }
 
-    function evaluate(text, travelFeedRate, maxFeedRate, initialPosition, errorCollector, fragmentListener) {
+    function evaluateLine(originalLine, lineNo, machineState, maxFeedRate, errorCollector) {
+        if (originalLine.match(/[\t ]*%[\t ]*/))
+            return;
+        var line = cleanLineUp(originalLine);
+        var parsed = machineState.parser.parseLine(line);
+        machineState.lineNo = lineNo;
+        if (parsed == undefined)
+            errorCollector.push({lineNo: lineNo, message: "did not understand line", line: originalLine});
+        else
+            try {
+                handleLineAst(parsed, machineState, maxFeedRate, originalLine, lineNo, errorCollector);
+            } catch (error) {
+                errorCollector.push({
+                    lineNo: lineNo,
+                    message: error.name + ': ' + error.message,
+                    line: originalLine
+                });
+            }
+    }
+
+    // evaluates the program a range of lines at a time, the path of a range is handed over and not kept
+    function createEvaluator(text, travelFeedRate, maxFeedRate, initialPosition, errorCollector, fragmentListener) {
         if (errorCollector == null)
             errorCollector = [];
         if (travelFeedRate == null)
@@ -538,31 +558,31 @@ define(['libs/jsparse', 'cnc/util'], function (jp, util) {
         }
         var machineState = createMachine(travelFeedRate, maxFeedRate, initialPosition, fragmentListener);
         var arrayOfLines = text.split(/\r?\n/);
-        for (var lineNo = 0; lineNo < arrayOfLines.length; lineNo++) {
-            var originalLine = arrayOfLines[lineNo];
-            if (originalLine.match(/[\t ]*%[\t ]*/))
-                continue;
-            var line = cleanLineUp(originalLine);
-            var parsed = machineState.parser.parseLine(line);
-            machineState.lineNo = lineNo;
-            if (parsed == undefined)
-                errorCollector.push({lineNo: lineNo, message: "did not understand line", line: originalLine});
-            else
-                try {
-                    handleLineAst(parsed, machineState, maxFeedRate, originalLine, lineNo, errorCollector);
-                } catch (error) {
-                    errorCollector.push({
-                        lineNo: lineNo,
-                        message: error.name + ': ' + error.message,
-                        line: originalLine
-                    });
+        var lineNo = 0;
+        return {
+            isDone: function () {
+                return lineNo >= arrayOfLines.length;
+            },
+            // the lines are evaluated until the path has maxFragments fragments, an arc can go past it
+            evaluateLines: function (maxFragments) {
+                machineState.path = [];
+                while (lineNo < arrayOfLines.length && machineState.path.length < maxFragments) {
+                    evaluateLine(arrayOfLines[lineNo], lineNo, machineState, maxFeedRate, errorCollector);
+                    lineNo++;
                 }
-        }
-        return machineState.path;
+                return machineState.path;
+            }
+        };
+    }
+
+    function evaluate(text, travelFeedRate, maxFeedRate, initialPosition, errorCollector, fragmentListener) {
+        return createEvaluator(text, travelFeedRate, maxFeedRate, initialPosition, errorCollector, fragmentListener)
+            .evaluateLines(Infinity);
     }
 
     return {
         evaluate: evaluate,
+        createEvaluator: createEvaluator,
         createParser: createParser
     };
 });
\ No newline at end of file
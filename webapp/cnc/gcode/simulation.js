@@ -20,6 +20,11 @@ define(['cnc/util', 'cnc/gcode/geometry'], function (util, geometry) {
                 var dp = line.to.sub(line.from);
                 return dp.normalized();
             },
+            // the share of the speed each axis takes
+            axesLoad: function (line) {
+                var direction = COMPONENT_TYPES.line.entryDirection(line);
+                return new util.Point(Math.abs(direction.x), Math.abs(direction.y), Math.abs(direction.z));
+            },
             exitDirection: function (line) {
                 return COMPONENT_TYPES.line.entryDirection(line);
             },
@@ -43,6 +48,15 @@ define(['cnc/util', 'cnc/gcode/geometry'], function (util, geometry) {
             entryDirection: function (arc) {
                 return getArcSpeedDirection(arc, 0);
             },
+            // the tangent turns in the plane, both axes of the plane take the whole speed at some point
+            axesLoad: function (arc) {
+                var lastCoord = arc.plane.lastCoord;
+                var load = new util.Point(0, 0, 0);
+                load[arc.plane.firstCoord] = 1;
+                load[arc.plane.secondCoord] = 1;
+                load[lastCoord] = Math.abs(arc.to[lastCoord] - arc.from[lastCoord]) / COMPONENT_TYPES.arc.length(arc);
+                return load;
+            },
             exitDirection: function (arc) {
                 return getArcSpeedDirection(arc, arc.angularDistance);
             },
@@ -211,7 +225,19 @@ define(['cnc/util', 'cnc/gcode/geometry'], function (util, geometry) {
         return {speed: result.speed, time: timeOffset + result.time};
     }
 
-    function groupConnectedComponents(path, acceleration) {
+    // the highest value along a path loading the axes with load that keeps each axis under its own limit
+    function axesLimit(load, limits) {
+        var limit = Infinity;
+        ['x', 'y', 'z'].forEach(function (axis) {
+            if (load[axis] > 0)
+                limit = Math.min(limit, limits[axis] / load[axis]);
+        });
+        // a zero length component moves no axis, the most limited one is taken
+        return isFinite(limit) ? limit : Math.min(limits.x, limits.y, limits.z);
+    }
+
+    // axesLimits: {acceleration, feedRate} points, in mm/s^2 and mm/min on each axis
+    function groupConnectedComponents(path, axesLimits) {
         var groups = [];
         var currentGroup = null;
         var lastExitDirection = new util.Point(0, 0, 0);
@@ -226,8 +252,10 @@ define(['cnc/util', 'cnc/gcode/geometry'], function (util, geometry) {
             }
             lastExitDirection = trait.exitDirection(component);
             component.length = trait.length(component);
-            var speedData = trait.speed(component, acceleration);
-            component.squaredSpeed = Math.pow(speedData.speed, 2);
+            var load = trait.axesLoad(component);
+            var speedData = trait.speed(component, axesLimit(load, axesLimits.acceleration));
+            var maxSpeed = axesLimit(load, axesLimits.feedRate) / 60;
+            component.squaredSpeed = Math.pow(Math.min(speedData.speed, maxSpeed), 2);
             component.maxAcceleration = speedData.acceleration;
         }
         return groups;
@@ -235,7 +263,10 @@ define(['cnc/util', 'cnc/gcode/geometry'], function (util, geometry) {
 
     function simulate2(toolPath, pushPointXYZ) {
         var acceleration = 200; //mm.s^-2
-        var groups = groupConnectedComponents(toolPath, acceleration);
+        var groups = groupConnectedComponents(toolPath, {
+            acceleration: new util.Point(acceleration, acceleration, acceleration),
+            feedRate: new util.Point(Infinity, Infinity, Infinity)
+        });
         var currentTime = 0;
         var lastPosition;
 
@@ -269,25 +300,80 @@ define(['cnc/util', 'cnc/gcode/geometry'], function (util, geometry) {
         });
     }
 
-    function planProgram(toolPath, acceleration, stepSize, timebase, stepCollector) {
-        var speedFactors = [0, 1, Math.SQRT2, Math.sqrt(3)];
-        var groups = groupConnectedComponents(toolPath, acceleration);
-        $.each(groups, function (_, group) {
-            planSpeed(group);
-            $.each(group, function (_, segment) {
-                function planningStepCollector(dx, dy, dz, ratio) {
-                    //go slower if we are stepping in diagonals
-                    var speedFactor = speedFactors[!!dx + !!dy + !!dz];
-                    var speed = dataForRatio(segment, ratio).speed;
-                    var minSpeed = segment.feedRate / 60 / 20;
-                    speed = Math.max(speed, minSpeed);
-                    var time = Math.ceil(timebase * speedFactor * stepSize / speed);
-                    stepCollector(dx, dy, dz, time, segment);
-                }
+    function fragmentSquaredSpeeds(fragment) {
+        if (fragment.type == 'constant')
+            return {from: fragment.squaredSpeed, to: fragment.squaredSpeed};
+        return {from: fragment.fromSqSpeed, to: fragment.toSqSpeed};
+    }
 
-                COMPONENT_TYPES[segment.type].rasterize(segment, stepSize, planningStepCollector);
-            });
+    //when segmentCollector is given, the lines are not rasterized but handed over with their speed profile,
+    //for the firmware to interpolate them (see planner.c)
+    //axes: [{stepsPerMillimeter, maxFeedrate, maxAcceleration}] for x, y and z, like CNCMachine.getParameters()
+    //the steps are produced on demand: each planNext() call plans one more component of the path and returns false
+    //once the last one is done, so that the caller only plans as far ahead as it wants
+    function createProgramPlanner(toolPath, axes, timebase, stepCollector, segmentCollector) {
+        function axesPoint(key) {
+            return new util.Point(axes[0][key], axes[1][key], axes[2][key]);
+        }
+
+        var stepSize = new util.Point(1 / axes[0].stepsPerMillimeter, 1 / axes[1].stepsPerMillimeter,
+            1 / axes[2].stepsPerMillimeter);
+        var groups = groupConnectedComponents(toolPath, {
+            acceleration: axesPoint('maxAcceleration'),
+            feedRate: axesPoint('maxFeedrate')
         });
+        var groupIndex = 0;
+        var segmentIndex = 0;
+
+        function planSegment(segment) {
+            if (segmentCollector && segment.type == 'line' && segment.fragments.length) {
+                //same rounding as geometry.rasterizeLine()
+                var fromStep = geometry.toSteps(segment.from, stepSize);
+                var dv = geometry.toSteps(segment.to, stepSize).sub(fromStep);
+                var entry = fragmentSquaredSpeeds(segment.fragments[0]).from;
+                var exit = fragmentSquaredSpeeds(segment.fragments[segment.fragments.length - 1]).to;
+                segmentCollector(dv.x, dv.y, dv.z, Math.sqrt(entry), Math.sqrt(segment.squaredSpeed), Math.sqrt(exit),
+                    segment.maxAcceleration, segment);
+                return;
+            }
+
+            function planningStepCollector(dx, dy, dz, ratio) {
+                //go slower if we are stepping in diagonals
+                var stepLength = util.length(dx * stepSize.x, dy * stepSize.y, dz * stepSize.z);
+                var speed = dataForRatio(segment, ratio).speed;
+                var minSpeed = segment.feedRate / 60 / 20;
+                speed = Math.max(speed, minSpeed);
+                var time = Math.ceil(timebase * stepLength / speed);
+                stepCollector(dx, dy, dz, time, segment);
+            }
+
+            COMPONENT_TYPES[segment.type].rasterize(segment, stepSize, planningStepCollector);
+        }
+
+        return {
+            planNext: function () {
+                if (groupIndex == groups.length)
+                    return false;
+                var group = groups[groupIndex];
+                if (segmentIndex == 0)
+                    planSpeed(group);
+                planSegment(group[segmentIndex]);
+                segmentIndex++;
+                if (segmentIndex == group.length) {
+                    //the speed plan of a finished group can go
+                    groups[groupIndex] = null;
+                    groupIndex++;
+                    segmentIndex = 0;
+                }
+                return groupIndex < groups.length;
+            }
+        };
+    }
+
+    function planProgram(toolPath, axes, timebase, stepCollector, segmentCollector) {
+        var planner = createProgramPlanner(toolPath, axes, timebase, stepCollector, segmentCollector);
+        while (planner.planNext()) {
+        }
     }
 
     function collectToolpathInfo(toolpath) {
@@ -309,6 +395,7 @@ define(['cnc/util', 'cnc/gcode/geometry'], function (util, geometry) {
         simulate2: simulate2,
         collectToolpathInfo: collectToolpathInfo,
         planProgram: planProgram,
+        createProgramPlanner: createProgramPlanner,
         COMPONENT_TYPES: COMPONENT_TYPES
     }
 });
\ No newline at end of file
@@ -78,21 +78,46 @@ var tasks = {
                 PROGRAM_START_SPINDLE: 1,
                 PROGRAM_STOP_SPINDLE: 2,
                 PROGRAM_START_SOCKET: 3,
-                PROGRAM_STOP_SOCKET: 4
+                PROGRAM_STOP_SOCKET: 4,
+                PROGRAM_COMPRESSED_STEPS: 5,
+                PROGRAM_SEGMENTS: 6,
+                // the rotary axes, the tool paths here only move X, Y and Z
+                PROGRAM_WIDE_STEPS: 7,
+                PROGRAM_COMPRESSED_WIDE_STEPS: 8
             };
 
             function createSingleFlagProgram(type) {
                 return {program: new Uint8Array([type, 0, 0, 0, 0, 0, 0, 0]).buffer, programID: 0, operations: []};
             }
 
-            var MAX_QUEUED_PROGRAMS = 10;
+            // the planning stops when this much is handed to the runner and not sent to USB yet, see planUntilLookahead()
+            // a program message can override them with its lookahead: {bytes, seconds}
+            var DEFAULT_LOOKAHEAD = {bytes: 128 * 1024, seconds: 10};
             var TOOLPATH_CHUNK_SIZE = 100000;
             var MAX_PROGRAM_SIZE = 300;
-            var sentToRunnerProgramsCount = 0;
+            // run-length encoded steps, see main.c:nextCompressedProgramStep()
+            var COMPRESSED_STEPS = true;
+            // the lines are interpolated by the firmware, see planner.c, the arcs are still sent as steps
+            var LINEAR_SEGMENTS = true;
             var sentToUSBProgramsCount = 0;
-            var programEncoder = createProgramEncoder(MAX_PROGRAM_SIZE);
+            // shared by the encoders, the runner follows the programs by their ID
+            var nextProgramID = 1;
+            var programEncoder = COMPRESSED_STEPS ? createCompressedProgramEncoder(MAX_PROGRAM_SIZE * 3)
+                : createProgramEncoder(MAX_PROGRAM_SIZE);
+            var segmentEncoder = createSegmentProgramEncoder(MAX_PROGRAM_SIZE * 3);
             var pendingEvents = [];
-            var pendingToolPathChunks = [];
+            // the event being converted, it hands its tool path a chunk at a time
+            var toolPathSource = null;
+            var lookahead = DEFAULT_LOOKAHEAD;
+            // the programs posted to the runner and not sent to USB yet, oldest first
+            var queuedPrograms = [];
+            var queuedBytes = 0;
+            var queuedSeconds = 0;
+            // the motion time in the encoder being filled, it goes with its program
+            var encodedSeconds = 0;
+            var planner = null;
+            var plannedChunk = null;
+            var finished = false;
             var inputPort = event.ports[0];
             var outputPort = event.ports[1];
             var stopSpindleAfter = false;
@@ -102,71 +127,111 @@ var tasks = {
                 pendingEvents.push(deferredEvent);
                 stopSpindleAfter |= deferredEvent.data.stopSpindleAfter;
                 stopSocketAfter |= deferredEvent.data.stopSocketAfter;
+                if (deferredEvent.data.lookahead)
+                    lookahead = $.extend({}, DEFAULT_LOOKAHEAD, deferredEvent.data.lookahead);
                 if (deferredEvent.data.startSpindleBefore)
-                    outputPort.postMessage(createSingleFlagProgram(PROGRAM_TYPES.PROGRAM_START_SPINDLE));
+                    postProgram(createSingleFlagProgram(PROGRAM_TYPES.PROGRAM_START_SPINDLE), 0);
                 if (deferredEvent.data.startSocketBefore)
-                    outputPort.postMessage(createSingleFlagProgram(PROGRAM_TYPES.PROGRAM_START_SOCKET));
-                while (pendingEvents.length > 0 && sentToRunnerProgramsCount - sentToUSBProgramsCount < MAX_QUEUED_PROGRAMS) {
-                    var event = pendingEvents.shift();
-                    var typeConverter = {
-                        gcode: function (data) {
-                            var params = data.parameters;
-                            return parser.evaluate(data.program, params.maxFeedrate, params.maxFeedrate, params.position);
-                        },
-                        toolPath: function (data) {
-                            return data.toolPath;
-                        },
-                        compactToolPath: function (data) {
-                            var fragments = data.toolPath;
-                            var travelBits = [];
-                            var position;
-                            var travelFeedrate = data.parameters.maxFeedrate;
-
-                            function travelTo(point, speedTag, feedrate, operation) {
-                                if (position)
-                                    travelBits.push({
-                                        type: 'line',
-                                        from: position,
-                                        to: point,
-                                        speedTag: speedTag,
-                                        feedRate: speedTag == 'rapid' ? travelFeedrate : feedrate,
-                                        operation: operation
-                                    });
-                                position = point;
-                            }
-
-                            for (var i = 0; i < fragments.length; i++) {
-                                var fragment = fragments[i];
-                                for (var j = 0; j < fragment.path.length; j += 3) {
-                                    var point = new util.Point(fragment.path[j], fragment.path[j + 1], fragment.path[j + 2]);
-                                    travelTo(point, fragment.speedTag, fragment.feedRate, fragment.operation);
-                                }
-                            }
-                            return travelBits;
-                        }
-                    };
-                    var toolPath = typeConverter[event.data.type](event.data);
-                    for (var i = 0, j = toolPath.length; i < j; i += TOOLPATH_CHUNK_SIZE) {
-                        var chunk = toolPath.slice(i, i + TOOLPATH_CHUNK_SIZE);
-                        chunk.parameters = event.data.parameters;
-                        pendingToolPathChunks.push(chunk);
-                    }
-                    if (!event.data['hasMore'])
-                        pendingToolPathChunks[pendingToolPathChunks.length - 1].isLast = true;
-                }
-
-                consumePendingToolPathsChunks();
+                    postProgram(createSingleFlagProgram(PROGRAM_TYPES.PROGRAM_START_SOCKET), 0);
+                planUntilLookahead();
             };
 
+            // the runner counts every transfer, the flag programs included
             outputPort.onmessage = function (event) {
+                while (sentToUSBProgramsCount < event.data.count && queuedPrograms.length) {
+                    var sent = queuedPrograms.shift();
+                    queuedBytes -= sent.bytes;
+                    queuedSeconds -= sent.seconds;
+                    sentToUSBProgramsCount++;
+                }
                 sentToUSBProgramsCount = event.data.count;
-                consumePendingToolPathsChunks();
+                planUntilLookahead();
             };
 
+            // the chunks of a tool path that is already in memory
+            function sliceToolPath(toolPath) {
+                var start = 0;
+                return function () {
+                    if (start >= toolPath.length)
+                        return null;
+                    start += TOOLPATH_CHUNK_SIZE;
+                    return toolPath.slice(start - TOOLPATH_CHUNK_SIZE, start);
+                };
+            }
+
+            // the G-code is parsed a range of lines at a time, when the previous chunk is planned
+            function convertEvent(event) {
+                var typeConverter = {
+                    gcode: function (data) {
+                        var params = data.parameters;
+                        var evaluator = parser.createEvaluator(data.program, params.maxFeedrate, params.maxFeedrate,
+                            params.position);
+                        return function () {
+                            return evaluator.isDone() ? null : evaluator.evaluateLines(TOOLPATH_CHUNK_SIZE);
+                        };
+                    },
+                    toolPath: function (data) {
+                        return sliceToolPath(data.toolPath);
+                    },
+                    compactToolPath: function (data) {
+                        var fragments = data.toolPath;
+                        var travelBits = [];
+                        var position;
+                        var travelFeedrate = data.parameters.maxFeedrate;
+
+                        function travelTo(point, speedTag, feedrate, operation) {
+                            if (position)
+                                travelBits.push({
+                                    type: 'line',
+                                    from: position,
+                                    to: point,
+                                    speedTag: speedTag,
+                                    feedRate: speedTag == 'rapid' ? travelFeedrate : feedrate,
+                                    operation: operation
+                                });
+                            position = point;
+                        }
+
+                        for (var i = 0; i < fragments.length; i++) {
+                            var fragment = fragments[i];
+                            for (var j = 0; j < fragment.path.length; j += 3) {
+                                var point = new util.Point(fragment.path[j], fragment.path[j + 1], fragment.path[j + 2]);
+                                travelTo(point, fragment.speedTag, fragment.feedRate, fragment.operation);
+                            }
+                        }
+                        return sliceToolPath(travelBits);
+                    }
+                };
+                toolPathSource = {
+                    nextChunk: typeConverter[event.data.type](event.data),
+                    parameters: event.data.parameters,
+                    hasMore: event.data['hasMore']
+                };
+            }
+
+            // null when the events received so far are planned, the program is finished after the last one
+            function nextToolPathChunk() {
+                while (toolPathSource != null || pendingEvents.length) {
+                    if (toolPathSource == null)
+                        convertEvent(pendingEvents.shift());
+                    var chunk = toolPathSource.nextChunk();
+                    if (chunk == null) {
+                        var hasMore = toolPathSource.hasMore;
+                        toolPathSource = null;
+                        if (!hasMore) {
+                            finishProgram();
+                            return null;
+                        }
+                    } else if (chunk.length) {
+                        chunk.parameters = toolPathSource.parameters;
+                        return chunk;
+                    }
+                }
+                return null;
+            }
 
             function createProgramEncoder(maximumInstructionsCount) {
                 var HEADER_LENGTH = 8;
-                var programID = 1;
                 var operationsForProgram = {};
                 var buffer = new ArrayBuffer(maximumInstructionsCount * 3 + HEADER_LENGTH);
                 return {
@@ -197,6 +262,7 @@ var tasks = {
                         ++this.instructionsCount;
                     },
                     popEncodedProgram: function () {
+                        var programID = nextProgramID++;
                         // program type goes to first byte.
                         this.view.setUint8(0, PROGRAM_TYPES.PROGRAM_STEPS, true);
                         // We send the *size in bytes* of the program, header excluded on a 3 bytes numbers starting after one byte.
@@ -211,39 +277,203 @@ var tasks = {
                             operations: Object.keys(operationsForProgram)
                         };
                         operationsForProgram = {};
-                        programID++;
                         return result;
                     }
                 };
             }
 
-            function consumePendingToolPathsChunks() {
-                while (pendingToolPathChunks.length > 0 && sentToRunnerProgramsCount - sentToUSBProgramsCount < MAX_QUEUED_PROGRAMS) {
-                    var toolPathChunk = pendingToolPathChunks.shift();
-                    var params = toolPathChunk.parameters;
-                    simulation.planProgram(toolPathChunk, params.maxAcceleration, 1 / params.stepsPerMillimeter, params.clockFrequency,
-                        function stepCollector(dx, dy, dz, time, segment) {
-                            programEncoder.pushInstruction(dx, dy, dz, time, segment);
-                            if (programEncoder.isFull()) {
-                                outputPort.postMessage(programEncoder.popEncodedProgram());
-                                sentToRunnerProgramsCount++;
-                            }
-                        });
+            function createCompressedProgramEncoder(maximumProgramBytes) {
+                var HEADER_LENGTH = 8;
+                // axes byte and 2 varints of 5 bytes
+                var MAX_RECORD_LENGTH = 11;
+                var DURATION_FLAG = 0x40;
+                var REPEAT_FLAG = 0x80;
+                var operationsForProgram = {};
+                var buffer = new ArrayBuffer(HEADER_LENGTH + maximumProgramBytes + MAX_RECORD_LENGTH);
+                var view = new DataView(buffer);
+                var length = HEADER_LENGTH;
+                var previousDuration = 0;
+                // the last step is kept until a different one comes, to count the repetitions
+                var pending = null;
+
+                function writeVarint(value) {
+                    while (value > 0x7F) {
+                        view.setUint8(length++, value % 128 + 0x80);
+                        value = Math.floor(value / 128);
+                    }
+                    view.setUint8(length++, value);
+                }
+
+                function flushPending() {
+                    var delta = pending.duration - previousDuration;
+                    var word = pending.axes | (delta ? DURATION_FLAG : 0) | (pending.count > 1 ? REPEAT_FLAG : 0);
+                    view.setUint8(length++, word);
+                    if (delta)
+                        writeVarint(delta >= 0 ? delta * 2 : -delta * 2 - 1);
+                    if (pending.count > 1)
+                        writeVarint(pending.count);
+                    previousDuration = pending.duration;
+                    pending = null;
+                }
+
+                return {
+                    isFull: function () {
+                        return length - HEADER_LENGTH + MAX_RECORD_LENGTH > maximumProgramBytes;
+                    },
+                    isNotEmpty: function () {
+                        return pending != null || length != HEADER_LENGTH;
+                    },
+                    pushInstruction: function (dx, dy, dz, time, segment) {
+                        function bin(axis) {
+                            var direction = axis >= 0 ? '1' : '0';
+                            var enableStep = axis ? '1' : '0';
+                            return direction + enableStep;
+                        }
 
-                    if (toolPathChunk.isLast) {
-                        if (programEncoder.isNotEmpty()) {
-                            outputPort.postMessage(programEncoder.popEncodedProgram());
-                            sentToRunnerProgramsCount++;
+                        if (segment.operation)
+                            operationsForProgram[segment.operation] = 1;
+                        // the firmware cuts the long durations in timer periods
+                        var duration = Math.min(0x7FFFFFFF, Math.floor(time));
+                        var axes = parseInt('00' + bin(dz) + bin(dy) + bin(dx), 2);
+                        if (pending && pending.axes == axes && pending.duration == duration && pending.count < 0x7FFFFFFF) {
+                            pending.count++;
+                            return;
                         }
-                        if (stopSpindleAfter)
-                            outputPort.postMessage(createSingleFlagProgram(PROGRAM_TYPES.PROGRAM_STOP_SPINDLE));
-                        if (stopSocketAfter)
-                            outputPort.postMessage(createSingleFlagProgram(PROGRAM_TYPES.PROGRAM_STOP_SOCKET));
-                        outputPort.postMessage({program: null});
-                        stopSpindleAfter = false;
-                        stopSocketAfter = false;
-                        outputPort.close();
-                        inputPort.close();
+                        if (pending)
+                            flushPending();
+                        pending = {axes: axes, duration: duration, count: 1};
+                    },
+                    popEncodedProgram: function () {
+                        var programID = nextProgramID++;
+                        if (pending)
+                            flushPending();
+                        view.setUint8(0, PROGRAM_TYPES.PROGRAM_COMPRESSED_STEPS, true);
+                        // size in bytes on 24 bits, squished by the program ID
+                        view.setUint32(1, length - HEADER_LENGTH, true);
+                        view.setUint32(4, programID, true);
+                        var encodedProgram = buffer.slice(0, length);
+                        length = HEADER_LENGTH;
+                        // every program starts from a zero duration in the firmware
+                        previousDuration = 0;
+                        var result = {
+                            program: encodedProgram,
+                            programID: programID,
+                            operations: Object.keys(operationsForProgram)
+                        };
+                        operationsForProgram = {};
+                        return result;
+                    }
+                };
+            }
+
+            function createSegmentProgramEncoder(maximumProgramBytes) {
+                var HEADER_LENGTH = 8;
+                // 3 int32 steps and 4 float32, see planner.c:readSegment()
+                var RECORD_LENGTH = 28;
+                var operationsForProgram = {};
+                var buffer = new ArrayBuffer(HEADER_LENGTH + maximumProgramBytes);
+                var view = new DataView(buffer);
+                var length = HEADER_LENGTH;
+                return {
+                    isFull: function () {
+                        return length - HEADER_LENGTH + RECORD_LENGTH > maximumProgramBytes;
+                    },
+                    isNotEmpty: function () {
+                        return length != HEADER_LENGTH;
+                    },
+                    pushSegment: function (dx, dy, dz, entrySpeed, cruiseSpeed, exitSpeed, acceleration, segment) {
+                        if (segment.operation)
+                            operationsForProgram[segment.operation] = 1;
+                        view.setInt32(length, dx, true);
+                        view.setInt32(length + 4, dy, true);
+                        view.setInt32(length + 8, dz, true);
+                        view.setFloat32(length + 12, entrySpeed, true);
+                        view.setFloat32(length + 16, cruiseSpeed, true);
+                        view.setFloat32(length + 20, exitSpeed, true);
+                        view.setFloat32(length + 24, acceleration, true);
+                        length += RECORD_LENGTH;
+                    },
+                    popEncodedProgram: function () {
+                        var programID = nextProgramID++;
+                        view.setUint8(0, PROGRAM_TYPES.PROGRAM_SEGMENTS, true);
+                        // size in bytes on 24 bits, squished by the program ID
+                        view.setUint32(1, length - HEADER_LENGTH, true);
+                        view.setUint32(4, programID, true);
+                        var encodedProgram = buffer.slice(0, length);
+                        length = HEADER_LENGTH;
+                        var result = {
+                            program: encodedProgram,
+                            programID: programID,
+                            operations: Object.keys(operationsForProgram)
+                        };
+                        operationsForProgram = {};
+                        return result;
+                    }
+                };
+            }
+
+            function postProgram(program, seconds) {
+                var bytes = program.program.byteLength;
+                queuedPrograms.push({bytes: bytes, seconds: seconds});
+                queuedBytes += bytes;
+                queuedSeconds += seconds;
+                outputPort.postMessage(program);
+            }
+
+            function flushEncoder(encoder) {
+                if (encoder.isNotEmpty()) {
+                    postProgram(encoder.popEncodedProgram(), encodedSeconds);
+                    encodedSeconds = 0;
+                }
+            }
+
+            function stepCollector(dx, dy, dz, time, segment) {
+                // the programs are run in order, the segments before those steps go first
+                flushEncoder(segmentEncoder);
+                encodedSeconds += time / plannedChunk.parameters.clockFrequency;
+                programEncoder.pushInstruction(dx, dy, dz, time, segment);
+                if (programEncoder.isFull())
+                    flushEncoder(programEncoder);
+            }
+
+            function segmentCollector(dx, dy, dz, entrySpeed, cruiseSpeed, exitSpeed, acceleration, segment) {
+                flushEncoder(programEncoder);
+                encodedSeconds += segment.duration;
+                segmentEncoder.pushSegment(dx, dy, dz, entrySpeed, cruiseSpeed, exitSpeed, acceleration, segment);
+                if (segmentEncoder.isFull())
+                    flushEncoder(segmentEncoder);
+            }
+
+            function finishProgram() {
+                flushEncoder(programEncoder);
+                flushEncoder(segmentEncoder);
+                if (stopSpindleAfter)
+                    postProgram(createSingleFlagProgram(PROGRAM_TYPES.PROGRAM_STOP_SPINDLE), 0);
+                if (stopSocketAfter)
+                    postProgram(createSingleFlagProgram(PROGRAM_TYPES.PROGRAM_STOP_SOCKET), 0);
+                outputPort.postMessage({program: null});
+                stopSpindleAfter = false;
+                stopSocketAfter = false;
+                finished = true;
+                outputPort.close();
+                inputPort.close();
+            }
+
+            // the steps are planned a component at a time, only while the runner is short of them,
+            // so that the memory stays flat whatever the length of the job; a component can go past the lookahead
+            function planUntilLookahead() {
+                while (!finished && queuedBytes < lookahead.bytes && queuedSeconds < lookahead.seconds) {
+                    if (planner == null) {
+                        plannedChunk = nextToolPathChunk();
+                        if (plannedChunk == null)
+                            return;
+                        var params = plannedChunk.parameters;
+                        planner = simulation.createProgramPlanner(plannedChunk, params.axes, params.clockFrequency,
+                            stepCollector, LINEAR_SEGMENTS ? segmentCollector : null);
+                    }
+                    if (!planner.planNext()) {
+                        planner = null;
+                        plannedChunk = null;
                     }
                 }
             }